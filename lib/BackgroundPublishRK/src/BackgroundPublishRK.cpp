@@ -50,62 +50,106 @@ void BackgroundPublishRK::stop()
     }
 }
 
-void BackgroundPublishRK::thread_f()
+void BackgroundPublishRK::setMaxInFlight(size_t count)
 {
-    while(true)
+    maxInFlight = constrain(count, (size_t)1, MAX_IN_FLIGHT);
+}
+
+bool BackgroundPublishRK::canPublish()
+{
+    if(!thread)
+    {
+        return false;
+    }
+
+    WITH_LOCK(*this)
     {
-        while(state == BACKGROUND_PUBLISH_IDLE)
+        return getIdleSlot() != NULL;
+    }
+    return false;
+}
+
+BackgroundPublishSlot *BackgroundPublishRK::getIdleSlot()
+{
+    for(size_t ii = 0; ii < maxInFlight; ii++)
+    {
+        if(!slots[ii])
         {
-            // yield to rest of system while we wait
-            // a condition variable would be ideal but doesn't look like
-            // std::condition_variable is supported
-            delay(1);
+            slots[ii] = new BackgroundPublishSlot();
         }
+        if(slots[ii] && slots[ii]->state == BACKGROUND_PUBLISH_IDLE)
+        {
+            return slots[ii];
+        }
+    }
+    return NULL;
+}
+
+void BackgroundPublishRK::thread_f()
+{
+    while(true)
+    {
+        // yield to rest of system while we wait
+        // a condition variable would be ideal but doesn't look like
+        // std::condition_variable is supported
+        delay(1);
 
         if(state == BACKGROUND_PUBLISH_STOP)
         {
             return;
         }
 
-        // temporarily acquire the lock
-        // this allows a calling thread to block the publish thread if it needs
-        // additional synchronization around a publish request and acts as a
-        // memory barrier around publish arguments to ensure all updates
-        // are complete
-        lock();
-        unlock();
-
-        // kick off the publish
-        // WITH_ACK does not work as expected from a background thread
-        // use the Future<bool> object directly as its default wait
-        // (used by WITH_ACK) short-circuits when not called from the
-        // main application thread
-        auto ok = Particle.publish(event_name, event_data, event_flags);
-
-        // then wait for publish to complete
-        while(!ok.isDone() && state != BACKGROUND_PUBLISH_STOP)
+        for(size_t ii = 0; ii < MAX_IN_FLIGHT; ii++)
         {
-            // yield to rest of system while we wait
-            delay(1);
-        }
+            BackgroundPublishSlot *slot = slots[ii];
+            if(!slot || slot->state == BACKGROUND_PUBLISH_IDLE)
+            {
+                continue;
+            }
 
-        if(completed_cb)
-        {
-            completed_cb(ok.isSucceeded(),
-                event_name,
-                event_data,
-                event_context);
-        }
+            if(slot->state == BACKGROUND_PUBLISH_REQUESTED)
+            {
+                // temporarily acquire the lock
+                // this allows a calling thread to block the publish thread if it needs
+                // additional synchronization around a publish request and acts as a
+                // memory barrier around publish arguments to ensure all updates
+                // are complete
+                lock();
+                unlock();
+
+                // kick off the publish
+                // WITH_ACK does not work as expected from a background thread
+                // use the Future<bool> object directly as its default wait
+                // (used by WITH_ACK) short-circuits when not called from the
+                // main application thread
+                slot->result = Particle.publish(slot->event_name, slot->event_data, slot->event_flags);
+                slot->state = BACKGROUND_PUBLISH_PENDING;
+            }
 
-        WITH_LOCK(*this)
-        {
-            if(state == BACKGROUND_PUBLISH_STOP)
+            // then wait for publish to complete, while checking the other slots
+            if(!slot->result.isDone())
             {
-                return;
+                continue;
+            }
+
+            if(slot->completed_cb)
+            {
+                slot->completed_cb(slot->result.isSucceeded(),
+                    slot->event_name,
+                    slot->event_data,
+                    slot->event_context);
+            }
+
+            WITH_LOCK(*this)
+            {
+                if(state == BACKGROUND_PUBLISH_STOP)
+                {
+                    return;
+                }
+                slot->event_context = NULL;
+                slot->completed_cb = NULL;
+                slot->state = BACKGROUND_PUBLISH_IDLE;
             }
-            event_context = NULL;
-            completed_cb = NULL;
-            state = BACKGROUND_PUBLISH_IDLE;
         }
     }
 }
@@ -115,7 +159,7 @@ bool BackgroundPublishRK::publish(const char *name, const char *data, PublishFla
     // protect against separate threads trying to publish at the same time
     WITH_LOCK(*this)
 
-    // check currently in idle state and ready to accept publish request
+    // check thread is running and a slot is ready to accept publish request
     if(!thread || state != BACKGROUND_PUBLISH_IDLE)
     {
         return false;
@@ -128,25 +172,31 @@ bool BackgroundPublishRK::publish(const char *name, const char *data, PublishFla
         return false;
     }
 
-    // have the lock and thread is currently idle
+    BackgroundPublishSlot *slot = getIdleSlot();
+    if(!slot)
+    {
+        return false;
+    }
+
+    // have the lock and slot is currently idle
     // safe to prepare publish request
-    strncpy(event_name, name, sizeof(event_name));
-    event_name[sizeof(event_name)-1] = '\0'; // ensure null termination
+    strncpy(slot->event_name, name, sizeof(slot->event_name));
+    slot->event_name[sizeof(slot->event_name)-1] = '\0'; // ensure null termination
 
     if(data)
     {
-        strncpy(event_data, data, sizeof(event_data));
-        event_data[sizeof(event_data)-1] = '\0'; // ensure null termination
+        strncpy(slot->event_data, data, sizeof(slot->event_data));
+        slot->event_data[sizeof(slot->event_data)-1] = '\0'; // ensure null termination
     }
     else
     {
-        event_data[0] = '\0'; // null terminate at start for no event data
+        slot->event_data[0] = '\0'; // null terminate at start for no event data
     }
 
-    completed_cb = cb;
-    event_context = context;
-    event_flags = flags;
-    state = BACKGROUND_PUBLISH_REQUESTED;
+    slot->completed_cb = cb;
+    slot->event_context = context;
+    slot->event_flags = flags;
+    slot->state = BACKGROUND_PUBLISH_REQUESTED;
 
     return true;
 }
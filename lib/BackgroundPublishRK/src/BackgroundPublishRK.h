@@ -14,6 +14,7 @@ typedef enum {
     BACKGROUND_PUBLISH_IDLE = 0,	//!< Not currently publishing
     BACKGROUND_PUBLISH_REQUESTED,	//!< Publish started
     BACKGROUND_PUBLISH_STOP,		//!< Thread stopped (need to start again to publish)
+    BACKGROUND_PUBLISH_PENDING,		//!< Particle.publish called, waiting for it to complete (slot state only)
 } publish_thread_state_t;
 
 /**
@@ -35,6 +36,23 @@ typedef std::function<void(bool succeeded,
     const char *event_data,
     const void *event_context)> PublishCompletedCallback;
 
+/**
+ * @brief One publish request. There is one of these for each publish that can be in flight at the same time.
+ */
+struct BackgroundPublishSlot {
+    volatile publish_thread_state_t state = BACKGROUND_PUBLISH_IDLE; //!< IDLE, REQUESTED, or PENDING
+
+    // arguments for Particle.publish
+    char event_name[particle::protocol::MAX_EVENT_NAME_LENGTH+1];	//!< name passed to publish
+    char event_data[particle::protocol::MAX_EVENT_DATA_LENGTH+1];	//!< event data passed to publish (may be empty string)
+    PublishFlags event_flags; 	//!< event flags, typically PRIVATE, PRIVATE | WITH_ACK, or PRIVATE | NO_ACK.
+    // callback when publish completes
+    PublishCompletedCallback completed_cb = NULL; 	//!< Completion callback (optional)
+    const void *event_context = NULL; 		//!< Context passed to completion (optional)
+
+    particle::Future<bool> result = particle::Future<bool>(particle::Error::INVALID_STATE); //!< Result of Particle.publish, valid in PENDING state
+};
+
 /**
  * @brief Background publish class. You typically instantiate one of these as a global variable.
  */
@@ -69,6 +87,33 @@ public:
      */
     void stop();
 
+    /**
+     * @brief Sets the number of publishes that can be in progress at the same time (default: 1)
+     *
+     * @param count The number of publishes, 1 to MAX_IN_FLIGHT
+     *
+     * With more than one, publish() can be called again before the previous publish completes,
+     * so the cloud round trip time of several events overlaps. The completion callbacks may be
+     * called in a different order than the events were published. Each additional publish uses
+     * about 1.1K of RAM, allocated the first time it's used.
+     */
+    void setMaxInFlight(size_t count);
+
+    /**
+     * @brief Gets the number of publishes that can be in progress at the same time
+     */
+    size_t getMaxInFlight() const { return maxInFlight; };
+
+    /**
+     * @brief Returns true if publish() can accept another publish now
+     */
+    bool canPublish();
+
+    /**
+     * @brief Maximum value for setMaxInFlight()
+     */
+    static const size_t MAX_IN_FLIGHT = 4;
+
     /**
      * @brief Publish method. Use this instead of Particle.publish().
      *
@@ -130,18 +175,20 @@ private:
     BackgroundPublishRK& operator=(const BackgroundPublishRK&) = delete;
 
 
+    /**
+     * @brief Gets an idle slot, allocating it if necessary. Must be called with the mutex locked.
+     *
+     * @return The slot, or NULL if maxInFlight publishes are already in progress
+     */
+    BackgroundPublishSlot *getIdleSlot();
+
     Thread *thread = NULL;		//!< Thread object pointer. Allocated during start()
     void thread_f();			//!< Thread function, passed to the Thread object
     os_mutex_t mutex;	//!< Mutex to protect access to class members from multiple threads
-    volatile publish_thread_state_t state = BACKGROUND_PUBLISH_IDLE; //!< Current state
+    volatile publish_thread_state_t state = BACKGROUND_PUBLISH_IDLE; //!< Current state, IDLE or STOP
 
-    // arguments for Particle.publish
-    char event_name[particle::protocol::MAX_EVENT_NAME_LENGTH+1];	//!< name passed to publish
-    char event_data[particle::protocol::MAX_EVENT_DATA_LENGTH+1];	//!< event data passed to publish (may be empty string)
-    PublishFlags event_flags; 	//!< event flags, typically PRIVATE, PRIVATE | WITH_ACK, or PRIVATE | NO_ACK.
-    // callback when publish completes
-    PublishCompletedCallback completed_cb = NULL; 	//!< Completion callback (optional)
-    const void *event_context = NULL; 		//!< Context passed to completion (optional)
+    BackgroundPublishSlot *slots[MAX_IN_FLIGHT] = {0}; //!< Publish requests, allocated when first used and never freed
+    size_t maxInFlight = 1; //!< Number of slots that can be used
 
     static BackgroundPublishRK *_instance; //!< Singleton instance of this class
 };
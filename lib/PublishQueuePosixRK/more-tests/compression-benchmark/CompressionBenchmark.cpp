@@ -0,0 +1,117 @@
+// Host benchmark for PublishQueueLZSS. See README.md in this directory.
+//
+// Build and run from this directory:
+//   g++ -O2 -std=c++11 -I../../src CompressionBenchmark.cpp ../../src/PublishQueueLZSS.cpp -o CompressionBenchmark && ./CompressionBenchmark
+
+#include "PublishQueueLZSS.h"
+
+#include <chrono>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// Same layout as PublishQueueEvent, which can't be used here because it needs Particle.h
+struct BenchEvent {
+    uint32_t flags;
+    char eventName[65];
+    char eventData[1];
+};
+
+// Sizes from PublishQueueRecordHeader, the commit marker, and the uncompressed size in a compressed record
+static const size_t RECORD_OVERHEAD = 24 + 4;
+static const size_t COMPRESSED_OVERHEAD = 2;
+
+static std::vector<uint8_t> makeEvent(const char *eventName, const std::string &eventData) {
+    std::vector<uint8_t> result(offsetof(BenchEvent, eventData) + eventData.length() + 1, 0);
+    BenchEvent *event = (BenchEvent *)result.data();
+    strncpy(event->eventName, eventName, sizeof(event->eventName) - 1);
+    memcpy(event->eventData, eventData.c_str(), eventData.length());
+    return result;
+}
+
+// Same JSON as SensorData::toJSON() in the application
+static std::string sensorData(int ii) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "{\"sensorType\":\"GestureFace\",\"timestamp\":%d,\"gesturetype\":%d,\"gesturescore\":%d,\"facenumber\":%d,\"facescore\":%d}",
+        1760000000 + ii * 37 + rand() % 30, 1 + rand() % 8, rand() % 100, rand() % 4, rand() % 100);
+    return buf;
+}
+
+static void run(const char *label, const std::vector<std::vector<uint8_t>> &events, const std::vector<uint8_t> &dict, int iterations) {
+    const uint8_t *dictData = dict.empty() ? NULL : dict.data();
+
+    size_t rawBytes = 0;
+    size_t packedBytes = 0;
+    size_t rawRecordBytes = 0;
+    size_t packedRecordBytes = 0;
+
+    std::vector<std::vector<uint8_t>> packed(events.size());
+    for(size_t ii = 0; ii < events.size(); ii++) {
+        const std::vector<uint8_t> &event = events[ii];
+        packed[ii].resize(event.size());
+
+        // Stored compressed only if that's smaller, as in the file queue
+        size_t len = PublishQueueLZSS::compress(event.data(), event.size(), packed[ii].data(), event.size() - COMPRESSED_OVERHEAD - 1, dictData, dict.size());
+        packed[ii].resize(len);
+
+        std::vector<uint8_t> check(event.size());
+        if (len && (PublishQueueLZSS::decompress(packed[ii].data(), len, check.data(), check.size(), dictData, dict.size()) != event.size() || check != event)) {
+            printf("%s: event %u did not decompress correctly\n", label, (unsigned)ii);
+            exit(1);
+        }
+
+        rawBytes += event.size();
+        packedBytes += len ? len + COMPRESSED_OVERHEAD : event.size();
+        rawRecordBytes += RECORD_OVERHEAD + event.size();
+        packedRecordBytes += RECORD_OVERHEAD + (len ? len + COMPRESSED_OVERHEAD : event.size());
+    }
+
+    std::vector<uint8_t> buf(1024);
+
+    auto start = std::chrono::steady_clock::now();
+    for(int iter = 0; iter < iterations; iter++) {
+        for(const std::vector<uint8_t> &event : events) {
+            PublishQueueLZSS::compress(event.data(), event.size(), buf.data(), buf.size(), dictData, dict.size());
+        }
+    }
+    double compressSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    for(int iter = 0; iter < iterations; iter++) {
+        for(size_t ii = 0; ii < events.size(); ii++) {
+            if (!packed[ii].empty()) {
+                PublishQueueLZSS::decompress(packed[ii].data(), packed[ii].size(), buf.data(), events[ii].size(), dictData, dict.size());
+            }
+        }
+    }
+    double decompressSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    double mb = (double)rawBytes * iterations / 1e6;
+    printf("%-22s events %6u -> %6u bytes (%.2f)  records %6u -> %6u bytes (%.2f)  compress %6.1f MB/s  decompress %7.1f MB/s\n",
+        label, (unsigned)rawBytes, (unsigned)packedBytes, (double)packedBytes / rawBytes,
+        (unsigned)rawRecordBytes, (unsigned)packedRecordBytes, (double)packedRecordBytes / rawRecordBytes,
+        mb / compressSec, mb / decompressSec);
+}
+
+int main(int argc, char *argv[]) {
+    const int numEvents = 1000;
+    const int iterations = (argc > 1) ? atoi(argv[1]) : 20;
+
+    srand(1);
+
+    std::vector<std::vector<uint8_t>> events;
+    for(int ii = 0; ii < numEvents; ii++) {
+        events.push_back(makeEvent("sensor-data", sensorData(ii)));
+    }
+
+    // What PublishQueuePosix::withCompressionDictionary() builds from a sample event
+    std::vector<uint8_t> dict = makeEvent("sensor-data", sensorData(0));
+
+    run("sensor-data", events, std::vector<uint8_t>(), iterations);
+    run("sensor-data + dict", events, dict, iterations);
+
+    return 0;
+}
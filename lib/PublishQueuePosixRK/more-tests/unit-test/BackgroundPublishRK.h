@@ -0,0 +1,75 @@
+// Stand-in for the BackgroundPublishRK library for the PublishQueuePosixRK unit tests.
+// publish() only saves the request; the test completes it with complete().
+#ifndef __BACKGROUNDPUBLISHRK_H
+#define __BACKGROUNDPUBLISHRK_H
+
+#include "Particle.h"
+
+#include <deque>
+#include <functional>
+
+typedef std::function<void(bool succeeded,
+    const char *event_name,
+    const char *event_data,
+    const void *event_context)> PublishCompletedCallback;
+
+class BackgroundPublishRK
+{
+public:
+    static BackgroundPublishRK &instance() {
+        static BackgroundPublishRK _instance;
+        return _instance;
+    }
+
+    void start() {}
+
+    void setMaxInFlight(size_t count) { maxInFlight = (count < 1) ? 1 : ((count > MAX_IN_FLIGHT) ? MAX_IN_FLIGHT : count); };
+
+    size_t getMaxInFlight() const { return maxInFlight; };
+
+    static const size_t MAX_IN_FLIGHT = 4;
+
+    bool publish(const char *name,
+        const char *data = NULL,
+        PublishFlags /*flags*/ = PRIVATE,
+        PublishCompletedCallback cb = NULL,
+        const void *context = NULL) {
+        if (pending.size() >= maxInFlight) {
+            return false;
+        }
+        Request req;
+        req.name = name;
+        req.data = data ? data : "";
+        req.cb = cb;
+        req.context = context;
+        pending.push_back(req);
+        return true;
+    }
+
+    /**
+     * @brief Completes the oldest publish request. Returns false if there isn't one.
+     */
+    bool complete(bool succeeded) {
+        if (pending.empty()) {
+            return false;
+        }
+        Request req = pending.front();
+        pending.pop_front();
+        if (req.cb) {
+            req.cb(succeeded, req.name.c_str(), req.data.c_str(), req.context);
+        }
+        return true;
+    }
+
+    struct Request {
+        String name;
+        String data;
+        PublishCompletedCallback cb;
+        const void *context;
+    };
+    std::deque<Request> pending;
+
+    size_t maxInFlight = 1;
+};
+
+#endif /* __BACKGROUNDPUBLISHRK_H */
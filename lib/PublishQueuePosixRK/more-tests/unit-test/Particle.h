@@ -0,0 +1,55 @@
+// Additions to the UnitTestLib Particle.h (in StorageHelperRK/automated-test/UnitTestLib)
+// for compiling PublishQueuePosixRK and SequentialFileRK with gcc on a computer. This
+// directory is first in the include path, so the libraries get this file, which adds to 
+// the next Particle.h in the include path.
+#ifndef __UNITTESTPARTICLE_H
+#define __UNITTESTPARTICLE_H
+
+#include_next "Particle.h"
+
+#include <functional>
+
+// concurrent_hal.h. The tests are single threaded.
+typedef void *os_mutex_t;
+typedef void *os_mutex_recursive_t;
+
+inline int os_mutex_create(os_mutex_t *mutex) { *mutex = 0; return 0; }
+inline int os_mutex_lock(os_mutex_t /*mutex*/) { return 0; }
+inline int os_mutex_unlock(os_mutex_t /*mutex*/) { return 0; }
+
+inline int os_mutex_recursive_create(os_mutex_recursive_t *mutex) { *mutex = 0; return 0; }
+inline int os_mutex_recursive_lock(os_mutex_recursive_t /*mutex*/) { return 0; }
+inline bool os_mutex_recursive_trylock(os_mutex_recursive_t /*mutex*/) { return true; }
+inline int os_mutex_recursive_unlock(os_mutex_recursive_t /*mutex*/) { return 0; }
+
+// system_threading.h
+namespace spark { namespace feature {
+    enum State { DISABLED, ENABLED };
+}}
+inline spark::feature::State system_thread_get_state(void *) { return spark::feature::ENABLED; }
+
+// system_event.h
+typedef uint64_t system_event_t;
+const system_event_t cloud_status = 1 << 6;
+const system_event_t reset = 1 << 10;
+const int cloud_status_disconnecting = 3;
+
+class SystemClass {
+public:
+    bool on(system_event_t /*events*/, void (*)(system_event_t, int)) { return true; }
+};
+extern SystemClass System;
+
+// spark_wiring_cloud.h. Set connected to simulate being cloud connected or not.
+class CloudClass {
+public:
+    bool connected() const { return isConnected; }
+
+    template<typename T>
+    bool variable(const char * /*name*/, T /*fn*/) { return true; }
+
+    bool isConnected = false;
+};
+extern CloudClass Particle;
+
+#endif /* __UNITTESTPARTICLE_H */
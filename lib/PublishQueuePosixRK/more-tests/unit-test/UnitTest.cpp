@@ -0,0 +1,525 @@
+// Host unit tests for the PublishQueuePosixRK file queue. See README.md in this directory.
+
+#include "PublishQueuePosixRK.h"
+#include "BackgroundPublishRK.h"
+
+#include <signal.h>
+#include <sys/resource.h>
+#include <vector>
+
+SystemClass System;
+CloudClass Particle;
+
+#define assertInt(msg, got, expected) _assertInt(msg, got, expected, __LINE__)
+void _assertInt(const char *msg, int got, int expected, int line) {
+	if (expected != got) {
+		printf("assertion failed %s line %d\n", msg, line);
+		printf("expected: %d\n", expected);
+		printf("     got: %d\n", got);
+		assert(false);
+	}
+}
+
+#define assertStr(msg, got, expected) _assertStr(msg, got, expected, __LINE__)
+void _assertStr(const char *msg, const char *got, const char *expected, int line) {
+	if (strcmp(expected, got) != 0) {
+		printf("assertion failed %s line %d\n", msg, line);
+		printf("expected: %s\n", expected);
+		printf("     got: %s\n", got);
+		assert(false);
+	}
+}
+
+// Directory for the PRIORITY_NORMAL queue; the other priority classes add -alert and -bulk
+const char *queueDirPath = "./temp-pubq";
+
+// Makes the protected parts of PublishQueuePosix available to the tests, and publishes
+// without the delays that are used on a device
+class TestQueue : public PublishQueuePosix {
+public:
+	TestQueue() {
+		waitAfterConnect = 0;
+		withPublishRateLimit(0, 1);
+		withDirPath(queueDirPath);
+	}
+
+	String getSegmentPath(int fileNum) {
+		return fileQueue[PRIORITY_NORMAL].getPathForFileNum(fileNum);
+	}
+
+	String getCursorPath() {
+		return String(fileQueue[PRIORITY_NORMAL].getDirPath()) + "/" + CURSOR_FILENAME;
+	}
+
+	size_t getKeyedRecordCount() const {
+		return fileState[PRIORITY_NORMAL].keyedRecords.size();
+	}
+
+	using PublishQueuePosix::crc32;
+	using PublishQueuePosix::stats;
+};
+
+void removeQueueDirs() {
+	system("rm -rf ./temp-pubq ./temp-pubq-alert ./temp-pubq-bulk");
+}
+
+// Size of a record in a segment file for an uncompressed event
+size_t recordSize(const char *eventData) {
+	return sizeof(PublishQueueRecordHeader) + sizeof(PublishQueueEvent) + strlen(eventData) + sizeof(uint32_t);
+}
+
+off_t getFileSize(const char *path) {
+	struct stat sb;
+	if (stat(path, &sb) != 0) {
+		return -1;
+	}
+	return sb.st_size;
+}
+
+// Publishes count events, "event-00" to "event-NN", while not cloud connected, so they go to the file queue
+void publishEvents(TestQueue &queue, int first, int count) {
+	Particle.isConnected = false;
+	for(int ii = first; ii < first + count; ii++) {
+		char buf[24];
+		snprintf(buf, sizeof(buf), "event-%02d", ii);
+		queue.publish("test", buf, PRIVATE);
+	}
+}
+
+// Connects and publishes until the queue is empty, completing each publish successfully.
+// Returns the event data of the events that were published, in order.
+std::vector<String> drain(TestQueue &queue) {
+	BackgroundPublishRK &background = BackgroundPublishRK::instance();
+	std::vector<String> result;
+
+	Particle.isConnected = true;
+	for(int ii = 0; ii < 1000; ii++) {
+		queue.loop();
+
+		bool published = !background.pending.empty();
+		while(!background.pending.empty()) {
+			result.push_back(background.pending.front().data);
+			background.complete(true);
+		}
+		if (!published && queue.getNumEvents() == 0 && queue.getCanSleep()) {
+			break;
+		}
+	}
+	Particle.isConnected = false;
+
+	return result;
+}
+
+void assertEvents(const std::vector<String> &events, int first, int count, int line) {
+	_assertInt("number of events", (int)events.size(), count, line);
+	for(int ii = 0; ii < count; ii++) {
+		char buf[24];
+		snprintf(buf, sizeof(buf), "event-%02d", first + ii);
+		_assertStr("event data", events[ii].c_str(), buf, line);
+	}
+}
+
+// Reads the record header at offset, changes it with fn, and writes it back with a new CRC
+void rewriteRecordHeader(TestQueue &queue, int fileNum, uint32_t offset, std::function<void(PublishQueueRecordHeader &rec)> fn) {
+	int fd = open(queue.getSegmentPath(fileNum), O_RDWR);
+	assert(fd >= 0);
+
+	PublishQueueRecordHeader rec;
+	assert(pread(fd, &rec, sizeof(rec), offset) == sizeof(rec));
+	fn(rec);
+	rec.crc = 0;
+	rec.crc = TestQueue::crc32(&rec, rec.headerSize);
+	assert(pwrite(fd, &rec, sizeof(rec), offset) == sizeof(rec));
+
+	close(fd);
+}
+
+// Changes the event name of the record at offset without updating the payload CRC, so the
+// record is counted as corrupted if its event is read
+void corruptRecordPayload(TestQueue &queue, int fileNum, uint32_t offset) {
+	int fd = open(queue.getSegmentPath(fileNum), O_RDWR);
+	assert(fd >= 0);
+
+	char c = '!';
+	assert(pwrite(fd, &c, 1, offset + sizeof(PublishQueueRecordHeader) + offsetof(PublishQueueEvent, eventName)) == 1);
+
+	close(fd);
+}
+
+void writeCursor(TestQueue &queue, int fileNum, uint32_t offset, uint32_t index, bool validCrc = true) {
+	PublishQueueCursor cursor;
+	cursor.magic = PublishQueuePosix::CURSOR_MAGIC;
+	cursor.fileNum = fileNum;
+	cursor.offset = offset;
+	cursor.index = index;
+	cursor.crc = TestQueue::crc32(&cursor, offsetof(PublishQueueCursor, crc));
+	if (!validCrc) {
+		cursor.crc ^= 1;
+	}
+
+	int fd = open(queue.getCursorPath(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+	assert(fd >= 0);
+	assert(write(fd, &cursor, sizeof(cursor)) == sizeof(cursor));
+	close(fd);
+}
+
+
+void tornTailTest() {
+	removeQueueDirs();
+
+	String segmentPath;
+	off_t segmentSize;
+	{
+		TestQueue queue;
+		queue.setup();
+		publishEvents(queue, 0, 3);
+		assertInt("", (int)queue.getNumEvents(), 3);
+
+		segmentPath = queue.getSegmentPath(1);
+		segmentSize = getFileSize(segmentPath);
+		assertInt("", (int)segmentSize, (int)(PublishQueuePosix::SEGMENT_DATA_OFFSET + 3 * recordSize("event-00")));
+	}
+
+	// Power lost while appending the fourth record: the header and part of the event were written,
+	// but not the rest of the event or the commit marker
+	{
+		uint8_t partial[sizeof(PublishQueueRecordHeader) + 20];
+		int fd = open(segmentPath, O_RDWR);
+		assert(fd >= 0);
+		assert(pread(fd, partial, sizeof(partial), PublishQueuePosix::SEGMENT_DATA_OFFSET) == sizeof(partial));
+		assert(pwrite(fd, partial, sizeof(partial), segmentSize) == sizeof(partial));
+		close(fd);
+	}
+
+	{
+		TestQueue queue;
+		queue.setup();
+
+		// The partial record is truncated and the complete records before it are kept
+		assertInt("", (int)getFileSize(segmentPath), (int)segmentSize);
+		assertInt("", (int)queue.getNumEvents(), 3);
+		assertInt("", (int)queue.stats.corrupted, 1);
+
+		// New records are appended where the partial record was
+		publishEvents(queue, 3, 1);
+		assertInt("", (int)getFileSize(segmentPath), (int)(segmentSize + recordSize("event-03")));
+
+		assertEvents(drain(queue), 0, 4, __LINE__);
+		assertInt("", (int)queue.stats.corrupted, 1);
+	}
+
+	// Power lost while writing the commit marker
+	{
+		TestQueue queue;
+		queue.setup();
+		publishEvents(queue, 0, 2);
+		segmentPath = queue.getSegmentPath(1);
+		segmentSize = getFileSize(segmentPath);
+	}
+	assert(truncate(segmentPath, segmentSize - 2) == 0);
+	{
+		TestQueue queue;
+		queue.setup();
+		assertInt("", (int)getFileSize(segmentPath), (int)(segmentSize - recordSize("event-01")));
+		assertEvents(drain(queue), 0, 1, __LINE__);
+	}
+
+	removeQueueDirs();
+}
+
+// Eight events: five in segment 1, which is sealed, and three in segment 2, which is not
+void writeTwoSegments() {
+	removeQueueDirs();
+
+	TestQueue queue;
+	queue.withSegmentSize(PublishQueuePosix::SEGMENT_DATA_OFFSET + 5 * recordSize("event-00"));
+	queue.setup();
+	publishEvents(queue, 0, 8);
+	assertInt("", (int)queue.getNumEvents(), 8);
+	assertInt("", (int)getFileSize(queue.getSegmentPath(2)), (int)(PublishQueuePosix::SEGMENT_DATA_OFFSET + 3 * recordSize("event-00")));
+}
+
+void cursorTest() {
+	const uint32_t size = recordSize("event-00");
+	const uint32_t first = PublishQueuePosix::SEGMENT_DATA_OFFSET;
+
+	// Valid cursor, two events consumed from the sealed segment
+	writeTwoSegments();
+	{
+		TestQueue queue;
+		writeCursor(queue, 1, first + 2 * size, 2);
+		queue.setup();
+		assertInt("", (int)queue.getNumEvents(), 6);
+		assertEvents(drain(queue), 2, 6, __LINE__);
+	}
+
+	// Offset is not the start of a record, or is past the end of the sealed segment:
+	// findRecordOffset() skips the number of consumed records instead
+	const uint32_t badOffsets[2] = { first + 2 * size + 3, first + 20 * size };
+	for(size_t ii = 0; ii < 2; ii++) {
+		writeTwoSegments();
+		{
+			TestQueue queue;
+			writeCursor(queue, 1, badOffsets[ii], 2);
+			queue.setup();
+			assertInt("", (int)queue.getNumEvents(), 6);
+			assertEvents(drain(queue), 2, 6, __LINE__);
+		}
+	}
+
+	// Offset is not the start of a record in the segment that was being appended to
+	writeTwoSegments();
+	{
+		TestQueue queue;
+		writeCursor(queue, 2, first + size + 3, 1);
+		queue.setup();
+		assertInt("", (int)queue.getNumEvents(), 2);
+		assertEvents(drain(queue), 6, 2, __LINE__);
+	}
+
+	// Cursor with a bad CRC is not used, so everything is sent again
+	writeTwoSegments();
+	{
+		TestQueue queue;
+		writeCursor(queue, 1, first + 2 * size, 2, false);
+		queue.setup();
+		assertInt("", (int)queue.getNumEvents(), 8);
+		assertEvents(drain(queue), 0, 8, __LINE__);
+	}
+
+	removeQueueDirs();
+}
+
+void version1Test() {
+	removeQueueDirs();
+
+	// Files written by versions of the library before segments: one event per file
+	{
+		TestQueue queue;
+		mkdir(queueDirPath, 0777);
+
+		for(int fileNum = 1; fileNum <= 3; fileNum++) {
+			char eventData[24];
+			snprintf(eventData, sizeof(eventData), "event-%02d", fileNum - 1);
+
+			PublishQueueFileHeader hdr = {};
+			hdr.magic = PublishQueuePosix::FILE_MAGIC;
+			hdr.version = 1;
+			hdr.headerSize = sizeof(PublishQueueFileHeader);
+			hdr.nameLen = sizeof(PublishQueueEvent::eventName);
+
+			std::vector<uint8_t> event(sizeof(PublishQueueEvent) + strlen(eventData), 0);
+			PublishQueueEvent *ev = (PublishQueueEvent *)event.data();
+			ev->flags = PRIVATE;
+			strcpy(ev->eventName, "test");
+			strcpy(ev->eventData, eventData);
+
+			int fd = open(queue.getSegmentPath(fileNum), O_RDWR | O_CREAT | O_TRUNC, 0666);
+			assert(fd >= 0);
+			assert(write(fd, &hdr, sizeof(hdr)) == sizeof(hdr));
+			assert(write(fd, event.data(), event.size()) == (int)event.size());
+			close(fd);
+		}
+	}
+
+	{
+		TestQueue queue;
+		queue.setup();
+		assertInt("", (int)queue.getNumEvents(), 3);
+
+		// New events go in a segment after the old files
+		publishEvents(queue, 3, 2);
+		assertInt("", (int)queue.getNumEvents(), 5);
+		assertInt("", (int)getFileSize(queue.getSegmentPath(4)), (int)(PublishQueuePosix::SEGMENT_DATA_OFFSET + 2 * recordSize("event-00")));
+
+		assertEvents(drain(queue), 0, 5, __LINE__);
+		assertInt("", (int)queue.stats.corrupted, 0);
+		assertInt("", (int)getFileSize(queue.getSegmentPath(1)), -1);
+	}
+
+	removeQueueDirs();
+}
+
+void skipTest() {
+	const uint32_t first = PublishQueuePosix::SEGMENT_DATA_OFFSET;
+
+	// A superseded record is skipped using its header; the event is not read
+	removeQueueDirs();
+	{
+		TestQueue queue;
+		queue.setup();
+
+		Particle.isConnected = false;
+		queue.publish("test", "old", PublishQueuePosix::PublishOptions().withSupersedeKey("status"), PRIVATE);
+		publishEvents(queue, 0, 1);
+
+		// Larger than the old event, so the old record is marked superseded instead of overwritten
+		queue.publish("test", "event-01 replaces old", PublishQueuePosix::PublishOptions().withSupersedeKey("status"), PRIVATE);
+		assertInt("", (int)queue.stats.superseded, 1);
+
+		corruptRecordPayload(queue, 1, first);
+
+		std::vector<String> events = drain(queue);
+		assertInt("", (int)events.size(), 2);
+		assertStr("", events[0].c_str(), "event-00");
+		assertStr("", events[1].c_str(), "event-01 replaces old");
+		assertInt("", (int)queue.stats.corrupted, 0);
+	}
+
+	// An expired record is skipped using its header; the event is not read
+	removeQueueDirs();
+	{
+		TestQueue queue;
+		queue.setup();
+
+		Particle.isConnected = false;
+		queue.publish("test", "expired", PublishQueuePosix::PublishOptions().withTtl(60), PRIVATE);
+		publishEvents(queue, 0, 1);
+		queue.publish("test", "event-01", PublishQueuePosix::PublishOptions().withTtl(60), PRIVATE);
+
+		// Published two minutes ago
+		rewriteRecordHeader(queue, 1, first, [](PublishQueueRecordHeader &rec) {
+			rec.timestamp = (uint32_t)Time.now() - 120;
+		});
+		corruptRecordPayload(queue, 1, first);
+
+		assertEvents(drain(queue), 0, 2, __LINE__);
+		assertInt("", (int)queue.stats.expired, 1);
+		assertInt("", (int)queue.stats.corrupted, 0);
+	}
+
+	// A record whose event was changed is read, and discarded because of the payload CRC
+	removeQueueDirs();
+	{
+		TestQueue queue;
+		queue.setup();
+		publishEvents(queue, 0, 3);
+		corruptRecordPayload(queue, 1, first + recordSize("event-00"));
+
+		std::vector<String> events = drain(queue);
+		assertInt("", (int)events.size(), 2);
+		assertStr("", events[0].c_str(), "event-00");
+		assertStr("", events[1].c_str(), "event-02");
+		assertInt("", (int)queue.stats.corrupted, 1);
+	}
+
+	removeQueueDirs();
+}
+
+void mergeKeyTest() {
+	removeQueueDirs();
+
+	// Twelve events with the same merge key: segments 1 and 2 are sealed, and 3 is not
+	{
+		TestQueue queue;
+		queue.withSegmentSize(PublishQueuePosix::SEGMENT_DATA_OFFSET + 5 * recordSize("event-00"));
+		queue.setup();
+
+		Particle.isConnected = false;
+		for(int ii = 0; ii < 12; ii++) {
+			char buf[24];
+			snprintf(buf, sizeof(buf), "event-%02d", ii);
+			queue.publish("test", buf, PublishQueuePosix::PublishOptions().withMergeKey("sensor"), PRIVATE);
+		}
+		assertInt("", (int)queue.getNumEvents(), 12);
+
+		// Only the newest record is indexed
+		assertInt("", (int)queue.getKeyedRecordCount(), 1);
+
+		// Merge-keyed records are not counted, so the sealed segment is not read at startup
+		PublishQueueSegmentInfo info;
+		int fd = open(queue.getSegmentPath(1), O_RDONLY);
+		assert(fd >= 0);
+		assert(pread(fd, &info, sizeof(info), sizeof(PublishQueueFileHeader)) == sizeof(info));
+		close(fd);
+		assertInt("", (int)info.recordCount, 5);
+		assertInt("", (int)info.keyedCount, 0);
+	}
+
+	// After a restart the newest record is found in the segment that was being appended to,
+	// and new events are merged into it
+	{
+		TestQueue queue;
+		queue.withSegmentSize(PublishQueuePosix::SEGMENT_DATA_OFFSET + 5 * recordSize("event-00"));
+		queue.withSummaryPolicy(1, 0, [](const char * /*eventName*/, const char *queuedData, const char *newData, char *mergedData, size_t mergedDataSize) {
+			snprintf(mergedData, mergedDataSize, "%s+%s", queuedData, newData);
+			return true;
+		});
+		queue.setup();
+		assertInt("", (int)queue.getKeyedRecordCount(), 1);
+
+		Particle.isConnected = false;
+		queue.publish("test", "new", PublishQueuePosix::PublishOptions().withMergeKey("sensor"), PRIVATE);
+		assertInt("", (int)queue.stats.summarized, 1);
+		assertInt("", (int)queue.getKeyedRecordCount(), 1);
+
+		std::vector<String> events = drain(queue);
+		assertInt("", (int)events.size(), 12);
+		assertStr("", events[10].c_str(), "event-10");
+		assertStr("", events[11].c_str(), "event-11+new");
+	}
+
+	removeQueueDirs();
+}
+
+// Limits the size of files this process can write, so writes past maxSize fail with EFBIG
+void setFileSizeLimit(rlim_t maxSize) {
+	struct rlimit limit;
+	assert(getrlimit(RLIMIT_FSIZE, &limit) == 0);
+	limit.rlim_cur = maxSize;
+	assert(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+}
+
+void writeFailureTest() {
+	removeQueueDirs();
+	signal(SIGXFSZ, SIG_IGN);
+
+	{
+		TestQueue queue;
+		queue.setup();
+
+		// The third record is only partly written, so segment 1 is abandoned with two events
+		setFileSizeLimit(PublishQueuePosix::SEGMENT_DATA_OFFSET + 2 * recordSize("event-00") + 10);
+		publishEvents(queue, 0, 3);
+		assertInt("", (int)queue.getNumEvents(), 3);
+
+		// The event that could not be written was kept in RAM, and is written to segment 2 ahead of the next one
+		publishEvents(queue, 3, 1);
+		assertInt("", (int)getFileSize(queue.getSegmentPath(2)), (int)(PublishQueuePosix::SEGMENT_DATA_OFFSET + 2 * recordSize("event-00")));
+
+		setFileSizeLimit(RLIM_INFINITY);
+		assertEvents(drain(queue), 0, 4, __LINE__);
+	}
+
+	// Nothing could be written to the first segment, which is skipped without blocking the queue
+	removeQueueDirs();
+	{
+		TestQueue queue;
+		queue.setup();
+
+		setFileSizeLimit(PublishQueuePosix::SEGMENT_DATA_OFFSET + 10);
+		publishEvents(queue, 0, 1);
+		setFileSizeLimit(RLIM_INFINITY);
+		publishEvents(queue, 1, 1);
+		assertInt("", (int)queue.getNumEvents(), 2);
+
+		assertEvents(drain(queue), 0, 2, __LINE__);
+	}
+
+	removeQueueDirs();
+}
+
+
+int main() {
+	// So the assertion message is not lost when assert() aborts
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	tornTailTest();
+	cursorTest();
+	version1Test();
+	skipTest();
+	mergeKeyTest();
+	writeFailureTest();
+	printf("tests completed\n");
+	return 0;
+}
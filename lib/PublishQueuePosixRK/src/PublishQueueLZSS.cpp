@@ -0,0 +1,128 @@
+#include "PublishQueueLZSS.h"
+
+// [static]
+size_t PublishQueueLZSS::compress(const void *src, size_t srcLen, uint8_t *dst, size_t dstSize, const uint8_t *dict, size_t dictLen, size_t window) {
+    const uint8_t *in = (const uint8_t *)src;
+    size_t inPos = 0;
+    size_t outPos = 0;
+    size_t flagPos = 0;
+    int bit = 0;
+
+    if (window > MAX_DISTANCE) {
+        window = MAX_DISTANCE;
+    }
+    if (!dict) {
+        dictLen = 0;
+    }
+    else if (dictLen > window) {
+        // Only the end of the dictionary is within reach
+        dict += dictLen - window;
+        dictLen = window;
+    }
+
+    while(inPos < srcLen) {
+        if (bit == 0) {
+            if (outPos >= dstSize) {
+                return 0;
+            }
+            flagPos = outPos++;
+            dst[flagPos] = 0;
+        }
+
+        // Find the longest match, nearest first. Matches can overlap the current position.
+        size_t bestLen = 0;
+        size_t bestDist = 0;
+        size_t maxLen = srcLen - inPos;
+        if (maxLen > MAX_MATCH) {
+            maxLen = MAX_MATCH;
+        }
+        if (maxLen >= MIN_MATCH) {
+            size_t start = (inPos > window) ? (inPos - window) : 0;
+            for(size_t pos = inPos; pos-- > start; ) {
+                if (in[pos] != in[inPos]) {
+                    continue;
+                }
+                size_t len = 1;
+                while(len < maxLen && in[pos + len] == in[inPos + len]) {
+                    len++;
+                }
+                if (len > bestLen) {
+                    bestLen = len;
+                    bestDist = inPos - pos;
+                    if (len == maxLen) {
+                        break;
+                    }
+                }
+            }
+
+            // Then the end of the dictionary, which is treated as if it comes before src
+            size_t dictStart = (inPos + dictLen > window) ? (inPos + dictLen - window) : 0;
+            for(size_t pos = dictLen; bestLen < maxLen && pos-- > dictStart; ) {
+                size_t len = 0;
+                while(len < maxLen && (pos + len < dictLen ? dict[pos + len] : in[pos + len - dictLen]) == in[inPos + len]) {
+                    len++;
+                }
+                if (len > bestLen) {
+                    bestLen = len;
+                    bestDist = inPos + dictLen - pos;
+                }
+            }
+        }
+
+        if (bestLen >= MIN_MATCH) {
+            if (outPos + 2 > dstSize) {
+                return 0;
+            }
+            uint16_t token = (uint16_t)(((bestDist - 1) << 4) | (bestLen - MIN_MATCH));
+            dst[outPos++] = (uint8_t)(token >> 8);
+            dst[outPos++] = (uint8_t)token;
+            dst[flagPos] |= (uint8_t)(1 << bit);
+            inPos += bestLen;
+        }
+        else {
+            if (outPos >= dstSize) {
+                return 0;
+            }
+            dst[outPos++] = in[inPos++];
+        }
+        bit = (bit + 1) & 7;
+    }
+
+    return outPos;
+}
+
+// [static]
+size_t PublishQueueLZSS::decompress(const uint8_t *src, size_t srcLen, void *dst, size_t dstSize, const uint8_t *dict, size_t dictLen) {
+    uint8_t *out = (uint8_t *)dst;
+    size_t inPos = 0;
+    size_t outPos = 0;
+
+    while(inPos < srcLen && outPos < dstSize) {
+        uint8_t flags = src[inPos++];
+
+        for(int bit = 0; bit < 8 && inPos < srcLen && outPos < dstSize; bit++) {
+            if (flags & (1 << bit)) {
+                if (inPos + 2 > srcLen) {
+                    return 0;
+                }
+                uint16_t token = (uint16_t)((src[inPos] << 8) | src[inPos + 1]);
+                inPos += 2;
+
+                size_t dist = (token >> 4) + 1;
+                size_t len = (token & 0xf) + MIN_MATCH;
+                if (dist > outPos + dictLen || outPos + len > dstSize) {
+                    return 0;
+                }
+                // Byte by byte because the match can overlap the bytes being written
+                for(size_t ii = 0; ii < len; ii++, outPos++) {
+                    out[outPos] = (dist > outPos) ? dict[dictLen + outPos - dist] : out[outPos - dist];
+                }
+            }
+            else {
+                out[outPos++] = src[inPos++];
+            }
+        }
+    }
+
+    return outPos;
+}
@@ -0,0 +1,73 @@
+#ifndef __PUBLISHQUEUELZSS_H
+#define __PUBLISHQUEUELZSS_H
+
+// Github: https://github.com/rickkas7/PublishQueuePosixRK
+// License: MIT
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Small LZSS codec used to compress events in the file queue
+ *
+ * The compressed data is a sequence of groups. Each group is a flag byte followed by up to
+ * 8 items, one per bit starting with the least significant bit. A 0 bit is a literal byte.
+ * A 1 bit is a 2-byte match, high byte first: the distance back to the start of the match
+ * minus 1 in the upper 12 bits, and the length minus MIN_MATCH in the lower 4 bits.
+ *
+ * Neither compress() nor decompress() use any memory other than the buffers passed to them,
+ * and decompressing is a single pass with no searching. Compressing searches the previous
+ * window bytes for each match, so it's limited to small buffers like a single event.
+ */
+class PublishQueueLZSS {
+public:
+    /**
+     * @brief Compresses a buffer
+     *
+     * @param src The data to compress
+     *
+     * @param srcLen Length of the data in bytes
+     *
+     * @param dst Buffer to write the compressed data to
+     *
+     * @param dstSize Size of dst in bytes
+     *
+     * @param dict Optional preset dictionary, treated as if it came just before src, so the
+     * first bytes of src can be matches. Pass the same dictionary to decompress(). Can be NULL.
+     *
+     * @param dictLen Length of the dictionary in bytes. Only the last window bytes are used.
+     *
+     * @param window How far back to look for matches in bytes, up to MAX_DISTANCE. A smaller
+     * window is faster but may not compress as well.
+     *
+     * @return The length of the compressed data, or 0 if it does not fit in dstSize
+     */
+    static size_t compress(const void *src, size_t srcLen, uint8_t *dst, size_t dstSize, const uint8_t *dict = NULL, size_t dictLen = 0, size_t window = DEFAULT_WINDOW);
+
+    /**
+     * @brief Decompresses a buffer
+     *
+     * @param src The compressed data
+     *
+     * @param srcLen Length of the compressed data in bytes
+     *
+     * @param dst Buffer to write the decompressed data to
+     *
+     * @param dstSize Size of dst in bytes. Decompressing stops when it's full, so src can
+     * be followed by padding.
+     *
+     * @param dict The preset dictionary passed to compress(), or NULL
+     *
+     * @param dictLen Length of the dictionary in bytes
+     *
+     * @return The length of the decompressed data, or 0 if src is not valid
+     */
+    static size_t decompress(const uint8_t *src, size_t srcLen, void *dst, size_t dstSize, const uint8_t *dict = NULL, size_t dictLen = 0);
+
+    static const size_t MIN_MATCH = 3;          //!< Shortest match that is encoded as a match instead of literals
+    static const size_t MAX_MATCH = 18;         //!< Longest match, MIN_MATCH + 15
+    static const size_t MAX_DISTANCE = 4096;    //!< Farthest back a match can start
+    static const size_t DEFAULT_WINDOW = 1024;  //!< Default window for compress(), larger than any event
+};
+
+#endif /* __PUBLISHQUEUELZSS_H */
@@ -2,14 +2,25 @@
 
 #include "BackgroundPublishRK.h"
 
+#include <algorithm>
 #include <dirent.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 
 PublishQueuePosix *PublishQueuePosix::_instance;
 
+const uint32_t PublishQueuePosix::latencyBucketLimits[NUM_LATENCY_BUCKETS - 1] = { 2, 10, 60, 600, 3600 };
+
+const size_t PublishQueueEventPool::sizeClassSizes[NUM_SIZE_CLASSES] = { 128, 384, sizeof(PublishQueueEvent) + particle::protocol::MAX_EVENT_DATA_LENGTH };
+
+const char * const PublishQueuePosix::CURSOR_FILENAME = "cursor";
+
 static Logger _log("app.pubq");
 
+// Directory suffix for each priority class. PRIORITY_NORMAL uses the directory from withDirPath() 
+// unchanged so queues created by earlier versions of the library are still sent.
+static const char * const _prioritySuffix[PublishQueuePosix::NUM_PRIORITIES] = { "-alert", "", "-bulk" };
+
 
 PublishQueuePosix &PublishQueuePosix::instance() {
     if (!_instance) {
@@ -39,6 +50,73 @@ PublishQueuePosix &PublishQueuePosix::withFileQueueSize(size_t size) {
     return *this; 
 }
 
+PublishQueuePosix &PublishQueuePosix::withFileQueueSize(Priority priority, size_t size) {
+    priorityFileQueueSize[priority] = size; 
+
+    if (stateHandler) {
+        _log.trace("withFileQueueSize(%d, %u)", (int)priority, size);
+        checkQueueLimits();
+    }
+    return *this; 
+}
+
+PublishQueuePosix &PublishQueuePosix::withPublishRateLimit(unsigned long intervalMs, size_t burst) {
+    publishIntervalMs = intervalMs;
+    publishBurst = (burst > 0) ? burst : 1;
+    if (bucketCreditMs > publishIntervalMs * publishBurst) {
+        bucketCreditMs = publishIntervalMs * publishBurst;
+    }
+    return *this;
+}
+
+PublishQueuePosix &PublishQueuePosix::withMaxInFlight(size_t count) {
+    // BackgroundPublishRK limits it to the number of publish slots it has
+    BackgroundPublishRK::instance().setMaxInFlight(count);
+    maxInFlight = BackgroundPublishRK::instance().getMaxInFlight();
+    return *this;
+}
+
+PublishQueuePosix &PublishQueuePosix::withCompressionDictionary(const char *eventName, const char *eventData) {
+    // Laid out the same as the events being compressed, so the event name and padding match too
+    size_t dataLen = strlen(eventData);
+    compressionDict.assign(sizeof(PublishQueueEvent) + dataLen, 0);
+
+    PublishQueueEvent *event = (PublishQueueEvent *)compressionDict.data();
+    strncpy(event->eventName, eventName, sizeof(event->eventName) - 1);
+    memcpy(event->eventData, eventData, dataLen);
+
+    codec = CODEC_LZSS;
+    return *this;
+}
+
+PublishQueuePosix &PublishQueuePosix::withEventPool(size_t smallCount, size_t mediumCount, size_t largeCount) {
+    eventPoolCounts[0] = smallCount;
+    eventPoolCounts[1] = mediumCount;
+    eventPoolCounts[2] = largeCount;
+    return *this;
+}
+
+PublishQueueEventPool::Stats PublishQueuePosix::getPoolStats() {
+    PublishQueueEventPool::Stats result;
+
+    WITH_LOCK(*this) {
+        result = eventPool.getStats();
+    }
+    return result;
+}
+
+PublishQueuePosix &PublishQueuePosix::withDirPath(const char *dirPath) {
+    String path(dirPath);
+    if (path.endsWith("/")) {
+        path = path.substring(0, path.length() - 1);
+    }
+
+    for(int priority = 0; priority < NUM_PRIORITIES; priority++) {
+        fileQueue[priority].withDirPath(path + _prioritySuffix[priority]).withManifest();
+    }
+    return *this;
+}
+
 void PublishQueuePosix::setup() {
     if (system_thread_get_state(nullptr) != spark::feature::ENABLED) {
         _log.error("SYSTEM_THREAD(ENABLED) is required");
@@ -51,36 +129,95 @@ void PublishQueuePosix::setup() {
     System.on(reset | cloud_status, systemEventHandler);
 
     // Start the background publish thread
+    BackgroundPublishRK::instance().setMaxInFlight(maxInFlight);
     BackgroundPublishRK::instance().start();
 
-    fileQueue.scanDir();
+    eventPool.setup(eventPoolCounts);
+
+    if (!writeBuffer) {
+        writeBuffer = new uint8_t[WRITE_BUFFER_SIZE];
+    }
+
+    for(int priority = 0; priority < NUM_PRIORITIES; priority++) {
+        loadFileQueue((Priority)priority);
+    }
 
     checkQueueLimits();
 
+    // Start with a full publish rate limit bucket
+    bucketCreditMs = publishIntervalMs * publishBurst;
+    bucketLastMs = millis();
+
     stateHandler = &PublishQueuePosix::stateConnectWait;
 }
 
 void PublishQueuePosix::loop() {
+    if (!inFlight.empty()) {
+        releaseCompletedEvents();
+    }
+
     if (stateHandler) {
         stateHandler(*this);
     }
+
+    if (readAheadCount && Particle.connected()) {
+        readAheadEvent();
+    }
+
+    if (summarizing) {
+        WITH_LOCK(*this) {
+            updateSummarizing();
+        }
+    }
+
+    if (statsEventPeriodMs && millis() - statsEventLastMs >= statsEventPeriodMs) {
+        statsEventLastMs = millis();
+        publish(statsEventName.c_str(), getStatsJson().c_str(), PublishOptions().withPriority(PRIORITY_BULK).withSupersedeKey(statsEventName.c_str()), PRIVATE);
+    }
 }
 
-bool PublishQueuePosix::publishCommon(const char *eventName, const char *eventData, int ttl, PublishFlags flags1, PublishFlags flags2) {
+bool PublishQueuePosix::publishCommon(const char *eventName, const char *eventData, int /*ttl*/, PublishFlags flags1, PublishFlags flags2, const PublishOptions &options) {
+    Priority priority = options.priority;
+    if (priority < 0 || priority >= NUM_PRIORITIES) {
+        priority = PRIORITY_NORMAL;
+    }
 
     PublishQueueEvent *event = newRamEvent(eventName, eventData, flags1 | flags2);
     if (!event) {
         return false;
     }
-    _log.trace("publishCommon eventName=%s eventData=%s", eventName, eventData ? eventData : "");
+    _log.trace("publishCommon eventName=%s eventData=%s priority=%d", eventName, eventData ? eventData : "", (int)priority);
+
+    PublishQueueEventPool::header(event)->ttl = options.ttl;
+
+    if (options.supersedeKey) {
+        PublishQueueEventPool::header(event)->supersedeKey = supersedeKeyHash(options.supersedeKey);
+    }
+    else
+    if (options.mergeKey) {
+        PublishQueueEventPool::header(event)->supersedeKey = supersedeKeyHash(options.mergeKey);
+        PublishQueueEventPool::header(event)->mergeKey = true;
+    }
 
     WITH_LOCK(*this) {
-        ramQueue.push_back(event);
+        if (options.supersedeKey && supersedeEvent(priority, event)) {
+            return true;
+        }
+        if (!options.supersedeKey && options.mergeKey) {
+            updateSummarizing();
+            if (summarizing && mergeEvent(priority, event) && supersedeEvent(priority, event)) {
+                // If supersedeEvent() returns false, the merged event did not fit in place of the
+                // queued event, and is queued as a new event instead
+                return true;
+            }
+        }
+
+        ramQueue[priority].push_back(event);
 
-        _log.trace("fileQueueLen=%u ramQueueLen=%u connected=%d", fileQueue.getQueueLen(), ramQueue.size(), Particle.connected());
+        _log.trace("fileQueueLen=%u ramQueueLen=%u connected=%d", fileQueue[priority].getQueueLen(), getRamQueueLen(), Particle.connected());
 
-        if (fileQueue.getQueueLen() == 0 && (ramQueue.size() <= ramQueueSize) && Particle.connected()) {
-            // No files in the disk-based queue, RAM-based queue is not full, and we are cloud connected
+        if (fileState[priority].numEvents == 0 && (getRamQueueLen() <= ramQueueSize) && Particle.connected()) {
+            // No files in the disk-based queue for this priority class, RAM-based queue is not full, and we are cloud connected
             // Leave the event in the RAM queue and return true
             _log.trace("queued to ramQueue");
         }
@@ -109,8 +246,9 @@ PublishQueueEvent *PublishQueuePosix::newRamEvent(const char *eventName, const c
 
     PublishQueueEvent *event;
 
-    event = (PublishQueueEvent *) new char[sizeof(PublishQueueEvent) + strlen(eventData)];
+    event = allocEvent(sizeof(PublishQueueEvent) + strlen(eventData));
     if (event) {
+        PublishQueueEventPool::header(event)->timestamp = Time.isValid() ? (uint32_t) Time.now() : 0;
         event->flags = flags;
         strcpy(event->eventName, eventName);
         strcpy(event->eventData, eventData);
@@ -118,291 +256,2048 @@ PublishQueueEvent *PublishQueuePosix::newRamEvent(const char *eventName, const c
     return event;
 }
 
-void PublishQueuePosix::writeQueueToFiles() {
+PublishQueueEvent *PublishQueuePosix::allocEvent(size_t eventSize) {
+    PublishQueueEvent *event;
 
     WITH_LOCK(*this) {
-        while(!ramQueue.empty()) {
-            PublishQueueEvent *event = ramQueue.front();
-            ramQueue.pop_front();
+        event = eventPool.alloc(eventSize);
+    }
+    return event;
+}
 
-            int fileNum = fileQueue.reserveFile();
+void PublishQueuePosix::freeEvent(PublishQueueEvent *event) {
+    WITH_LOCK(*this) {
+        eventPool.free(event);
+    }
+}
 
-            int fd = open(fileQueue.getPathForFileNum(fileNum), O_RDWR | O_CREAT);
-            if (fd) {
-                PublishQueueFileHeader hdr;
-                hdr.magic = FILE_MAGIC;
-                hdr.version = FILE_VERSION;
-                hdr.headerSize = sizeof(PublishQueueFileHeader);
-                hdr.nameLen = sizeof(PublishQueueEvent::eventName);
-                write(fd, &hdr, sizeof(hdr));
+void PublishQueuePosix::writeQueueToFiles() {
+    const uint32_t commitMarker = RECORD_COMMIT_MARKER;
 
-                write(fd, event, sizeof(PublishQueueEvent) + strlen(event->eventData));
+    WITH_LOCK(*this) {
+        for(int priority = 0; priority < NUM_PRIORITIES; priority++) {
+            FileQueueState &state = fileState[priority];
+            int fd = -1;
+
+            // Records are collected in writeBuffer and written together. bufLen bytes (bufCount records)
+            // are pending, and will be written at state.appendOffset. Their events are kept in buffered
+            // until then, so they can be put back in the RAM queue if the write fails.
+            size_t bufLen = 0;
+            size_t bufCount = 0;
+            size_t bufKeyed = 0;
+            PublishQueueEventList buffered;
+            bool failed = false;
+
+            // After a failed write, nothing else is appended to the segment. The records that were
+            // completely written before it are still sent, and the next call starts a new segment.
+            auto abandonSegment = [&]() {
+                _log.error("writeQueueToFiles write failed fileNum=%d errno=%d", state.appendFileNum, errno);
+                for(auto it = state.keyedRecords.begin(); it != state.keyedRecords.end(); ) {
+                    if (it->fileNum == state.appendFileNum && it->offset >= state.appendOffset) {
+                        it = state.keyedRecords.erase(it);
+                    }
+                    else {
+                        it++;
+                    }
+                }
+                state.appendFileNum = 0;
                 close(fd);
+                fd = -1;
+                failed = true;
+            };
+
+            auto flush = [&]() {
+                if (fd >= 0 && bufLen) {
+                    if (writeRecords(fd, writeBuffer, bufLen)) {
+                        state.appendOffset += bufLen;
+                        state.fileBytes += bufLen;
+                        state.segmentEvents.back() += bufCount;
+                        state.numEvents += bufCount;
+                        state.appendCount += bufCount;
+                        state.appendKeyedCount += bufKeyed;
+                        while(!buffered.empty()) {
+                            PublishQueueEvent *event = buffered.front();
+                            buffered.pop_front();
+                            freeEvent(event);
+                        }
+                    }
+                    else {
+                        abandonSegment();
+                    }
+                }
+                bufLen = bufCount = bufKeyed = 0;
+            };
+
+            while(!ramQueue[priority].empty() && !failed) {
+                PublishQueueEvent *event = ramQueue[priority].front();
+                ramQueue[priority].pop_front();
+
+                size_t eventSize = sizeof(PublishQueueEvent) + strlen(event->eventData);
+
+                // Stored compressed only if that's smaller
+                size_t payloadSize = eventSize;
+                PublishQueueEvent *packed = (codec != CODEC_NONE) ? compressEvent(event, eventSize, eventSize, payloadSize) : NULL;
+                const uint8_t *payload = packed ? (const uint8_t *)packed : (const uint8_t *)event;
+
+                size_t recordSize = sizeof(PublishQueueRecordHeader) + payloadSize + sizeof(commitMarker);
+
+                if (state.appendFileNum != 0 && 
+                    ((packed && state.appendCodec != codec) || 
+                     (state.appendOffset + bufLen + recordSize > segmentSize && state.appendOffset + bufLen > SEGMENT_DATA_OFFSET))) {
+                    // Segment is full or was written without compression, start a new one
+                    flush();
+                    if (fd >= 0) {
+                        close(fd);
+                        fd = -1;
+                    }
+                    if (state.appendFileNum != 0) {
+                        sealSegment((Priority)priority);
+                    }
+                    state.appendFileNum = 0;
+                }
 
-                // This message is monitored by the automated test tool. If you edit this, change that too.
-                _log.trace("writeQueueToFiles fileNum=%d", fileNum);
-            }
-            fileQueue.addFileToQueue(fileNum);
+                if (failed) {
+                    // The buffered records could not be written
+                    ramQueue[priority].push_front(event);
+                    freeEvent(packed);
+                    break;
+                }
 
-            delete event;
-        }
-    }
-}
+                if (state.appendFileNum == 0) {
+                    int fileNum = fileQueue[priority].reserveFile();
+
+                    fd = open(fileQueue[priority].getPathForFileNum(fileNum), O_RDWR | O_CREAT | O_TRUNC);
+                    if (fd >= 0) {
+                        PublishQueueFileHeader hdr;
+                        hdr.magic = FILE_MAGIC;
+                        hdr.version = FILE_VERSION;
+                        hdr.headerSize = sizeof(PublishQueueFileHeader);
+                        hdr.nameLen = sizeof(PublishQueueEvent::eventName);
+                        hdr.codec = codec;
+
+                        // Not sealed until the next segment is started
+                        PublishQueueSegmentInfo info = {};
+
+                        state.appendFileNum = fileNum;
+                        state.appendOffset = 0;
+                        state.appendCount = 0;
+                        state.appendKeyedCount = 0;
+                        state.appendCodec = codec;
+                        fileQueue[priority].addFileToQueue(fileNum);
+                        state.segmentEvents.push_back(0);
+
+                        if (writeBuffer) {
+                            // Written along with the first records
+                            memcpy(writeBuffer, &hdr, sizeof(hdr));
+                            memcpy(&writeBuffer[sizeof(hdr)], &info, sizeof(info));
+                            bufLen = SEGMENT_DATA_OFFSET;
+                        }
+                        else 
+                        if (writeRecords(fd, (const uint8_t *)&hdr, sizeof(hdr)) && writeRecords(fd, (const uint8_t *)&info, sizeof(info))) {
+                            state.appendOffset = SEGMENT_DATA_OFFSET;
+                            state.fileBytes += SEGMENT_DATA_OFFSET;
+                        }
+                        else {
+                            abandonSegment();
+                        }
+                    }
+                }
+                else 
+                if (fd < 0) {
+                    fd = open(fileQueue[priority].getPathForFileNum(state.appendFileNum), O_RDWR);
+                    if (fd >= 0) {
+                        lseek(fd, state.appendOffset, SEEK_SET);
+                    }
+                }
 
+                if (fd >= 0 && writeBuffer && bufLen + recordSize > WRITE_BUFFER_SIZE) {
+                    flush();
+                }
 
-PublishQueueEvent *PublishQueuePosix::readQueueFile(int fileNum) {
-    PublishQueueEvent *result = NULL;
+                if (fd < 0) {
+                    // Could not open or write the segment. This event and the ones after it stay in 
+                    // the RAM queue to try again later.
+                    ramQueue[priority].push_front(event);
+                    freeEvent(packed);
+                    failed = true;
+                    break;
+                }
 
-    int fd = open(fileQueue.getPathForFileNum(fileNum), O_RDONLY);
-    if (fd) {
-        struct stat sb;
-        fstat(fd, &sb);
+                PublishQueueRecordHeader rec;
+                rec.size = (uint16_t) payloadSize;
+                rec.flags = packed ? RECORD_FLAG_COMPRESSED : 0;
+                rec.headerSize = sizeof(PublishQueueRecordHeader);
+                rec.supersedeKey = PublishQueueEventPool::header(event)->supersedeKey;
+                if (PublishQueueEventPool::header(event)->mergeKey) {
+                    rec.flags |= RECORD_FLAG_MERGE_KEY;
+                }
+                rec.timestamp = PublishQueueEventPool::header(event)->timestamp;
+                rec.payloadCrc = crc32(event, eventSize);
+                rec.crc = 0;
+                rec.ttl = PublishQueueEventPool::header(event)->ttl;
+                rec.crc = crc32(&rec, sizeof(rec));
+
+                // Merge-keyed records are not counted in the segment info, so a sealed segment is not read for them at startup
+                bool counted = rec.supersedeKey && !(rec.flags & RECORD_FLAG_MERGE_KEY);
+
+                KeyedRecord keyed;
+                keyed.supersedeKey = rec.supersedeKey;
+                keyed.fileNum = state.appendFileNum;
+                keyed.offset = state.appendOffset + bufLen;
+                keyed.size = rec.size;
+                keyed.mergeKey = (rec.flags & RECORD_FLAG_MERGE_KEY) != 0;
+
+                if (writeBuffer && bufLen + recordSize <= WRITE_BUFFER_SIZE) {
+                    memcpy(&writeBuffer[bufLen], &rec, sizeof(rec));
+                    memcpy(&writeBuffer[bufLen + sizeof(rec)], payload, payloadSize);
+                    memcpy(&writeBuffer[bufLen + sizeof(rec) + payloadSize], &commitMarker, sizeof(commitMarker));
+                    bufLen += recordSize;
+                    bufCount++;
+                    buffered.push_back(event);
+                    if (rec.supersedeKey) {
+                        // Removed by abandonSegment() if the buffer cannot be written
+                        addKeyedRecord(state.keyedRecords, keyed);
+                    }
+                    if (counted) {
+                        bufKeyed++;
+                    }
+                }
+                else {
+                    // No buffer, or the record does not fit in it. The commit marker is written last.
+                    if (writeRecords(fd, (const uint8_t *)&rec, sizeof(rec)) && 
+                        writeRecords(fd, payload, payloadSize) &&
+                        writeRecords(fd, (const uint8_t *)&commitMarker, sizeof(commitMarker))) {
+                        state.appendOffset += recordSize;
+                        state.fileBytes += recordSize;
+                        state.segmentEvents.back()++;
+                        state.numEvents++;
+                        state.appendCount++;
+                        if (rec.supersedeKey) {
+                            addKeyedRecord(state.keyedRecords, keyed);
+                        }
+                        if (counted) {
+                            state.appendKeyedCount++;
+                        }
+                        freeEvent(event);
+                    }
+                    else {
+                        // A partial record may have been written after appendOffset
+                        abandonSegment();
+                        ramQueue[priority].push_front(event);
+                    }
+                }
 
-        _log.trace("fileNum=%d size=%ld", fileNum, sb.st_size);
+                // This message is monitored by the automated test tool. If you edit this, change that too.
+                _log.trace("writeQueueToFiles fileNum=%d", state.appendFileNum);
 
-        PublishQueueFileHeader hdr;
-        
-        lseek(fd, 0, SEEK_SET);
-        read(fd, &hdr, sizeof(PublishQueueFileHeader));
-        if (sb.st_size >= (off_t)(sizeof(PublishQueueFileHeader) + sizeof(PublishQueueEvent)) &&
-            hdr.magic == FILE_MAGIC && 
-            hdr.version == FILE_VERSION &&
-            hdr.headerSize == sizeof(PublishQueueFileHeader) &&
-            hdr.nameLen == sizeof(PublishQueueEvent::eventName)) {
-
-            size_t eventSize = sb.st_size - sizeof(PublishQueueFileHeader);
-
-            result = (PublishQueueEvent *)new char[eventSize];
-            if (result) {
-                read(fd, result, eventSize);
+                freeEvent(packed);
+            }
 
-                if (((char *)result)[eventSize - 1] == 0 && strlen(result->eventName) < (sizeof(PublishQueueEvent::eventName) - 1)) {
-                    _log.trace("readQueueFile %d event=%s data=%s", fileNum, result->eventName, result->eventData);
-                }
-                else {
-                    _log.trace("readQueueFile %d corrupted event name or data", fileNum);
-                    delete result;
-                    result = NULL;
+            if (fd >= 0) {
+                flush();
+                if (fd >= 0) {
+                    close(fd);
                 }
+            }
 
+            if (!buffered.empty()) {
+                // The buffer could not be written, so its events go back in front of the rest of the RAM queue
+                while(!ramQueue[priority].empty()) {
+                    PublishQueueEvent *event = ramQueue[priority].front();
+                    ramQueue[priority].pop_front();
+                    buffered.push_back(event);
+                }
+                while(!buffered.empty()) {
+                    PublishQueueEvent *event = buffered.front();
+                    buffered.pop_front();
+                    ramQueue[priority].push_back(event);
+                }
             }
-        } else {
-            _log.trace("readQueueFile %d bad magic=%08lx version=%u headerSize=%u nameLen=%u", fileNum, hdr.magic, hdr.version, hdr.headerSize, hdr.nameLen);
         }
+    }
+}
 
-        close(fd);
+bool PublishQueuePosix::writeRecords(int fd, const uint8_t *buf, size_t len) {
+    while(len > 0) {
+        int count = write(fd, buf, len);
+        if (count <= 0) {
+            return false;
+        }
+        buf += count;
+        len -= count;
     }
-    return result;
+    return true;
 }
 
-void PublishQueuePosix::clearQueues() {
-    WITH_LOCK(*this) {
-        while(!ramQueue.empty()) {
-            PublishQueueEvent *event = ramQueue.front();
-            ramQueue.pop_front();
+int PublishQueuePosix::openQueueFile(Priority priority, int fileNum, PublishQueueFileHeader &hdr, off_t &fileSize, bool writable) {
+    int fd = open(fileQueue[priority].getPathForFileNum(fileNum), writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
 
-            delete event;
-        }
+    struct stat sb;
+    fstat(fd, &sb);
+    fileSize = sb.st_size;
 
-        fileQueue.removeAll(true);
+    if (read(fd, &hdr, sizeof(PublishQueueFileHeader)) == sizeof(PublishQueueFileHeader) &&
+        hdr.magic == FILE_MAGIC && 
+        (hdr.version == 1 || hdr.version == FILE_VERSION) &&
+        hdr.headerSize == sizeof(PublishQueueFileHeader) &&
+        hdr.nameLen == sizeof(PublishQueueEvent::eventName)) {
+        return fd;
     }
 
-    _log.trace("clearQueues");
+    _log.trace("openQueueFile %d bad magic=%08lx version=%u headerSize=%u nameLen=%u", fileNum, hdr.magic, hdr.version, hdr.headerSize, hdr.nameLen);
+    close(fd);
+    return -1;
 }
 
-void PublishQueuePosix::setPausePublishing(bool value) { 
-    pausePublishing = value; 
+bool PublishQueuePosix::readRecordHeader(int fd, uint32_t offset, off_t fileSize, PublishQueueRecordHeader &rec) {
+    if ((off_t)(offset + sizeof(PublishQueueRecordHeader)) > fileSize) {
+        return false;
+    }
 
-    if (!value) {
-        // When resuming publishing, update the canSleep flag
-        if (getNumEvents() != 0) {
-            canSleep = false;
-        }
+    lseek(fd, offset, SEEK_SET);
+    if (read(fd, &rec, sizeof(rec)) != sizeof(rec)) {
+        return false;
     }
+
+    uint32_t crc = rec.crc;
+    rec.crc = 0;
+    bool valid = (crc32(&rec, sizeof(rec)) == crc);
+    rec.crc = crc;
+
+    return valid &&
+        rec.headerSize == sizeof(PublishQueueRecordHeader) &&
+        rec.size >= ((rec.flags & RECORD_FLAG_COMPRESSED) ? sizeof(uint16_t) + 1 : sizeof(PublishQueueEvent)) &&
+        (off_t)(offset + recordLength(rec)) <= fileSize;
 }
 
+bool PublishQueuePosix::writeRecordHeader(int fd, PublishQueueRecordHeader &rec) {
+    rec.crc = 0;
+    rec.crc = crc32(&rec, sizeof(rec));
+    return writeRecords(fd, (const uint8_t *)&rec, sizeof(rec));
+}
 
+// [static]
+bool PublishQueuePosix::isExpired(uint32_t timestamp, uint32_t ttl) {
+    return ttl != 0 && timestamp != 0 && Time.isValid() && (uint32_t)Time.now() - timestamp >= ttl;
+}
 
-void PublishQueuePosix::checkQueueLimits() {
-    WITH_LOCK(*this) {
-        if (ramQueue.size() > ramQueueSize) {
-            // RAM queue is too large, move all to files
-            writeQueueToFiles();
-        }
+bool PublishQueuePosix::readCommitMarker(int fd, uint32_t offset, const PublishQueueRecordHeader &rec) {
+    uint32_t marker = 0;
 
-        while(fileQueue.getQueueLen() > (int)fileQueueSize) {
-            int fileNum = fileQueue.getFileFromQueue(true);
-            if (fileNum) {
-                fileQueue.removeFileNum(fileNum, false);
-                _log.info("discarded event %d", fileNum);
-            }
-        }
-    }
+    lseek(fd, offset + rec.headerSize + rec.size, SEEK_SET);
+    return read(fd, &marker, sizeof(marker)) == sizeof(marker) && marker == RECORD_COMMIT_MARKER;
 }
 
-size_t PublishQueuePosix::getNumEvents() {
-    size_t result = 0;
+PublishQueueEvent *PublishQueuePosix::readRecordEvent(int fd, const PublishQueueFileHeader &hdr, const PublishQueueRecordHeader &rec, size_t &eventSize, bool &corrupted) {
+    corrupted = false;
+    eventSize = rec.size;
 
-    WITH_LOCK(*this) {
-        result = ramQueue.size();
-        if (result == 0) {
-            result = fileQueue.getQueueLen();
+    PublishQueueEvent *result = allocEvent(rec.size);
+    if (!result) {
+        return NULL;
+    }
+    if (read(fd, result, rec.size) != (int)rec.size) {
+        freeEvent(result);
+        corrupted = true;
+        return NULL;
+    }
 
-            if (curEvent && curFileNum == 0) {
-                // This happens when we are sending an event from the RAM queue
-                // It's not in the RAM queue, but we want to count it, because
-                // otherwise getNumEvents would return 1 for the event sent from
-                // a file (because the file is not deleted until sent) and
-                // this makes the behavior consistent.
-                result++;
+    if (rec.flags & RECORD_FLAG_COMPRESSED) {
+        PublishQueueEvent *packed = result;
+        uint16_t rawSize;
+        memcpy(&rawSize, packed, sizeof(rawSize));
+
+        result = NULL;
+        if (hdr.codec == CODEC_LZSS && rawSize >= sizeof(PublishQueueEvent)) {
+            result = allocEvent(rawSize);
+            if (result) {
+                if (PublishQueueLZSS::decompress((const uint8_t *)packed + sizeof(rawSize), rec.size - sizeof(rawSize), result, rawSize, compressionDict.data(), compressionDict.size()) == rawSize) {
+                    eventSize = rawSize;
+                }
+                else {
+                    freeEvent(result);
+                    result = NULL;
+                }
             }
         }
+        freeEvent(packed);
+        if (!result) {
+            // Unknown codec or invalid data
+            corrupted = true;
+            return NULL;
+        }
+    }
+
+    // The CRC is of the uncompressed event, so this also catches a dictionary that does not match
+    if (crc32(result, eventSize) != rec.payloadCrc) {
+        freeEvent(result);
+        corrupted = true;
+        return NULL;
     }
     return result;
 }
 
-void PublishQueuePosix::publishCompleteCallback(bool succeeded, const char *eventName, const char *eventData) {
-    publishComplete = true;
-    publishSuccess = succeeded;
+PublishQueueEvent *PublishQueuePosix::compressEvent(PublishQueueEvent *event, size_t eventSize, size_t maxSize, size_t &packedSize) {
+    uint16_t rawSize = (uint16_t) eventSize;
+    if (maxSize <= sizeof(rawSize) + 1) {
+        return NULL;
+    }
 
-    if (publishCompleteUserCallback) {
-        publishCompleteUserCallback(succeeded, eventName, eventData);
+    PublishQueueEvent *result = allocEvent(maxSize);
+    if (!result) {
+        return NULL;
     }
+
+    uint8_t *buf = (uint8_t *)result;
+    size_t len = PublishQueueLZSS::compress(event, eventSize, buf + sizeof(rawSize), maxSize - sizeof(rawSize) - 1, compressionDict.data(), compressionDict.size());
+    if (len == 0) {
+        // Doesn't compress to less than maxSize
+        freeEvent(result);
+        return NULL;
+    }
+    memcpy(buf, &rawSize, sizeof(rawSize));
+    packedSize = sizeof(rawSize) + len;
+
+    return result;
 }
 
+bool PublishQueuePosix::readSegmentInfo(int fd, PublishQueueSegmentInfo &info) {
+    lseek(fd, sizeof(PublishQueueFileHeader), SEEK_SET);
+    return read(fd, &info, sizeof(info)) == sizeof(info) &&
+        info.crc == crc32(&info, offsetof(PublishQueueSegmentInfo, crc));
+}
 
-void PublishQueuePosix::stateConnectWait() {
-    canSleep = (pausePublishing || getNumEvents() == 0);
+void PublishQueuePosix::sealSegment(Priority priority) {
+    FileQueueState &state = fileState[priority];
 
-    if (Particle.connected()) {
-        stateTime = millis();
-        durationMs = waitAfterConnect;
-        stateHandler = &PublishQueuePosix::stateWait;
+    PublishQueueSegmentInfo info;
+    info.recordCount = state.appendCount;
+    info.keyedCount = state.appendKeyedCount;
+    info.crc = crc32(&info, offsetof(PublishQueueSegmentInfo, crc));
+
+    int fd = open(fileQueue[priority].getPathForFileNum(state.appendFileNum), O_RDWR);
+    if (fd >= 0) {
+        lseek(fd, sizeof(PublishQueueFileHeader), SEEK_SET);
+        writeRecords(fd, (const uint8_t *)&info, sizeof(info));
+        close(fd);
+        _log.trace("sealed file %d records=%u keyed=%u", state.appendFileNum, info.recordCount, info.keyedCount);
     }
 }
 
+PublishQueueEvent *PublishQueuePosix::readQueueFile(Priority priority, int fileNum, uint32_t &offset, uint32_t &length, bool &skip) {
+    PublishQueueEvent *result = NULL;
+    FileQueueState &state = fileState[priority];
 
-void PublishQueuePosix::stateWait() {
-    if (!Particle.connected()) {
-        stateHandler = &PublishQueuePosix::stateConnectWait;
-        return;
-    }
+    skip = false;
+    length = 0;
 
-    if (pausePublishing) {
-        canSleep = true;
-        return;
+    if (state.segmentEvents.empty() || state.segmentEvents.front() == 0) {
+        // No records were successfully written to this segment
+        return NULL;
     }
 
-    if (millis() - stateTime < durationMs) {
-        canSleep = (getNumEvents() == 0);
-        return;
+    if (state.readFileNum != fileNum) {
+        state.readFileNum = fileNum;
+        state.readOffset = SEGMENT_DATA_OFFSET;
+        state.readLength = 0;
+        state.readIndex = 0;
     }
-    
-    curFileNum = fileQueue.getFileFromQueue(false);
-    if (curFileNum) {
-        curEvent = readQueueFile(curFileNum);
-        if (!curEvent) {
-            // Probably a corrupted file, discard
-            _log.info("discarding corrupted file %d", curFileNum);
-            fileQueue.getFileFromQueue(true);
-            fileQueue.removeFileNum(curFileNum, false);
-        }
+    if (offset == 0) {
+        offset = state.readOffset;
     }
-    else {
-        if (!ramQueue.empty()) {
-            curEvent = ramQueue.front();
-            ramQueue.pop_front();
+
+    PublishQueueFileHeader hdr;
+    off_t fileSize;
+    int fd = openQueueFile(priority, fileNum, hdr, fileSize);
+    if (fd >= 0) {
+        PublishQueueRecordHeader rec;
+        size_t eventSize = 0;
+        uint32_t timestamp = 0;
+        uint32_t ttl = 0;
+
+        if (hdr.version == 1) {
+            // Single event file
+            if (fileSize >= (off_t)(sizeof(PublishQueueFileHeader) + sizeof(PublishQueueEvent))) {
+                eventSize = fileSize - sizeof(PublishQueueFileHeader);
+                length = eventSize;
+            }
+        }
+        else {
+            if (readRecordHeader(fd, offset, fileSize, rec)) {
+                length = recordLength(rec);
+                if (rec.flags & RECORD_FLAG_SUPERSEDED) {
+                    skip = true;
+                }
+                else
+                if (isExpired(rec.timestamp, rec.ttl)) {
+                    // Discarded from the header alone, the event data is not read
+                    _log.trace("readQueueFile %d offset=%lu expired", fileNum, offset);
+                    skip = true;
+                    stats.expired++;
+                }
+                else {
+                    eventSize = rec.size;
+                    timestamp = rec.timestamp;
+                    ttl = rec.ttl;
+                }
+            }
+        }
+        if (offset == state.readOffset) {
+            state.readLength = length;
+        }
+        _log.trace("fileNum=%d offset=%lu size=%u", fileNum, offset, eventSize);
+
+        if (eventSize) {
+            bool corrupted = false;
+            if (hdr.version == 1) {
+                result = allocEvent(eventSize);
+                if (result) {
+                    read(fd, result, eventSize);
+                }
+            }
+            else {
+                result = readRecordEvent(fd, hdr, rec, eventSize, corrupted);
+                if (result && !readCommitMarker(fd, offset, rec)) {
+                    freeEvent(result);
+                    result = NULL;
+                    corrupted = true;
+                }
+            }
+
+            if (corrupted) {
+                // Only this record is bad; skip it and continue with the rest of the segment
+                _log.info("readQueueFile %d offset=%lu corrupted record", fileNum, offset);
+                skip = true;
+                stats.corrupted++;
+            }
+            else
+            if (result) {
+                PublishQueueEventPool::header(result)->timestamp = timestamp;
+                PublishQueueEventPool::header(result)->ttl = ttl;
+
+                if (((char *)result)[eventSize - 1] == 0 && strlen(result->eventName) < (sizeof(PublishQueueEvent::eventName) - 1)) {
+                    _log.trace("readQueueFile %d event=%s data=%s", fileNum, result->eventName, result->eventData);
+                }
+                else {
+                    _log.trace("readQueueFile %d corrupted event name or data", fileNum);
+                    freeEvent(result);
+                    result = NULL;
+                }
+            }
+        } 
+        else 
+        if (skip) {
+            _log.trace("readQueueFile %d offset=%lu skipped", fileNum, offset);
         }
         else {
-            curEvent = NULL;
+            _log.trace("readQueueFile %d offset=%lu invalid record", fileNum, offset);
         }
+
+        close(fd);
     }
+    return result;
+}
 
-    if (curEvent) {
-        stateTime = millis();
-        stateHandler = &PublishQueuePosix::statePublishWait;
-        publishComplete = false;
-        publishSuccess = false;
-        canSleep = false;
+size_t PublishQueuePosix::scanQueueFile(Priority priority, int fileNum, uint32_t &startOffset, uint32_t &startIndex, uint32_t &endOffset, std::vector<KeyedRecord> *keyedRecords) {
+    size_t count = 0;
+    endOffset = 0;
 
-        // This message is monitored by the automated test tool. If you edit this, change that too.
-        _log.trace("publishing %s event=%s data=%s", (curFileNum ? "file" : "ram"), curEvent->eventName, curEvent->eventData);
+    PublishQueueFileHeader hdr;
+    off_t fileSize;
+    int fd = openQueueFile(priority, fileNum, hdr, fileSize, true);
+    if (fd < 0) {
+        return 0;
+    }
 
-        if (BackgroundPublishRK::instance().publish(curEvent->eventName, curEvent->eventData, curEvent->flags, 
-            [this](bool succeeded, const char *eventName, const char *eventData, const void *context) {
-                publishCompleteCallback(succeeded, eventName, eventData);
-            })) {
-            // Successfully started publish
+    if (hdr.version == 1) {
+        if (fileSize >= (off_t)(sizeof(PublishQueueFileHeader) + sizeof(PublishQueueEvent))) {
+            count = 1;
         }
-    }
-    else {
-        // No events, can sleep
-        canSleep = true;
-    }
-}
-void PublishQueuePosix::statePublishWait() {
-    if (!publishComplete) {
-        return;
+        close(fd);
+        return count;
     }
 
-    if (publishSuccess) {
-        // Remove from the queue
-        _log.trace("publish success %d", curFileNum);
+    PublishQueueSegmentInfo info;
+    PublishQueueRecordHeader rec;
 
-        if (curFileNum) {
-            // Was from the file-based queue
-            int fileNum = fileQueue.getFileFromQueue(false);
-            if (fileNum == curFileNum) {
-                fileQueue.getFileFromQueue(true);
-                fileQueue.removeFileNum(fileNum, false);
-                _log.trace("removed file %d", fileNum);
+    if (readSegmentInfo(fd, info)) {
+        // Sealed: every record was completely written, and the number of records is known
+        if (startOffset == 0) {
+            startOffset = SEGMENT_DATA_OFFSET;
+            startIndex = 0;
+        }
+        if (info.recordCount > startIndex) {
+            count = info.recordCount - startIndex;
+        }
+        if (count && !readRecordHeader(fd, startOffset, fileSize, rec)) {
+            // Cursor offset does not point at a valid record, skip the consumed records instead
+            startOffset = findRecordOffset(fd, fileSize, startIndex);
+            _log.info("cursor offset invalid, resuming file %d at record %lu", fileNum, startIndex);
+            if (!startOffset) {
+                count = 0;
+            }
+        }
+        if (count && keyedRecords && info.keyedCount) {
+            uint32_t offset = startOffset;
+            while(readRecordHeader(fd, offset, fileSize, rec)) {
+                if (rec.supersedeKey && !(rec.flags & (RECORD_FLAG_SUPERSEDED | RECORD_FLAG_MERGE_KEY))) {
+                    keyedRecords->push_back({rec.supersedeKey, fileNum, offset, rec.size, false});
+                }
+                offset += recordLength(rec);
             }
-            curFileNum = 0;
         }
-
-        delete curEvent;
-        curEvent = NULL;
-        durationMs = waitBetweenPublish;
     }
     else {
-        // Wait and retry
-        // This message is monitored by the automated test tool. If you edit this, change that too.
-        _log.trace("publish failed %d", curFileNum);
-        durationMs = waitAfterFailure;
+        // Not sealed: this was being appended to, so check every record for a commit marker
+        uint32_t offset = SEGMENT_DATA_OFFSET;
+        uint32_t index = 0;
+        uint32_t indexOffset = 0;
+        bool found = (startOffset == 0);
+
+        if (found) {
+            startOffset = SEGMENT_DATA_OFFSET;
+            startIndex = 0;
+        }
 
-        if (curFileNum) {
-            // Was from the file-based queue
-            delete curEvent;
-            curEvent = NULL;
+        while(readRecordHeader(fd, offset, fileSize, rec) && readCommitMarker(fd, offset, rec)) {
+            if (!found && offset == startOffset) {
+                startIndex = index;
+                found = true;
+            }
+            if (index == startIndex) {
+                indexOffset = offset;
+            }
+            if (keyedRecords && rec.supersedeKey && !(rec.flags & RECORD_FLAG_SUPERSEDED)) {
+                addKeyedRecord(*keyedRecords, {rec.supersedeKey, fileNum, offset, rec.size, (rec.flags & RECORD_FLAG_MERGE_KEY) != 0});
+            }
+            offset += recordLength(rec);
+            index++;
         }
-        else {
-            // Was in the RAM-based queue, put back
-            WITH_LOCK(*this) {
-                ramQueue.push_front(curEvent);
+
+        if ((off_t)offset < fileSize) {
+            // Torn write: discard the partial record, but keep the complete records before it
+            _log.info("truncating file %d at offset %lu (%ld bytes incompletely written)", fileNum, offset, (long)(fileSize - offset));
+            ftruncate(fd, offset);
+            stats.corrupted++;
+        }
+
+        if (!found) {
+            if (startOffset == offset) {
+                // All of the records were consumed
+                startIndex = index;
+            }
+            else {
+                // Cursor offset does not point at a valid record, skip the consumed records instead
+                _log.info("cursor offset invalid, resuming file %d at record %lu", fileNum, startIndex);
+                startOffset = indexOffset ? indexOffset : offset;
             }
-            // Then write the entire queue to files
-            _log.trace("writing to files after publish failure");
-            writeQueueToFiles();
         }
+        if (index > startIndex) {
+            count = index - startIndex;
+        }
+        endOffset = offset;
     }
+    close(fd);
 
-    stateHandler = &PublishQueuePosix::stateWait;
-    stateTime = millis();
-}
-
+    if (keyedRecords) {
+        // Only unconsumed records can be superseded
+        keyedRecords->erase(std::remove_if(keyedRecords->begin(), keyedRecords->end(), [fileNum, startOffset](const KeyedRecord &keyed) {
+            return keyed.fileNum == fileNum && keyed.offset < startOffset;
+        }), keyedRecords->end());
+    }
 
-PublishQueuePosix::PublishQueuePosix() {
-    fileQueue.withDirPath("/usr/pubqueue");
+    return count;
 }
 
-PublishQueuePosix::~PublishQueuePosix() {
-
+// [static]
+void PublishQueuePosix::addKeyedRecord(std::vector<KeyedRecord> &keyedRecords, const KeyedRecord &keyed) {
+    if (keyed.mergeKey) {
+        // Events are only merged into the newest record, so the index does not grow with the queue
+        for(KeyedRecord &existing : keyedRecords) {
+            if (existing.mergeKey && existing.supersedeKey == keyed.supersedeKey) {
+                existing = keyed;
+                return;
+            }
+        }
+    }
+    keyedRecords.push_back(keyed);
+}
+
+uint32_t PublishQueuePosix::findRecordOffset(int fd, off_t fileSize, uint32_t index) {
+    uint32_t offset = SEGMENT_DATA_OFFSET;
+
+    PublishQueueRecordHeader rec;
+    for(uint32_t ii = 0; readRecordHeader(fd, offset, fileSize, rec); ii++) {
+        if (ii == index) {
+            return offset;
+        }
+        offset += recordLength(rec);
+    }
+    return 0;
+}
+
+void PublishQueuePosix::loadFileQueue(Priority priority) {
+    FileQueueState &state = fileState[priority];
+    SequentialFile &queue = fileQueue[priority];
+
+    state = FileQueueState();
+    while(queue.getQueueLen() > 0) {
+        queue.getFileFromQueue(true);
+    }
+    queue.scanDir();
+
+    // Take all of the files out of the SequentialFile queue; the ones with events are added back below
+    std::deque<int> fileNums;
+    while(int fileNum = queue.getFileFromQueue(true)) {
+        fileNums.push_back(fileNum);
+    }
+    std::sort(fileNums.begin(), fileNums.end());
+
+    String cursorPath = queue.getDirPath() + String("/") + CURSOR_FILENAME;
+    if (fileNums.empty()) {
+        // File numbers restart at 1 when the directory is empty so an old cursor must not be used
+        unlink(cursorPath);
+        return;
+    }
+
+    PublishQueueCursor cursor = {};
+    int fd = open(cursorPath, O_RDONLY);
+    if (fd >= 0) {
+        if (read(fd, &cursor, sizeof(cursor)) != sizeof(cursor) || 
+            cursor.magic != CURSOR_MAGIC || 
+            cursor.crc != crc32(&cursor, offsetof(PublishQueueCursor, crc))) {
+            cursor.fileNum = 0;
+        }
+        close(fd);
+    }
+
+    for(auto it = fileNums.begin(); it != fileNums.end(); it++) {
+        int fileNum = *it;
+        uint32_t startOffset = 0;
+        uint32_t startIndex = 0;
+
+        if (fileNum < cursor.fileNum) {
+            // All events in this segment were consumed, but it was not deleted yet
+            queue.removeFileNum(fileNum, false);
+            continue;
+        }
+        if (fileNum == cursor.fileNum) {
+            startOffset = cursor.offset;
+            startIndex = cursor.index;
+        }
+
+        uint32_t endOffset;
+        size_t count = scanQueueFile(priority, fileNum, startOffset, startIndex, endOffset, &state.keyedRecords);
+        if (count == 0) {
+            _log.info("removing empty or corrupted file %d", fileNum);
+            queue.removeFileNum(fileNum, false);
+            continue;
+        }
+
+        if (state.segmentEvents.empty() && fileNum == cursor.fileNum) {
+            state.readFileNum = fileNum;
+            state.readOffset = startOffset;
+            state.readIndex = startIndex;
+        }
+        queue.addFileToQueue(fileNum);
+        state.segmentEvents.push_back((uint16_t) count);
+        state.numEvents += count;
+
+        struct stat sb;
+        if (stat(queue.getPathForFileNum(fileNum), &sb) == 0) {
+            state.fileBytes += sb.st_size;
+        }
+
+        // Append to the last segment if it is not sealed or a single event file
+        state.appendFileNum = endOffset ? fileNum : 0;
+        state.appendOffset = endOffset;
+        state.appendCount = (uint16_t)(startIndex + count);
+        state.appendKeyedCount = (uint16_t) std::count_if(state.keyedRecords.begin(), state.keyedRecords.end(), [fileNum](const KeyedRecord &keyed) {
+            return keyed.fileNum == fileNum && !keyed.mergeKey;
+        });
+    }
+
+    if (state.appendFileNum) {
+        // Compressed records can only be appended if the segment was created with the same codec
+        PublishQueueFileHeader hdr;
+        off_t fileSize;
+        int fd = openQueueFile(priority, state.appendFileNum, hdr, fileSize);
+        if (fd >= 0) {
+            state.appendCodec = hdr.codec;
+            close(fd);
+        }
+    }
+
+    _log.trace("loadFileQueue priority=%d segments=%u events=%u", (int)priority, state.segmentEvents.size(), state.numEvents);
+}
+
+void PublishQueuePosix::consumeFileEvent(Priority priority) {
+    FileQueueState &state = fileState[priority];
+    SequentialFile &queue = fileQueue[priority];
+
+    int fileNum = queue.getFileFromQueue(false);
+    if (!fileNum || state.segmentEvents.empty()) {
+        return;
+    }
+
+    if (state.readFileNum != fileNum) {
+        state.readFileNum = fileNum;
+        state.readOffset = SEGMENT_DATA_OFFSET;
+        state.readLength = 0;
+        state.readIndex = 0;
+    }
+
+    if (state.readLength == 0) {
+        // Length of the record is not known (discarding an event that was never read)
+        PublishQueueFileHeader hdr;
+        off_t fileSize;
+        int fd = openQueueFile(priority, fileNum, hdr, fileSize);
+        if (fd >= 0) {
+            PublishQueueRecordHeader rec;
+            if (hdr.version != 1 && readRecordHeader(fd, state.readOffset, fileSize, rec)) {
+                state.readLength = recordLength(rec);
+            }
+            close(fd);
+        }
+        if (state.readLength == 0) {
+            // Single event file, or the rest of the segment cannot be read
+            removeOldestSegment(priority);
+            return;
+        }
+    }
+
+    for(auto it = state.keyedRecords.begin(); it != state.keyedRecords.end(); it++) {
+        if (it->fileNum == fileNum && it->offset == state.readOffset) {
+            state.keyedRecords.erase(it);
+            break;
+        }
+    }
+
+    state.readOffset += state.readLength;
+    state.readLength = 0;
+    state.readIndex++;
+    state.numEvents--;
+
+    if (--state.segmentEvents.front() == 0) {
+        removeOldestSegment(priority);
+    }
+    else 
+    if (++state.unsavedCount >= cursorSaveInterval) {
+        saveCursor(priority);
+    }
+}
+
+void PublishQueuePosix::removeOldestSegment(Priority priority) {
+    FileQueueState &state = fileState[priority];
+    SequentialFile &queue = fileQueue[priority];
+
+    int fileNum = queue.getFileFromQueue(true);
+    if (!fileNum || state.segmentEvents.empty()) {
+        return;
+    }
+
+    state.numEvents -= state.segmentEvents.front();
+    state.segmentEvents.pop_front();
+
+    struct stat sb;
+    if (stat(queue.getPathForFileNum(fileNum), &sb) == 0) {
+        state.fileBytes -= std::min(state.fileBytes, (size_t)sb.st_size);
+    }
+
+    for(auto it = state.keyedRecords.begin(); it != state.keyedRecords.end(); ) {
+        if (it->fileNum == fileNum) {
+            it = state.keyedRecords.erase(it);
+        }
+        else {
+            it++;
+        }
+    }
+
+    queue.removeFileNum(fileNum, false);
+    _log.trace("removed file %d", fileNum);
+
+    if (fileNum == state.appendFileNum) {
+        state.appendFileNum = 0;
+    }
+    state.readFileNum = 0;
+    state.readLength = 0;
+    state.readIndex = 0;
+    state.unsavedCount = 0;
+
+    if (state.segmentEvents.empty()) {
+        // Queue is empty, and file numbers will restart at 1 after the next scanDir()
+        String cursorPath = queue.getDirPath() + String("/") + CURSOR_FILENAME;
+        unlink(cursorPath);
+    }
+}
+
+bool PublishQueuePosix::supersedeEvent(Priority priority, PublishQueueEvent *event) {
+    uint32_t supersedeKey = PublishQueueEventPool::header(event)->supersedeKey;
+    bool mergeKey = PublishQueueEventPool::header(event)->mergeKey;
+
+    PublishQueueEvent *oldEvent = ramQueue[priority].find(supersedeKey, mergeKey);
+    if (oldEvent) {
+        ramQueue[priority].replace(oldEvent, event);
+        freeEvent(oldEvent);
+        stats.superseded++;
+        _log.trace("superseded ram event %s", event->eventName);
+        return true;
+    }
+
+    FileQueueState &state = fileState[priority];
+    for(auto it = state.keyedRecords.begin(); it != state.keyedRecords.end(); it++) {
+        if (it->supersedeKey != supersedeKey || it->mergeKey != mergeKey) {
+            continue;
+        }
+        if (isInFlight(priority, it->fileNum, it->offset)) {
+            // Being sent right now, so it can't be changed
+            continue;
+        }
+
+        PublishQueueFileHeader hdr;
+        off_t fileSize;
+        int fd = openQueueFile(priority, it->fileNum, hdr, fileSize, true);
+        if (fd < 0) {
+            continue;
+        }
+
+        // Otherwise the copy that was read ahead would be sent instead of the new event
+        dropReadAhead(priority, it->fileNum, it->offset);
+
+        bool result = false;
+        size_t eventSize = sizeof(PublishQueueEvent) + strlen(event->eventData);
+
+        // In a compressed segment, the new event may only fit in the old record if it's compressed
+        size_t payloadSize = eventSize;
+        PublishQueueEvent *packed = NULL;
+        if (eventSize > it->size && hdr.codec == CODEC_LZSS) {
+            packed = compressEvent(event, eventSize, it->size + 1, payloadSize);
+        }
+        const uint8_t *payload = packed ? (const uint8_t *)packed : (const uint8_t *)event;
+
+        if (payloadSize <= it->size) {
+            // Overwrite the old event, padding with nulls so the record size does not change
+            static const uint8_t zeros[32] = {0};
+
+            PublishQueueRecordHeader rec;
+            rec.size = it->size;
+            rec.flags = (packed ? RECORD_FLAG_COMPRESSED : 0) | (mergeKey ? RECORD_FLAG_MERGE_KEY : 0);
+            rec.headerSize = sizeof(PublishQueueRecordHeader);
+            rec.supersedeKey = supersedeKey;
+            rec.timestamp = PublishQueueEventPool::header(event)->timestamp;
+            rec.ttl = PublishQueueEventPool::header(event)->ttl;
+            if (packed) {
+                // Covers the uncompressed event; the padding after the compressed data is ignored
+                rec.payloadCrc = crc32(event, eventSize);
+            }
+            else {
+                rec.payloadCrc = crc32(payload, payloadSize);
+                for(size_t ii = payloadSize; ii < it->size; ii += sizeof(zeros)) {
+                    rec.payloadCrc = crc32(zeros, std::min(sizeof(zeros), it->size - ii), rec.payloadCrc);
+                }
+            }
+
+            // The header is written after the event, so if the write is interrupted the payload CRC
+            // does not match and the record is skipped instead of sending a partially updated event
+            lseek(fd, it->offset + sizeof(PublishQueueRecordHeader), SEEK_SET);
+            if (writeRecords(fd, payload, payloadSize)) {
+                for(size_t ii = payloadSize; ii < it->size; ii += sizeof(zeros)) {
+                    writeRecords(fd, zeros, std::min(sizeof(zeros), it->size - ii));
+                }
+                lseek(fd, it->offset, SEEK_SET);
+                writeRecordHeader(fd, rec);
+                _log.trace("superseded file event %s fileNum=%d offset=%lu", event->eventName, it->fileNum, it->offset);
+                freeEvent(event);
+                result = true;
+            }
+        }
+        else {
+            // Does not fit, mark the old record as superseded and let the caller queue the new event
+            PublishQueueRecordHeader rec;
+            rec.size = it->size;
+            rec.flags = RECORD_FLAG_SUPERSEDED | (mergeKey ? RECORD_FLAG_MERGE_KEY : 0);
+            rec.headerSize = sizeof(PublishQueueRecordHeader);
+            rec.supersedeKey = supersedeKey;
+            rec.timestamp = 0;
+            rec.payloadCrc = 0;
+            rec.ttl = 0;
+
+            lseek(fd, it->offset, SEEK_SET);
+            writeRecordHeader(fd, rec);
+            _log.trace("superseded file record fileNum=%d offset=%lu", it->fileNum, it->offset);
+        }
+        close(fd);
+        freeEvent(packed);
+
+        if (!result) {
+            state.keyedRecords.erase(it);
+        }
+        stats.superseded++;
+        return result;
+    }
+
+    return false;
+}
+
+bool PublishQueuePosix::mergeEvent(Priority priority, PublishQueueEvent *&event) {
+    if (!writeBuffer) {
+        return false;
+    }
+    uint32_t mergeKey = PublishQueueEventPool::header(event)->supersedeKey;
+
+    // Look in the same order as supersedeEvent() so it replaces the event that was merged
+    PublishQueueEvent *oldEvent = ramQueue[priority].find(mergeKey, true);
+    PublishQueueEvent *fileEvent = NULL;
+    if (!oldEvent) {
+        FileQueueState &state = fileState[priority];
+        for(auto it = state.keyedRecords.begin(); it != state.keyedRecords.end(); it++) {
+            if (it->supersedeKey != mergeKey || !it->mergeKey) {
+                continue;
+            }
+            if (isInFlight(priority, it->fileNum, it->offset)) {
+                // Being sent right now, so it can't be changed
+                continue;
+            }
+            oldEvent = fileEvent = readKeyedEvent(priority, *it);
+            if (!fileEvent) {
+                return false;
+            }
+            break;
+        }
+    }
+    if (!oldEvent) {
+        // First event with this key
+        return false;
+    }
+
+    // writeBuffer is only used by writeQueueToFiles() otherwise, which is not running since the queue is locked
+    char *mergedData = (char *)writeBuffer;
+    bool result = false;
+    if (mergeCallback(event->eventName, oldEvent->eventData, event->eventData, mergedData, WRITE_BUFFER_SIZE)) {
+        mergedData[WRITE_BUFFER_SIZE - 1] = 0;
+
+        PublishQueueEvent *mergedEvent = newRamEvent(event->eventName, mergedData, event->flags);
+        if (mergedEvent) {
+            PublishQueueEventPool::header(mergedEvent)->supersedeKey = mergeKey;
+            PublishQueueEventPool::header(mergedEvent)->mergeKey = true;
+            PublishQueueEventPool::header(mergedEvent)->timestamp = PublishQueueEventPool::header(oldEvent)->timestamp;
+            PublishQueueEventPool::header(mergedEvent)->ttl = PublishQueueEventPool::header(event)->ttl;
+            freeEvent(event);
+            event = mergedEvent;
+            stats.summarized++;
+            _log.trace("merged event %s data=%s", event->eventName, event->eventData);
+            result = true;
+        }
+    }
+    freeEvent(fileEvent);
+
+    return result;
+}
+
+PublishQueueEvent *PublishQueuePosix::readKeyedEvent(Priority priority, const KeyedRecord &keyed) {
+    PublishQueueEvent *result = NULL;
+
+    PublishQueueFileHeader hdr;
+    off_t fileSize;
+    int fd = openQueueFile(priority, keyed.fileNum, hdr, fileSize);
+    if (fd >= 0) {
+        PublishQueueRecordHeader rec;
+        if (hdr.version != 1 && readRecordHeader(fd, keyed.offset, fileSize, rec) && !(rec.flags & RECORD_FLAG_SUPERSEDED)) {
+            size_t eventSize;
+            bool corrupted;
+            result = readRecordEvent(fd, hdr, rec, eventSize, corrupted);
+            if (result && ((char *)result)[eventSize - 1] != 0) {
+                freeEvent(result);
+                result = NULL;
+                corrupted = true;
+            }
+            if (result) {
+                PublishQueueEventPool::header(result)->timestamp = rec.timestamp;
+                PublishQueueEventPool::header(result)->ttl = rec.ttl;
+            }
+            if (corrupted) {
+                _log.trace("readKeyedEvent %d offset=%lu corrupted record", keyed.fileNum, keyed.offset);
+            }
+        }
+        close(fd);
+    }
+    return result;
+}
+
+void PublishQueuePosix::updateSummarizing() {
+    size_t fileQueueLen = getFileQueueLen();
+
+    if (!summarizing) {
+        if (summaryHighWater && mergeCallback && fileQueueLen >= summaryHighWater) {
+            _log.info("file queue has %u events, merging events into summaries", fileQueueLen);
+            summarizing = true;
+        }
+    }
+    else
+    if (fileQueueLen <= summaryLowWater || !summaryHighWater || !mergeCallback) {
+        _log.info("file queue has %u events, no longer merging events", fileQueueLen);
+        summarizing = false;
+    }
+}
+
+// [static]
+uint32_t PublishQueuePosix::supersedeKeyHash(const char *supersedeKey) {
+    uint32_t hash = crc32(supersedeKey, strlen(supersedeKey));
+    return hash ? hash : 1;
+}
+
+void PublishQueuePosix::saveCursor(Priority priority, bool force) {
+    FileQueueState &state = fileState[priority];
+
+    if (!force && state.unsavedCount == 0) {
+        return;
+    }
+
+    PublishQueueCursor cursor;
+    cursor.magic = CURSOR_MAGIC;
+    cursor.fileNum = state.readFileNum;
+    cursor.offset = state.readOffset;
+    cursor.index = state.readIndex;
+    cursor.crc = crc32(&cursor, offsetof(PublishQueueCursor, crc));
+
+    String cursorPath = fileQueue[priority].getDirPath() + String("/") + CURSOR_FILENAME;
+    int fd = open(cursorPath, O_RDWR | O_CREAT | O_TRUNC);
+    if (fd >= 0) {
+        write(fd, &cursor, sizeof(cursor));
+        close(fd);
+        _log.trace("saveCursor priority=%d fileNum=%d offset=%lu index=%lu", (int)priority, (int)cursor.fileNum, cursor.offset, cursor.index);
+    }
+    state.unsavedCount = 0;
+}
+
+void PublishQueuePosix::saveCursors() {
+    WITH_LOCK(*this) {
+        for(int priority = 0; priority < NUM_PRIORITIES; priority++) {
+            saveCursor((Priority)priority);
+            fileQueue[priority].saveManifest();
+        }
+    }
+}
+
+// [static]
+uint32_t PublishQueuePosix::crc32(const void *data, size_t len, uint32_t crc) {
+    // Nibble-at-a-time table, small and fast enough for headers and events
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+    };
+    const uint8_t *p = (const uint8_t *)data;
+
+    crc = ~crc;
+    for(size_t ii = 0; ii < len; ii++) {
+        crc = table[(crc ^ p[ii]) & 0x0f] ^ (crc >> 4);
+        crc = table[(crc ^ (p[ii] >> 4)) & 0x0f] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+void PublishQueuePosix::clearQueues() {
+    WITH_LOCK(*this) {
+        for(int priority = 0; priority < NUM_PRIORITIES; priority++) {
+            while(!ramQueue[priority].empty()) {
+                PublishQueueEvent *event = ramQueue[priority].front();
+                ramQueue[priority].pop_front();
+
+                freeEvent(event);
+            }
+
+            fileQueue[priority].removeAll(true);
+            fileState[priority] = FileQueueState();
+        }
+
+        clearReadAhead();
+
+        for(auto &it : inFlight) {
+            if (it.fileNum) {
+                // File numbers are reused after removeAll(), so don't match a new record when released
+                it.offset = 0;
+            }
+        }
+    }
+
+    _log.trace("clearQueues");
+}
+
+void PublishQueuePosix::setPausePublishing(bool value) { 
+    pausePublishing = value; 
+
+    if (!value) {
+        // When resuming publishing, update the canSleep flag
+        if (getNumEvents() != 0) {
+            canSleep = false;
+        }
+    }
+}
+
+
+
+void PublishQueuePosix::checkQueueLimits() {
+    WITH_LOCK(*this) {
+        if (getRamQueueLen() > ramQueueSize) {
+            // RAM queue is too large, move all to files
+            writeQueueToFiles();
+        }
+
+        for(int priority = 0; priority < NUM_PRIORITIES; priority++) {
+            if (priorityFileQueueSize[priority] == 0) {
+                continue;
+            }
+            while(fileState[priority].numEvents > priorityFileQueueSize[priority]) {
+                discardOldestFile((Priority)priority);
+            }
+        }
+
+        while(getFileQueueLen() > fileQueueSize) {
+            // Discard from the lowest priority class that has files first
+            for(int priority = NUM_PRIORITIES - 1; priority >= 0; priority--) {
+                if (fileState[priority].numEvents > 0) {
+                    discardOldestFile((Priority)priority);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+void PublishQueuePosix::discardOldestFile(Priority priority) {
+    int fileNum = fileQueue[priority].getFileFromQueue(false);
+    if (fileNum) {
+        _log.info("discarded event %d offset %lu priority %d", fileNum, fileState[priority].readOffset, (int)priority);
+        consumeFileEvent(priority);
+        stats.discarded++;
+    }
+}
+
+size_t PublishQueuePosix::getRamQueueLen() const {
+    size_t result = 0;
+
+    for(int priority = 0; priority < NUM_PRIORITIES; priority++) {
+        result += ramQueue[priority].size();
+    }
+    return result;
+}
+
+size_t PublishQueuePosix::getFileQueueLen() const {
+    size_t result = 0;
+
+    for(int priority = 0; priority < NUM_PRIORITIES; priority++) {
+        result += fileState[priority].numEvents;
+    }
+    return result;
+}
+
+size_t PublishQueuePosix::getNumEvents() {
+    size_t result = 0;
+
+    WITH_LOCK(*this) {
+        result = getRamQueueLen() + getFileQueueLen();
+
+        for(const auto &it : inFlight) {
+            if (it.event && it.fileNum == 0) {
+                // This happens when we are sending an event from the RAM queue
+                // It's not in the RAM queue, but we want to count it, because
+                // otherwise getNumEvents would return 1 for the event sent from
+                // a file (because the file is not deleted until sent) and
+                // this makes the behavior consistent.
+                result++;
+            }
+        }
+    }
+    return result;
+}
+
+void PublishQueuePosix::publishCompleteCallback(bool succeeded, const char *eventName, const char *eventData, uint32_t id) {
+    WITH_LOCK(*this) {
+        for(auto &it : inFlight) {
+            if (it.id == id) {
+                it.complete = true;
+                it.success = succeeded;
+                break;
+            }
+        }
+    }
+
+    if (publishCompleteUserCallback) {
+        publishCompleteUserCallback(succeeded, eventName, eventData);
+    }
+}
+
+size_t PublishQueuePosix::getNumInFlight() const {
+    size_t result = 0;
+
+    for(const auto &it : inFlight) {
+        if (it.event) {
+            result++;
+        }
+    }
+    return result;
+}
+
+bool PublishQueuePosix::isInFlight(Priority priority, int fileNum, uint32_t offset) const {
+    for(const auto &it : inFlight) {
+        if (it.event && it.priority == priority && it.fileNum == fileNum && it.offset == offset) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void PublishQueuePosix::stateConnectWait() {
+    canSleep = (pausePublishing || getNumEvents() == 0);
+    if (canSleep) {
+        saveCursors();
+    }
+
+    if (Particle.connected()) {
+        stateTime = millis();
+        durationMs = waitAfterConnect;
+        stateHandler = &PublishQueuePosix::stateWait;
+    }
+}
+
+
+void PublishQueuePosix::stateWait() {
+    if (!Particle.connected()) {
+        stateHandler = &PublishQueuePosix::stateConnectWait;
+        return;
+    }
+
+    if (pausePublishing) {
+        if (!canSleep && inFlight.empty()) {
+            saveCursors();
+        }
+        canSleep = inFlight.empty();
+        return;
+    }
+
+    while(millis() - stateTime >= durationMs && refillPublishTokens()) {
+        bool failed = false;
+        WITH_LOCK(*this) {
+            for(const auto &it : inFlight) {
+                if (it.complete && !it.success) {
+                    failed = true;
+                    break;
+                }
+            }
+        }
+        if (failed || getNumInFlight() >= maxInFlight || !publishNextEvent()) {
+            // Wait for a failed publish to be retried, a publish to complete, or a new event
+            break;
+        }
+    }
+
+    canSleep = (inFlight.empty() && getNumEvents() == 0);
+}
+
+bool PublishQueuePosix::publishNextEvent() {
+    InFlightEvent entry = {};
+
+    // Strict priority: take the oldest event from the highest priority class that has one.
+    // Within a class, files are older than anything in the RAM queue.
+    WITH_LOCK(*this) {
+        bool blocked = false;
+
+        for(int priority = 0; priority < NUM_PRIORITIES && !entry.event && !blocked; priority++) {
+            FileQueueState &state = fileState[priority];
+
+            int fileNum;
+            while(!entry.event && (fileNum = fileQueue[priority].getFileFromQueue(false)) != 0) {
+                // Continue after the events from this segment that are already in flight
+                size_t numInFlight;
+                uint32_t offset = getNextReadOffset((Priority)priority, fileNum, false, numInFlight);
+                if (state.segmentEvents.empty() || (numInFlight && numInFlight >= state.segmentEvents.front())) {
+                    // Everything in the segment is in flight; the next one is sent after they complete.
+                    // A segment that no records were written to is discarded below.
+                    blocked = true;
+                    break;
+                }
+
+                bool skip;
+                uint32_t length;
+                PublishQueueEvent *event;
+                if (!takeReadAhead((Priority)priority, fileNum, offset, length, skip, event)) {
+                    event = readQueueFile((Priority)priority, fileNum, offset, length, skip);
+                }
+                if (event && isExpired(PublishQueueEventPool::header(event)->timestamp, PublishQueueEventPool::header(event)->ttl)) {
+                    // Expired after it was read ahead
+                    freeEvent(event);
+                    event = NULL;
+                    skip = true;
+                    stats.expired++;
+                }
+                if (!event && numInFlight) {
+                    if (skip) {
+                        // Superseded, expired, or corrupted, consume it after the events before it are released
+                        InFlightEvent skipped = {};
+                        skipped.priority = (Priority)priority;
+                        skipped.fileNum = fileNum;
+                        skipped.offset = offset;
+                        skipped.length = length;
+                        skipped.complete = skipped.success = true;
+                        inFlight.push_back(skipped);
+                        continue;
+                    }
+                    // The rest of the segment is discarded once nothing from it is in flight
+                    blocked = true;
+                    break;
+                }
+                if (event) {
+                    entry.event = event;
+                    entry.priority = (Priority)priority;
+                    entry.fileNum = fileNum;
+                    entry.offset = offset;
+                    entry.length = length;
+                }
+                else
+                if (skip) {
+                    // Replaced by a newer event, expired, or corrupted, skip it
+                    consumeFileEvent((Priority)priority);
+                }
+                else {
+                    // Probably a corrupted file, discard the rest of it
+                    _log.info("discarding corrupted file %d", fileNum);
+                    removeOldestSegment((Priority)priority);
+                }
+            }
+            while(!entry.event && !blocked && state.numEvents == 0 && !ramQueue[priority].empty()) {
+                PublishQueueEvent *event = ramQueue[priority].front();
+                ramQueue[priority].pop_front();
+
+                if (isExpired(PublishQueueEventPool::header(event)->timestamp, PublishQueueEventPool::header(event)->ttl)) {
+                    _log.trace("discarding expired event %s", event->eventName);
+                    freeEvent(event);
+                    stats.expired++;
+                    continue;
+                }
+                entry.event = event;
+                entry.priority = (Priority)priority;
+            }
+        }
+
+        if (entry.event) {
+            entry.id = nextInFlightId++;
+            inFlight.push_back(entry);
+        }
+    }
+
+    if (!entry.event) {
+        return false;
+    }
+
+    bucketCreditMs -= publishIntervalMs;
+    canSleep = false;
+
+    // This message is monitored by the automated test tool. If you edit this, change that too.
+    _log.trace("publishing %s event=%s data=%s", (entry.fileNum ? "file" : "ram"), entry.event->eventName, entry.event->eventData);
+
+    if (!BackgroundPublishRK::instance().publish(entry.event->eventName, entry.event->eventData, entry.event->flags, 
+        [this](bool succeeded, const char *eventName, const char *eventData, const void *context) {
+            publishCompleteCallback(succeeded, eventName, eventData, (uint32_t)(uintptr_t)context);
+        }, (const void *)(uintptr_t)entry.id)) {
+        // No publish slot available, put it back
+        _log.trace("publish could not be started");
+        WITH_LOCK(*this) {
+            clearReadAhead();
+
+            for(auto it = inFlight.begin(); it != inFlight.end(); it++) {
+                if (it->id == entry.id) {
+                    inFlight.erase(it);
+                    break;
+                }
+            }
+            if (entry.fileNum) {
+                freeEvent(entry.event);
+            }
+            else {
+                ramQueue[entry.priority].push_front(entry.event);
+            }
+        }
+        return false;
+    }
+    return true;
+}
+
+void PublishQueuePosix::readAheadEvent() {
+    WITH_LOCK(*this) {
+        if (readAhead.size() >= readAheadCount) {
+            return;
+        }
+
+        // The same class publishNextEvent() would send from next
+        for(int priority = 0; priority < NUM_PRIORITIES; priority++) {
+            FileQueueState &state = fileState[priority];
+
+            int fileNum = fileQueue[priority].getFileFromQueue(false);
+            if (!fileNum) {
+                if (!ramQueue[priority].empty()) {
+                    // Sent from RAM, nothing to read
+                    return;
+                }
+                continue;
+            }
+
+            size_t count;
+            uint32_t offset = getNextReadOffset((Priority)priority, fileNum, true, count);
+            if (state.segmentEvents.empty() || count >= state.segmentEvents.front()) {
+                // The rest of the segment is in flight or read ahead
+                return;
+            }
+
+            InFlightEvent entry = {};
+            bool skip;
+            entry.event = readQueueFile((Priority)priority, fileNum, offset, entry.length, skip);
+            if (entry.event || skip) {
+                entry.priority = (Priority)priority;
+                entry.fileNum = fileNum;
+                entry.offset = offset;
+                readAhead.push_back(entry);
+            }
+            return;
+        }
+    }
+}
+
+bool PublishQueuePosix::takeReadAhead(Priority priority, int fileNum, uint32_t &offset, uint32_t &length, bool &skip, PublishQueueEvent *&event) {
+    FileQueueState &state = fileState[priority];
+    uint32_t nextOffset = offset ? offset : state.readOffset;
+
+    for(auto it = readAhead.begin(); it != readAhead.end(); ) {
+        if (it->priority != priority) {
+            it++;
+            continue;
+        }
+        if (it->fileNum != fileNum || state.readFileNum != fileNum || it->offset < nextOffset) {
+            // Consumed or discarded by checkQueueLimits() after it was read
+            freeEvent(it->event);
+            it = readAhead.erase(it);
+            continue;
+        }
+        if (it->offset != nextOffset) {
+            dropReadAhead(priority, it->fileNum, it->offset);
+            return false;
+        }
+
+        offset = it->offset;
+        length = it->length;
+        event = it->event;
+        skip = (event == NULL);
+        readAhead.erase(it);
+
+        if (offset == state.readOffset) {
+            state.readLength = length;
+        }
+        return true;
+    }
+    return false;
+}
+
+void PublishQueuePosix::dropReadAhead(Priority priority, int fileNum, uint32_t offset) {
+    bool found = false;
+
+    for(auto it = readAhead.begin(); it != readAhead.end(); ) {
+        if (it->priority == priority && (found || (it->fileNum == fileNum && it->offset == offset))) {
+            found = true;
+            freeEvent(it->event);
+            it = readAhead.erase(it);
+        }
+        else {
+            it++;
+        }
+    }
+}
+
+void PublishQueuePosix::clearReadAhead() {
+    for(auto &it : readAhead) {
+        freeEvent(it.event);
+    }
+    readAhead.clear();
+}
+
+uint32_t PublishQueuePosix::getNextReadOffset(Priority priority, int fileNum, bool includeReadAhead, size_t &count) const {
+    const FileQueueState &state = fileState[priority];
+    uint32_t offset = 0;
+
+    // Records before the consumed offset were discarded by checkQueueLimits() after they were read
+    count = 0;
+    for(const auto &it : inFlight) {
+        if (it.priority == priority && it.fileNum == fileNum && state.readFileNum == fileNum && it.offset >= state.readOffset) {
+            count++;
+            offset = it.offset + it.length;
+        }
+    }
+    if (includeReadAhead) {
+        for(const auto &it : readAhead) {
+            if (it.priority == priority && it.fileNum == fileNum && state.readFileNum == fileNum && it.offset >= state.readOffset) {
+                count++;
+                offset = it.offset + it.length;
+            }
+        }
+    }
+    return offset;
+}
+
+size_t PublishQueuePosix::scanQueuedEvents(std::function<bool(const QueuedEventInfo &info)> callback) {
+    size_t count = 0;
+
+    WITH_LOCK(*this) {
+        for(int priority = 0; priority < NUM_PRIORITIES; priority++) {
+            FileQueueState &state = fileState[priority];
+            QueuedEventInfo info = {};
+            info.priority = (Priority)priority;
+
+            // Files are older than anything in the RAM queue
+            bool first = true;
+            for(int fileNum : fileQueue[priority].getQueueFileNums()) {
+                PublishQueueFileHeader hdr;
+                off_t fileSize;
+                int fd = openQueueFile((Priority)priority, fileNum, hdr, fileSize);
+                if (fd < 0) {
+                    continue;
+                }
+                if (hdr.version == 1) {
+                    info.timestamp = 0;
+                    info.ttl = 0;
+                    info.size = fileSize - sizeof(PublishQueueFileHeader);
+                    info.keyed = false;
+                    count++;
+                    if (!callback(info)) {
+                        close(fd);
+                        return count;
+                    }
+                }
+                else {
+                    uint32_t offset = (first && state.readFileNum == fileNum) ? state.readOffset : SEGMENT_DATA_OFFSET;
+                    PublishQueueRecordHeader rec;
+                    for(; readRecordHeader(fd, offset, fileSize, rec); offset += recordLength(rec)) {
+                        if ((rec.flags & RECORD_FLAG_SUPERSEDED) != 0 || isInFlight((Priority)priority, fileNum, offset)) {
+                            continue;
+                        }
+                        info.timestamp = rec.timestamp;
+                        info.ttl = rec.ttl;
+                        info.size = rec.size;
+                        info.keyed = (rec.supersedeKey != 0);
+                        count++;
+                        if (!callback(info)) {
+                            close(fd);
+                            return count;
+                        }
+                    }
+                }
+                close(fd);
+                first = false;
+            }
+
+            info.inRam = true;
+            for(PublishQueueEvent *event = ramQueue[priority].front(); event; event = ramQueue[priority].next(event)) {
+                PublishQueueEventPool::BlockHeader *blockHdr = PublishQueueEventPool::header(event);
+                info.timestamp = blockHdr->timestamp;
+                info.ttl = blockHdr->ttl;
+                info.size = offsetof(PublishQueueEvent, eventData) + strlen(event->eventData) + 1;
+                info.keyed = (blockHdr->supersedeKey != 0);
+                count++;
+                if (!callback(info)) {
+                    return count;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+void PublishQueuePosix::releaseCompletedEvents() {
+    WITH_LOCK(*this) {
+        while(!inFlight.empty() && inFlight.front().complete && inFlight.front().success) {
+            InFlightEvent &entry = inFlight.front();
+
+            if (entry.event) {
+                // This message is monitored by the automated test tool. If you edit this, change that too.
+                _log.trace("publish success %d", entry.fileNum);
+            }
+
+            if (entry.fileNum) {
+                // Was from the file-based queue. Advance the consumed offset unless the event 
+                // was discarded by checkQueueLimits() while it was being sent.
+                FileQueueState &state = fileState[entry.priority];
+                int fileNum = fileQueue[entry.priority].getFileFromQueue(false);
+                if (fileNum == entry.fileNum && state.readFileNum == entry.fileNum && state.readOffset == entry.offset) {
+                    state.readLength = entry.length;
+                    consumeFileEvent(entry.priority);
+                    _log.trace("consumed file %d offset %lu", fileNum, entry.offset);
+                }
+            }
+
+            if (entry.event) {
+                updateSentStats(entry.event);
+                freeEvent(entry.event);
+                consecutiveFailures = 0;
+                durationMs = 0;
+            }
+            inFlight.pop_front();
+        }
+
+        if (inFlight.empty() || !inFlight.front().complete) {
+            return;
+        }
+        for(const auto &it : inFlight) {
+            if (!it.complete) {
+                // Wait for the rest so they are not sent twice at the same time
+                return;
+            }
+        }
+
+        // Wait and retry
+        // This message is monitored by the automated test tool. If you edit this, change that too.
+        _log.trace("publish failed %d", inFlight.front().fileNum);
+        consecutiveFailures++;
+        stats.failures++;
+        durationMs = getFailureBackoff();
+        stateTime = millis();
+        _log.trace("retry in %lu ms", durationMs);
+
+        // Events from files are read again. Put events from the RAM queue back in the 
+        // same order, then write the entire queue to files.
+        clearReadAhead();
+        bool ramEvents = false;
+        for(auto it = inFlight.rbegin(); it != inFlight.rend(); it++) {
+            if (it->event && it->fileNum == 0) {
+                ramQueue[it->priority].push_front(it->event);
+                ramEvents = true;
+            }
+            else {
+                freeEvent(it->event);
+            }
+        }
+        inFlight.clear();
+
+        if (ramEvents) {
+            _log.trace("writing to files after publish failure");
+            writeQueueToFiles();
+        }
+    }
+}
+
+
+PublishQueuePosix::QueueStats PublishQueuePosix::getStats() {
+    QueueStats result;
+    uint32_t now = Time.isValid() ? (uint32_t) Time.now() : 0;
+    uint32_t oldest = 0;
+
+    WITH_LOCK(*this) {
+        result = stats;
+        result.ramEvents = getRamQueueLen();
+        result.fileEvents = getFileQueueLen();
+        result.fileBytes = 0;
+
+        for(int priority = 0; priority < NUM_PRIORITIES; priority++) {
+            result.fileBytes += fileState[priority].fileBytes;
+
+            // File events are older than RAM events in the same priority class
+            uint32_t timestamp = 0;
+            if (fileState[priority].numEvents) {
+                timestamp = getFileQueueTimestamp((Priority)priority);
+            }
+            else
+            if (!ramQueue[priority].empty()) {
+                timestamp = PublishQueueEventPool::header(ramQueue[priority].front())->timestamp;
+            }
+            if (timestamp && (!oldest || timestamp < oldest)) {
+                oldest = timestamp;
+            }
+        }
+        for(const auto &it : inFlight) {
+            uint32_t timestamp = it.event ? PublishQueueEventPool::header(it.event)->timestamp : 0;
+            if (timestamp && (!oldest || timestamp < oldest)) {
+                oldest = timestamp;
+            }
+        }
+    }
+    result.oldestAge = (oldest && now > oldest) ? (now - oldest) : 0;
+
+    return result;
+}
+
+String PublishQueuePosix::getStatsJson() {
+    QueueStats s = getStats();
+    char buf[256];
+
+    JSONBufferWriter writer(buf, sizeof(buf) - 1);
+    writer.beginObject();
+    writer.name("ram").value((unsigned)s.ramEvents);
+    writer.name("file").value((unsigned)s.fileEvents);
+    writer.name("bytes").value((unsigned)s.fileBytes);
+    writer.name("age").value((unsigned)s.oldestAge);
+    writer.name("pub").value((unsigned)s.published);
+    writer.name("fail").value((unsigned)s.failures);
+    writer.name("drop").value((unsigned)s.discarded);
+    writer.name("sup").value((unsigned)s.superseded);
+    writer.name("bad").value((unsigned)s.corrupted);
+    writer.name("mrg").value((unsigned)s.summarized);
+    writer.name("exp").value((unsigned)s.expired);
+    writer.name("lat").beginArray();
+    for(size_t ii = 0; ii < NUM_LATENCY_BUCKETS; ii++) {
+        writer.value((unsigned)s.latency[ii]);
+    }
+    writer.endArray();
+    writer.name("att").beginArray();
+    for(size_t ii = 0; ii < NUM_ATTEMPT_BUCKETS; ii++) {
+        writer.value((unsigned)s.attempts[ii]);
+    }
+    writer.endArray();
+    writer.endObject();
+    writer.buffer()[std::min(writer.bufferSize(), writer.dataSize())] = 0;
+
+    return String(buf);
+}
+
+PublishQueuePosix &PublishQueuePosix::withStatsVariable(const char *name) {
+    Particle.variable(name, [this]() {
+        return getStatsJson();
+    });
+    return *this;
+}
+
+uint32_t PublishQueuePosix::getFileQueueTimestamp(Priority priority) {
+    uint32_t result = 0;
+
+    int fileNum = fileQueue[priority].getFileFromQueue(false);
+    if (fileNum) {
+        FileQueueState &state = fileState[priority];
+        uint32_t offset = (state.readFileNum == fileNum) ? state.readOffset : SEGMENT_DATA_OFFSET;
+
+        PublishQueueFileHeader hdr;
+        off_t fileSize;
+        int fd = openQueueFile(priority, fileNum, hdr, fileSize);
+        if (fd >= 0) {
+            PublishQueueRecordHeader rec;
+            if (hdr.version != 1 && readRecordHeader(fd, offset, fileSize, rec)) {
+                result = rec.timestamp;
+            }
+            close(fd);
+        }
+    }
+    return result;
+}
+
+void PublishQueuePosix::updateSentStats(PublishQueueEvent *event) {
+    stats.published++;
+
+    size_t attempts = std::min((size_t)consecutiveFailures, NUM_ATTEMPT_BUCKETS - 1);
+    stats.attempts[attempts]++;
+
+    uint32_t timestamp = PublishQueueEventPool::header(event)->timestamp;
+    if (timestamp && Time.isValid() && (uint32_t)Time.now() >= timestamp) {
+        uint32_t latency = (uint32_t)Time.now() - timestamp;
+
+        size_t bucket = 0;
+        while(bucket < NUM_LATENCY_BUCKETS - 1 && latency >= latencyBucketLimits[bucket]) {
+            bucket++;
+        }
+        stats.latency[bucket]++;
+    }
+}
+
+bool PublishQueuePosix::refillPublishTokens() {
+    unsigned long now = millis();
+    unsigned long maxCreditMs = publishIntervalMs * publishBurst;
+
+    if (now - bucketLastMs >= maxCreditMs - bucketCreditMs) {
+        bucketCreditMs = maxCreditMs;
+    }
+    else {
+        bucketCreditMs += now - bucketLastMs;
+    }
+    bucketLastMs = now;
+
+    return bucketCreditMs >= publishIntervalMs;
+}
+
+unsigned long PublishQueuePosix::getFailureBackoff() const {
+    unsigned long result = failureBackoffMinMs;
+    for(unsigned int ii = 1; ii < consecutiveFailures && result < failureBackoffMaxMs; ii++) {
+        result *= 2;
+    }
+    if (result > failureBackoffMaxMs) {
+        result = failureBackoffMaxMs;
+    }
+
+    // Subtract a random jitter of up to half of the delay
+    if (result >= 2) {
+        result -= rand() % (result / 2);
+    }
+    return result;
+}
+
+PublishQueuePosix::PublishQueuePosix() {
+    withDirPath("/usr/pubqueue");
+}
+
+PublishQueuePosix::~PublishQueuePosix() {
+
 }
 
 void PublishQueuePosix::systemEventHandler(system_event_t event, int param) {
     if ((event == reset) || ((event == cloud_status) && (param == cloud_status_disconnecting))) {
         _log.trace("reset or disconnect event, save files to queue");
         PublishQueuePosix::instance().writeQueueToFiles();
+        PublishQueuePosix::instance().saveCursors();
+    }
+}
+
+
+void PublishQueueEventPool::setup(const size_t counts[NUM_SIZE_CLASSES]) {
+    for(size_t sizeClass = 0; sizeClass < NUM_SIZE_CLASSES; sizeClass++) {
+        if (slab[sizeClass] || counts[sizeClass] == 0) {
+            continue;
+        }
+
+        // Round up so every block header is aligned
+        const size_t align = sizeof(BlockHeader *);
+        size_t blockSize = (sizeof(BlockHeader) + sizeClassSizes[sizeClass] + align - 1) / align * align;
+
+        slab[sizeClass] = new uint8_t[blockSize * counts[sizeClass]];
+        if (!slab[sizeClass]) {
+            _log.error("event pool out of memory size class %u", sizeClass);
+            continue;
+        }
+        stats.count[sizeClass] = counts[sizeClass];
+
+        for(size_t ii = counts[sizeClass]; ii-- > 0; ) {
+            BlockHeader *hdr = (BlockHeader *)&slab[sizeClass][ii * blockSize];
+            hdr->sizeClass = sizeClass;
+            hdr->next = freeList[sizeClass];
+            freeList[sizeClass] = hdr;
+        }
+    }
+}
+
+PublishQueueEvent *PublishQueueEventPool::alloc(size_t eventSize) {
+    BlockHeader *hdr = 0;
+
+    for(size_t sizeClass = 0; sizeClass < NUM_SIZE_CLASSES; sizeClass++) {
+        if (eventSize <= sizeClassSizes[sizeClass] && freeList[sizeClass]) {
+            hdr = freeList[sizeClass];
+            freeList[sizeClass] = hdr->next;
+
+            stats.poolAllocs++;
+            if (++stats.inUse[sizeClass] > stats.highWater[sizeClass]) {
+                stats.highWater[sizeClass] = stats.inUse[sizeClass];
+            }
+            break;
+        }
+    }
+
+    if (!hdr) {
+        hdr = (BlockHeader *) new uint8_t[sizeof(BlockHeader) + eventSize];
+        if (!hdr) {
+            return NULL;
+        }
+        hdr->sizeClass = HEAP_BLOCK;
+        stats.heapAllocs++;
+        stats.heapInUse++;
+    }
+    hdr->next = 0;
+    hdr->supersedeKey = 0;
+    hdr->ttl = 0;
+    hdr->mergeKey = false;
+
+    return event(hdr);
+}
+
+void PublishQueueEventPool::free(PublishQueueEvent *ev) {
+    if (!ev) {
+        return;
+    }
+    BlockHeader *hdr = header(ev);
+
+    if (hdr->sizeClass == HEAP_BLOCK) {
+        stats.heapInUse--;
+        delete[] (uint8_t *)hdr;
+        return;
+    }
+
+    hdr->next = freeList[hdr->sizeClass];
+    freeList[hdr->sizeClass] = hdr;
+    stats.inUse[hdr->sizeClass]--;
+}
+
+
+void PublishQueueEventList::push_back(PublishQueueEvent *event) {
+    PublishQueueEventPool::BlockHeader *hdr = PublishQueueEventPool::header(event);
+
+    hdr->next = 0;
+    if (tail) {
+        tail->next = hdr;
+    }
+    else {
+        head = hdr;
+    }
+    tail = hdr;
+    count++;
+}
+
+void PublishQueueEventList::push_front(PublishQueueEvent *event) {
+    PublishQueueEventPool::BlockHeader *hdr = PublishQueueEventPool::header(event);
+
+    hdr->next = head;
+    head = hdr;
+    if (!tail) {
+        tail = hdr;
+    }
+    count++;
+}
+
+PublishQueueEvent *PublishQueueEventList::find(uint32_t supersedeKey, bool mergeKey) const {
+    for(PublishQueueEventPool::BlockHeader *hdr = head; hdr; hdr = hdr->next) {
+        if (hdr->supersedeKey == supersedeKey && hdr->mergeKey == mergeKey) {
+            return PublishQueueEventPool::event(hdr);
+        }
+    }
+    return 0;
+}
+
+PublishQueueEvent *PublishQueueEventList::next(PublishQueueEvent *event) const {
+    PublishQueueEventPool::BlockHeader *hdr = PublishQueueEventPool::header(event)->next;
+
+    return hdr ? PublishQueueEventPool::event(hdr) : 0;
+}
+
+void PublishQueueEventList::replace(PublishQueueEvent *oldEvent, PublishQueueEvent *newEvent) {
+    PublishQueueEventPool::BlockHeader *oldHdr = PublishQueueEventPool::header(oldEvent);
+    PublishQueueEventPool::BlockHeader *newHdr = PublishQueueEventPool::header(newEvent);
+
+    newHdr->next = oldHdr->next;
+    if (head == oldHdr) {
+        head = newHdr;
     }
+    else {
+        for(PublishQueueEventPool::BlockHeader *hdr = head; hdr; hdr = hdr->next) {
+            if (hdr->next == oldHdr) {
+                hdr->next = newHdr;
+                break;
+            }
+        }
+    }
+    if (tail == oldHdr) {
+        tail = newHdr;
+    }
+    oldHdr->next = 0;
 }
 
+void PublishQueueEventList::pop_front() {
+    if (head) {
+        head = head->next;
+        if (!head) {
+            tail = 0;
+        }
+        count--;
+    }
+}
@@ -6,21 +6,80 @@
 
 #include "Particle.h"
 #include "SequentialFileRK.h"
+#include "PublishQueueLZSS.h"
 
 #include <deque>
+#include <vector>
 
 /**
- * @brief Structure stored before the event data in files on the flash file system
+ * @brief Structure stored at the beginning of files on the flash file system
  * 
- * Each file is sequentially numbered and has one event. The contents of the file
- * are this header (8 bytes) followed by the PublishQueueEvent structure, which
- * is variably sized based on the size of the event.    
+ * Files are sequentially numbered. In version 2 files (segments) this header (8 bytes)
+ * is followed by a PublishQueueSegmentInfo (8 bytes) and then any number of records. Each
+ * record is a PublishQueueRecordHeader, a PublishQueueEvent structure, which is variably 
+ * sized based on the size of the event, and a 4-byte commit marker 
+ * (PublishQueuePosix::RECORD_COMMIT_MARKER).
+ * 
+ * A record with PublishQueuePosix::RECORD_FLAG_COMPRESSED has the uncompressed size of the
+ * PublishQueueEvent (uint16_t) followed by the event compressed with the codec in the file header
+ * instead of the event itself.
+ * 
+ * In version 1 files, written by earlier versions of the library, each file has one event 
+ * and the header is followed directly by the PublishQueueEvent structure. These are still
+ * read and sent, but are no longer written.
  */
 struct PublishQueueFileHeader {
     uint32_t magic;         //!< PublishQueuePosix::FILE_MAGIC = 0x31b67663
-    uint8_t version;        //!< PublishQueuePosix::FILE_VERSION = 1
+    uint8_t version;        //!< PublishQueuePosix::FILE_VERSION = 2 (1 = one event per file)
     uint8_t headerSize;     //!< sizeof(PublishQueueFileHeader) = 8
-    uint16_t nameLen;       //!< sizeof(PublishQueueEvent::eventName) = 64
+    uint8_t nameLen;        //!< sizeof(PublishQueueEvent::eventName) = 64
+    uint8_t codec;          //!< Codec for compressed records, PublishQueuePosix::CODEC_NONE or CODEC_LZSS (0 in older files)
+};
+
+/**
+ * @brief Structure stored after the file header in a segment file
+ * 
+ * This is written as zeros when the segment is created, and filled in (sealed) when the 
+ * next segment is started, at which point no more records will be appended. At startup the 
+ * records in a sealed segment do not need to be scanned; only the segment that was being 
+ * appended to is checked for a partially written (torn) record.
+ */
+struct PublishQueueSegmentInfo {
+    uint16_t recordCount;   //!< Number of records in the segment
+    uint16_t keyedCount;    //!< Number of records with a supersede key (not a merge key), 0 if they do not need to be scanned for
+    uint32_t crc;           //!< CRC32 of the preceding fields. Any other value means the segment is not sealed.
+};
+
+/**
+ * @brief Structure stored before each event in a segment file
+ * 
+ * Records are only ever appended to a segment. Sent records are not removed; instead the
+ * consumed offset in the PublishQueueCursor is advanced, and the segment file is deleted 
+ * once all of its records have been consumed.
+ */
+struct PublishQueueRecordHeader {
+    uint16_t size;          //!< Size of the PublishQueueEvent that follows, including the null terminator, or of the compressed event
+    uint8_t flags;          //!< PublishQueuePosix::RECORD_FLAG_SUPERSEDED, RECORD_FLAG_COMPRESSED, RECORD_FLAG_MERGE_KEY, or 0
+    uint8_t headerSize;     //!< sizeof(PublishQueueRecordHeader) = 24
+    uint32_t supersedeKey;  //!< Hash of the supersede or merge key, or 0 if the event does not have one
+    uint32_t timestamp;     //!< Time.now() when the event was published, or 0 if the time was not valid
+    uint32_t payloadCrc;    //!< CRC32 of the PublishQueueEvent that follows, after decompressing if RECORD_FLAG_COMPRESSED
+    uint32_t crc;           //!< CRC32 of this header with crc set to 0
+    uint32_t ttl;           //!< Seconds after timestamp that the event expires and is discarded instead of sent, or 0
+};
+
+/**
+ * @brief Consumed-offset pointer, stored in the cursor file in each queue directory
+ * 
+ * This is saved periodically, not after every event, so after an unexpected reset a
+ * few already-sent events may be sent again.
+ */
+struct PublishQueueCursor {
+    uint32_t magic;         //!< PublishQueuePosix::CURSOR_MAGIC
+    int32_t fileNum;        //!< Segment file number that offset refers to
+    uint32_t offset;        //!< File offset of the first unconsumed record in the segment
+    uint32_t index;         //!< Number of records consumed in the segment, used if offset is not a valid record
+    uint32_t crc;           //!< CRC32 of the preceding fields
 };
 
 /**
@@ -28,8 +87,9 @@ struct PublishQueueFileHeader {
  * 
  * In RAM, this structure is stored in the ramQueue. 
  * 
- * On the flash file system, each file contains one event and consists of the
- * PublishQueueFileHeader above (8 bytes) plus this structure.
+ * On the flash file system, each record in a segment file consists of a 
+ * PublishQueueRecordHeader (24 bytes), this structure (compressed if RECORD_FLAG_COMPRESSED),
+ * and a 4-byte commit marker.
  * 
  * Note that the eventData is specified as 1 byte here, but it's actually
  * sized to fit the event data with a null terminator.
@@ -40,12 +100,323 @@ struct PublishQueueEvent {
     char eventData[1]; //!< Variable size event data
 };
 
+/**
+ * @brief Fixed-size block allocator for PublishQueueEvent structures
+ * 
+ * Events are allocated from a small number of size classes. The slabs for each class
+ * are allocated once, in setup(), and events are then taken from and returned to a
+ * free list so publishing does not allocate from or fragment the heap. If a size class
+ * is exhausted (or setup() has not been called yet) the event is allocated from the heap
+ * instead, and this is counted in the stats.
+ * 
+ * Each block has a small header before the PublishQueueEvent that holds the size class
+ * and a link pointer, which is also used by PublishQueueEventList. 
+ * 
+ * This class is not thread-safe; PublishQueuePosix calls it with its mutex locked.
+ */
+class PublishQueueEventPool {
+public:
+    /**
+     * @brief Number of size classes
+     */
+    static const size_t NUM_SIZE_CLASSES = 3;
+
+    /**
+     * @brief Usage statistics returned by PublishQueuePosix::getPoolStats()
+     */
+    struct Stats {
+        size_t count[NUM_SIZE_CLASSES];     //!< Number of blocks in each size class
+        size_t inUse[NUM_SIZE_CLASSES];     //!< Number of blocks currently allocated in each size class
+        size_t highWater[NUM_SIZE_CLASSES]; //!< Maximum value of inUse since setup()
+        size_t poolAllocs;                  //!< Number of events allocated from the pool
+        size_t heapAllocs;                  //!< Number of events allocated from the heap because the pool was full or not set up
+        size_t heapInUse;                   //!< Number of heap-allocated events currently in use
+    };
+
+    /**
+     * @brief Header before each event, in both pool and heap blocks
+     */
+    struct BlockHeader {
+        BlockHeader *next;          //!< Next block in the free list or PublishQueueEventList
+        uint32_t sizeClass;         //!< Size class index, or HEAP_BLOCK
+        uint32_t supersedeKey;      //!< Hash of the supersede or merge key, or 0 if the event does not have one
+        uint32_t timestamp;         //!< Time.now() when the event was published, or 0 if the time was not valid
+        uint32_t ttl;               //!< Time-to-live in seconds from timestamp, or 0 if the event does not expire
+        bool mergeKey;              //!< true if supersedeKey is a merge key
+    };
+
+    /**
+     * @brief Value for BlockHeader::sizeClass for blocks allocated from the heap
+     */
+    static const uint32_t HEAP_BLOCK = 0xff;
+
+    /**
+     * @brief Largest event size (sizeof(PublishQueueEvent) + data length) for each size class
+     */
+    static const size_t sizeClassSizes[NUM_SIZE_CLASSES];
+
+    /**
+     * @brief Allocate the slabs 
+     * 
+     * @param counts Number of blocks in each size class. A count of 0 disables that class.
+     * 
+     * Can only be called once. 
+     */
+    void setup(const size_t counts[NUM_SIZE_CLASSES]);
+
+    /**
+     * @brief Allocate an event
+     * 
+     * @param eventSize Size in bytes, sizeof(PublishQueueEvent) + strlen(eventData)
+     * 
+     * @return The event, or NULL if out of memory
+     */
+    PublishQueueEvent *alloc(size_t eventSize);
+
+    /**
+     * @brief Free an event allocated by alloc(). It's safe to pass NULL.
+     */
+    void free(PublishQueueEvent *event);
+
+    /**
+     * @brief Gets a copy of the usage statistics
+     */
+    Stats getStats() const { return stats; };
+
+    /**
+     * @brief Gets the block header for an event allocated by alloc()
+     */
+    static BlockHeader *header(PublishQueueEvent *event) { return ((BlockHeader *)event) - 1; };
+
+    /**
+     * @brief Gets the event for a block header
+     */
+    static PublishQueueEvent *event(BlockHeader *hdr) { return (PublishQueueEvent *)(hdr + 1); };
+
+protected:
+    uint8_t *slab[NUM_SIZE_CLASSES] = {0}; //!< Memory for each size class, allocated in setup()
+    BlockHeader *freeList[NUM_SIZE_CLASSES] = {0}; //!< Free blocks in each size class
+    Stats stats = {{0}, {0}, {0}, 0, 0, 0}; //!< Usage statistics
+};
+
+/**
+ * @brief FIFO of events allocated by PublishQueueEventPool
+ * 
+ * Events are linked through their block header, so adding and removing events does not
+ * allocate memory. An event can only be in one list at a time.
+ */
+class PublishQueueEventList {
+public:
+    /**
+     * @brief Returns true if there are no events in the list
+     */
+    bool empty() const { return head == 0; };
+
+    /**
+     * @brief Returns the number of events in the list
+     */
+    size_t size() const { return count; };
+
+    /**
+     * @brief Returns the oldest event, or NULL if empty
+     */
+    PublishQueueEvent *front() const { return head ? PublishQueueEventPool::event(head) : 0; };
+
+    /**
+     * @brief Adds an event at the end of the list
+     */
+    void push_back(PublishQueueEvent *event);
+
+    /**
+     * @brief Adds an event at the beginning of the list
+     */
+    void push_front(PublishQueueEvent *event);
+
+    /**
+     * @brief Removes the oldest event. Does not free it.
+     */
+    void pop_front();
+
+    /**
+     * @brief Finds the event with a supersede key 
+     * 
+     * @param supersedeKey The key hash to find (not 0)
+     * 
+     * @param mergeKey true to find an event with a merge key instead of a supersede key
+     * 
+     * @return The event, or NULL if there is no event with that key in the list
+     */
+    PublishQueueEvent *find(uint32_t supersedeKey, bool mergeKey = false) const;
+
+    /**
+     * @brief Returns the event after event in the list, or NULL if it's the newest
+     */
+    PublishQueueEvent *next(PublishQueueEvent *event) const;
+
+    /**
+     * @brief Replaces an event in the list with another, keeping its position. Does not free oldEvent.
+     */
+    void replace(PublishQueueEvent *oldEvent, PublishQueueEvent *newEvent);
+
+protected:
+    PublishQueueEventPool::BlockHeader *head = 0; //!< Oldest event
+    PublishQueueEventPool::BlockHeader *tail = 0; //!< Newest event
+    size_t count = 0; //!< Number of events in the list
+};
+
 /**
  * @brief Class for asynchronous publishing of events
  * 
  */
 class PublishQueuePosix {
 public:
+    /**
+     * @brief Priority classes for events
+     * 
+     * Each priority class has its own RAM queue and its own file queue directory. Events
+     * are sent in strict priority order: all queued PRIORITY_ALERT events are sent before
+     * any PRIORITY_NORMAL event, and those before any PRIORITY_BULK event. Within a class,
+     * events are sent in the order they were published.
+     * 
+     * When the file queue exceeds its limit, events are discarded from the lowest 
+     * priority class first.
+     */
+    enum Priority {
+        PRIORITY_ALERT = 0,     //!< Time-critical events, sent first after a reconnect
+        PRIORITY_NORMAL,        //!< Default priority class
+        PRIORITY_BULK,          //!< Bulk data, sent last and discarded first
+        NUM_PRIORITIES          //!< Number of priority classes (not a valid priority)
+    };
+
+    /**
+     * @brief Callback to combine two events with the same merge key into one summary event
+     * 
+     * @param eventName The event name
+     * 
+     * @param queuedData Data of the queued event, which may already be a summary
+     * 
+     * @param newData Data of the event being published
+     * 
+     * @param mergedData Buffer to write the combined data to, as a c-string
+     * 
+     * @param mergedDataSize Size of mergedData in bytes, including the null terminator
+     * 
+     * @return true if the data was combined, false to queue the new event separately
+     */
+    typedef std::function<bool(const char *eventName, const char *queuedData, const char *newData, char *mergedData, size_t mergedDataSize)> MergeCallback;
+
+    /**
+     * @brief Optional settings for an event, passed to publish()
+     * 
+     * For example:
+     * 
+     * ```
+     * PublishQueuePosix::instance().publish("status", buf, PublishQueuePosix::PublishOptions().withSupersedeKey("status"), PRIVATE);
+     * ```
+     */
+    class PublishOptions {
+    public:
+        /**
+         * @brief Default options: PRIORITY_NORMAL and no supersede key
+         */
+        PublishOptions() {};
+
+        /**
+         * @brief Sets the priority class (default is PRIORITY_NORMAL)
+         */
+        PublishOptions &withPriority(Priority priority) { this->priority = priority; return *this; };
+
+        /**
+         * @brief Sets a supersede key for the event
+         * 
+         * @param supersedeKey A c-string key. The string is not saved; only a hash of it is stored with the event.
+         * 
+         * If an event with the same key is still queued in the same priority class, it is replaced
+         * by this event instead of adding another event to the queue. This is useful for status
+         * events where only the latest value matters.
+         */
+        PublishOptions &withSupersedeKey(const char *supersedeKey) { this->supersedeKey = supersedeKey; return *this; };
+
+        /**
+         * @brief Sets a merge key for the event
+         * 
+         * @param mergeKey A c-string key. The string is not saved; only a hash of it is stored with the event.
+         * 
+         * Events with a merge key are queued normally. While the file queue is above the high-water
+         * mark set with withSummaryPolicy(), an event is instead combined with a queued event that has
+         * the same key using the merge callback. Include the period in the key, for example the hour,
+         * to get one summary event per period.
+         */
+        PublishOptions &withMergeKey(const char *mergeKey) { this->mergeKey = mergeKey; return *this; };
+
+        /**
+         * @brief Sets a time-to-live for the event
+         * 
+         * @param ttl Seconds after publish() that the event is no longer worth sending, or 0 for no limit (default)
+         * 
+         * An event that is still queued once its time-to-live has passed is discarded instead of being sent,
+         * so after a long outage the queue does not spend time and data operations on stale events. Expired
+         * file queue events are discarded using only their record header, without reading the event data.
+         * 
+         * The time is measured with Time.now(), so an event published before the time was valid does not 
+         * expire. This is unrelated to the ttl parameter of publish(), which the cloud ignores.
+         */
+        PublishOptions &withTtl(uint32_t ttl) { this->ttl = ttl; return *this; };
+
+        Priority priority = PRIORITY_NORMAL; //!< Priority class
+        const char *supersedeKey = 0; //!< Supersede key, or NULL
+        const char *mergeKey = 0; //!< Merge key, or NULL
+        uint32_t ttl = 0; //!< Time-to-live in seconds, or 0
+    };
+
+    /**
+     * @brief Number of buckets in QueueStats::latency
+     */
+    static const size_t NUM_LATENCY_BUCKETS = 6;
+
+    /**
+     * @brief Number of buckets in QueueStats::attempts
+     */
+    static const size_t NUM_ATTEMPT_BUCKETS = 4;
+
+    /**
+     * @brief Upper limit in seconds of each QueueStats::latency bucket except the last
+     */
+    static const uint32_t latencyBucketLimits[NUM_LATENCY_BUCKETS - 1];
+
+    /**
+     * @brief Queue statistics returned by getStats()
+     * 
+     * Counters and histograms are since setup(); the depth and age values are current.
+     */
+    struct QueueStats {
+        size_t ramEvents;                       //!< Number of events in the RAM queues
+        size_t fileEvents;                      //!< Number of events in the file queues
+        size_t fileBytes;                       //!< Size of the segment files on the flash file system in bytes
+        uint32_t oldestAge;                     //!< Age of the oldest queued event in seconds, 0 if empty or not known
+        size_t published;                       //!< Number of events successfully published
+        size_t failures;                        //!< Number of failed publish attempts
+        size_t discarded;                       //!< Number of events discarded because a queue limit was exceeded
+        size_t superseded;                      //!< Number of events replaced by a newer event with the same supersede key
+        size_t corrupted;                       //!< Number of records discarded because they were corrupted or incompletely written
+        size_t summarized;                      //!< Number of events merged into a queued event because the file queue was above the high-water mark
+        size_t expired;                         //!< Number of events discarded because their time-to-live passed before they were sent
+        size_t latency[NUM_LATENCY_BUCKETS];    //!< Time from publish() to cloud ack: under 2s, 10s, 1min, 10min, 1hr, and longer
+        size_t attempts[NUM_ATTEMPT_BUCKETS];   //!< Publish attempts per event sent: 1, 2, 3, 4 or more
+    };
+
+    /**
+     * @brief Information about a queued event from its record header, passed to scanQueuedEvents()
+     */
+    struct QueuedEventInfo {
+        Priority priority;      //!< Priority class of the event
+        uint32_t timestamp;     //!< Time.now() when the event was published, or 0 if the time was not valid
+        uint32_t ttl;           //!< Time-to-live in seconds from timestamp, or 0 if the event does not expire
+        size_t size;            //!< Size of the event in bytes, including the event name and flags, or as stored if it's compressed
+        bool keyed;             //!< true if the event has a supersede or merge key
+        bool inRam;             //!< true if the event is in the RAM queue, false if it's in a file
+    };
+
     /**
      * @brief Gets the singleton instance of this class
      * 
@@ -78,7 +449,7 @@ public:
     /**
      * @brief Sets the file-based queue size (default is 100)
      * 
-     * @param size The maximum number of files to store (one event per file)
+     * @param size The maximum number of events to store on the file system
      * 
      * If you exceed this number of events, the oldest event is discarded.
      */
@@ -89,6 +460,179 @@ public:
      */
     size_t getFileQueueSize() const { return fileQueueSize; };
 
+    /**
+     * @brief Sets the file-based queue size for a single priority class (default is 0, no limit)
+     * 
+     * @param priority The priority class to set the limit for
+     * 
+     * @param size The maximum number of events to store on the file system for this
+     * priority class, or 0 to only apply the overall limit set with withFileQueueSize(size_t).
+     * 
+     * If you exceed this number of events, the oldest event in this class is discarded.
+     * The overall file queue size still applies, and is enforced by discarding from the
+     * lowest priority class first.
+     */
+    PublishQueuePosix &withFileQueueSize(Priority priority, size_t size);
+
+    /**
+     * @brief Gets the file queue size limit for a single priority class (0 = no limit)
+     */
+    size_t getFileQueueSize(Priority priority) const { return priorityFileQueueSize[priority]; };
+
+    /**
+     * @brief Sets the number of blocks in each event pool size class (default is 6, 3, 2)
+     * 
+     * @param smallCount Number of blocks for events up to 128 bytes (data up to about 60 bytes)
+     * 
+     * @param mediumCount Number of blocks for events up to 384 bytes (data up to about 315 bytes)
+     * 
+     * @param largeCount Number of blocks for maximum size events
+     * 
+     * Events in the RAM queue and the event currently being sent are allocated from this
+     * pool. If a size class is full, the event is allocated from the heap instead; use
+     * getPoolStats() to see if this happens. This must be called before setup().
+     */
+    PublishQueuePosix &withEventPool(size_t smallCount, size_t mediumCount, size_t largeCount);
+
+    /**
+     * @brief Gets the event pool usage statistics
+     */
+    PublishQueueEventPool::Stats getPoolStats();
+
+    /**
+     * @brief Sets the publish rate limit (default is 1000 ms, burst of 4)
+     * 
+     * @param intervalMs The average time between publishes in milliseconds
+     * 
+     * @param burst The number of events that can be published back-to-back after being idle
+     * 
+     * Publishes are scheduled using a token bucket. A token is added every intervalMs, up to 
+     * burst tokens, and each publish uses one token. The defaults match the Particle cloud limit
+     * of an average of one event per second with bursts of up to 4.
+     */
+    PublishQueuePosix &withPublishRateLimit(unsigned long intervalMs, size_t burst);
+
+    /**
+     * @brief Sets the delay after a failed publish (default is 10 seconds to 5 minutes)
+     * 
+     * @param minMs The delay after the first failure in milliseconds
+     * 
+     * @param maxMs The maximum delay in milliseconds
+     * 
+     * The delay doubles with each consecutive failure, up to maxMs, and is reset after a 
+     * successful publish. A random jitter of up to half of the delay is subtracted so devices
+     * that lost their connection at the same time do not all retry together.
+     */
+    PublishQueuePosix &withFailureBackoff(unsigned long minMs, unsigned long maxMs) { failureBackoffMinMs = minMs; failureBackoffMaxMs = maxMs; return *this; };
+
+    /**
+     * @brief Sets the maximum number of publishes that can be in progress at once (default is 1)
+     * 
+     * @param count Number of publishes, 1 to BackgroundPublishRK::MAX_IN_FLIGHT
+     * 
+     * With more than one, the next events are published without waiting for the cloud to 
+     * acknowledge the previous ones, which increases throughput on high-latency connections. 
+     * The publish rate limit still applies. Events are sent and removed from the queue in order.
+     * If a publish fails, the events sent after it are sent again after the failure backoff even
+     * if they succeeded, so they can be received more than once.
+     */
+    PublishQueuePosix &withMaxInFlight(size_t count);
+
+    /**
+     * @brief Sets the number of events to read from the file queue ahead of publishing them (default is 0)
+     * 
+     * @param count Number of events to keep read ahead, 0 to read each event when it's published
+     * 
+     * While waiting for the publish rate limit or for publishes in flight to complete, loop() reads 
+     * and validates the next events from the file queue, one per call, so publishing them doesn't 
+     * need to read the file. Each event read ahead uses an event pool block (or heap if the pool is 
+     * exhausted) until it's published.
+     */
+    PublishQueuePosix &withReadAhead(size_t count) { readAheadCount = count; return *this; };
+
+    /**
+     * @brief Compress events when they are written to the file queue (default is false)
+     * 
+     * @param enable true to compress events with PublishQueueLZSS
+     * 
+     * Each event is compressed separately, and only stored compressed if it's smaller. Events are 
+     * decompressed when they are read, so they are published unchanged. Files written with and 
+     * without compression can be read either way.
+     * 
+     * A single small event has little repetition in it, so without a dictionary (see 
+     * withCompressionDictionary()) typical JSON events are only about a third smaller.
+     */
+    PublishQueuePosix &withCompression(bool enable = true) { codec = enable ? CODEC_LZSS : CODEC_NONE; return *this; };
+
+    /**
+     * @brief Compress events using a typical event as a preset dictionary
+     * 
+     * @param eventName Event name of a typical event
+     * 
+     * @param eventData Event data of a typical event, such as JSON with the same keys as your events
+     * 
+     * This also enables compression. Each event can refer to matching bytes in the dictionary event,
+     * so the event name and JSON keys are stored as a few bytes instead of being repeated in every 
+     * record, which typically makes the file queue several times smaller.
+     * 
+     * Events compressed with a dictionary can only be read with the same dictionary. If the 
+     * dictionary changes in a firmware update, events still in the file queue from the old
+     * firmware fail their CRC check and are discarded.
+     */
+    PublishQueuePosix &withCompressionDictionary(const char *eventName, const char *eventData);
+
+    /**
+     * @brief Calls a function for each queued event in the order they will be sent, without reading event data from files
+     * 
+     * @param callback Called with the information for each event. Return false to stop.
+     * 
+     * @return The number of events the callback was called for
+     * 
+     * Only the record headers in the file queue are read, so this is much faster than reading the
+     * events, but it does access every unconsumed record so it's best not to call it on every loop. 
+     * Use it for decisions based on the number, age, or priority of queued events. Events that are
+     * being published are not included, and the queue must not be changed from the callback.
+     */
+    size_t scanQueuedEvents(std::function<bool(const QueuedEventInfo &info)> callback);
+
+    /**
+     * @brief Combine events into summaries instead of discarding them when the file queue is filling up
+     * 
+     * @param highWater Start merging when the file queue has at least this many events
+     * 
+     * @param lowWater Stop merging when the file queue has this many events or fewer
+     * 
+     * @param callback Combines the data of two events, see MergeCallback
+     * 
+     * Only events published with PublishOptions::withMergeKey() are merged. While merging, a new 
+     * event replaces the newest queued event with the same merge key and priority class with the 
+     * combined data, so the queue stops growing at the cost of resolution. Once the queue drains 
+     * to lowWater, events are queued individually again. The default is to never merge.
+     */
+    PublishQueuePosix &withSummaryPolicy(size_t highWater, size_t lowWater, MergeCallback callback) { summaryHighWater = highWater; summaryLowWater = lowWater; mergeCallback = callback; return *this; };
+
+    /**
+     * @brief Returns true if events with a merge key are currently being combined into summaries
+     */
+    bool getSummarizing() const { return summarizing; };
+
+    /**
+     * @brief Sets the maximum size of a segment file in bytes (default is 4096)
+     * 
+     * @param size The size in bytes
+     * 
+     * Events on the file system are appended to segment files, many events per file. Once
+     * a segment would exceed this size a new segment file is started. Segments are deleted
+     * once all of their events have been sent or discarded. The default matches the 4096
+     * byte block size of the flash file system.
+     */
+    PublishQueuePosix &withSegmentSize(size_t size) { segmentSize = size; return *this; };
+
+    /**
+     * @brief Gets the maximum size of a segment file in bytes
+     */
+    size_t getSegmentSize() const { return segmentSize; };
+
     /**
      * @brief Sets the directory to use as the queue directory. This is required!
      * 
@@ -102,15 +646,19 @@ public:
      * removed.
      * 
      * You must call this as you cannot use the root directory as a queue!
+     * 
+     * PRIORITY_NORMAL events are stored in this directory. The other priority classes are
+     * stored in sibling directories with a suffix, for example "/usr/pubqueue-alert" and
+     * "/usr/pubqueue-bulk".
      */
-    PublishQueuePosix &withDirPath(const char *dirPath) { fileQueue.withDirPath(dirPath); return *this; };
+    PublishQueuePosix &withDirPath(const char *dirPath);
 
     /**
      * @brief Gets the directory path set using withDirPath()
      * 
      * The returned path will not end with a slash.
      */
-    const char *getDirPath() const { return fileQueue.getDirPath(); };
+    const char *getDirPath() const { return fileQueue[PRIORITY_NORMAL].getDirPath(); };
 
     /**
      * @brief Adds a callback function to call with publish is complete
@@ -192,6 +740,7 @@ public:
 	 * @param ttl The time-to-live value. If not specified in one of the other overloads, the value 60 is
 	 * used. However, the ttl is ignored by the cloud, so it doesn't matter what you set it to. Essentially
 	 * all events are discarded immediately if not subscribed to so they essentially have a ttl of 0.
+	 * This value is not stored and does not expire queued events; use PublishOptions::withTtl() for that.
 	 *
 	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
 	 *
@@ -206,6 +755,45 @@ public:
 		return publishCommon(eventName, data, ttl, flags1, flags2);
 	}
 
+	/**
+	 * @brief Overload for publishing an event with a priority class
+	 *
+	 * @param eventName The name of the event (63 character maximum).
+	 *
+	 * @param data The event data (255 bytes maximum, 622 bytes in system firmware 0.8.0-rc.4 and later).
+	 *
+	 * @param priority The priority class, for example PublishQueuePosix::PRIORITY_ALERT. The other
+	 * overloads use PRIORITY_NORMAL.
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was queued or false if it was not.
+	 */
+	inline bool publish(const char *eventName, const char *data, Priority priority, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
+		return publishCommon(eventName, data, 60, flags1, flags2, PublishOptions().withPriority(priority));
+	}
+
+	/**
+	 * @brief Overload for publishing an event with options such as a supersede key
+	 *
+	 * @param eventName The name of the event (63 character maximum).
+	 *
+	 * @param data The event data (255 bytes maximum, 622 bytes in system firmware 0.8.0-rc.4 and later).
+	 *
+	 * @param options Options such as the priority class and supersede key
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was queued or false if it was not.
+	 */
+	inline bool publish(const char *eventName, const char *data, const PublishOptions &options, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
+		return publishCommon(eventName, data, 60, flags1, flags2, options);
+	}
+
 	/**
 	 * @brief Common publish function. All other overloads lead here. This is a pure virtual function, implemented in subclasses.
 	 *
@@ -216,17 +804,20 @@ public:
 	 * @param ttl The time-to-live value. If not specified in one of the other overloads, the value 60 is
 	 * used. However, the ttl is ignored by the cloud, so it doesn't matter what you set it to. Essentially
 	 * all events are discarded immediately if not subscribed to so they essentially have a ttl of 0.
+	 * This value is not stored and does not expire queued events; use PublishOptions::withTtl() for that.
 	 *
 	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
 	 *
 	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
 	 *
+	 * @param options (optional) The priority class and supersede key. Default is PRIORITY_NORMAL with no key.
+	 *
 	 * @return true if the event was queued or false if it was not.
 	 *
 	 * This function almost always returns true. If you queue more events than fit in the buffer the
 	 * oldest (sometimes second oldest) is discarded.
 	 */
-	virtual bool publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags());
+	virtual bool publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags(), const PublishOptions &options = PublishOptions());
 
     /**
      * @brief If there are events in the RAM queue, write them to files in the flash file system
@@ -278,12 +869,71 @@ public:
     size_t getNumEvents();
 
     /**
-     * @brief Check the queue limit, discarding events as necessary
-     * 
-     * When the RAM queue exceeds the limit, all events are moved into files. 
+     * @brief Gets the number of events that were replaced by a newer event with the same supersede key
      */
-    void checkQueueLimits();
-    
+    size_t getNumSuperseded() const { return stats.superseded; };
+
+    /**
+     * @brief Gets queue statistics 
+     * 
+     * Finding the age of the oldest event may require reading a record header from the file system.
+     */
+    QueueStats getStats();
+
+    /**
+     * @brief Gets queue statistics as compact JSON
+     * 
+     * For example:
+     * 
+     * ```
+     * {"ram":0,"file":12,"bytes":1032,"age":340,"pub":97,"fail":2,"drop":0,"sup":5,"lat":[90,5,2,0,0,0],"att":[95,2,0,0]}
+     * ```
+     */
+    String getStatsJson();
+
+    /**
+     * @brief Registers a Particle.variable that returns getStatsJson()
+     * 
+     * @param name The variable name
+     * 
+     * Call this from setup(), before connecting to the cloud.
+     */
+    PublishQueuePosix &withStatsVariable(const char *name);
+
+    /**
+     * @brief Periodically publish getStatsJson() as an event
+     * 
+     * @param eventName The event name
+     * 
+     * @param periodMs How often to publish, in milliseconds. 0 disables the event.
+     * 
+     * The event is queued at PRIORITY_BULK with a supersede key so only the most recent 
+     * statistics are queued while offline.
+     */
+    PublishQueuePosix &withStatsEvent(const char *eventName, unsigned long periodMs) { statsEventName = eventName; statsEventPeriodMs = periodMs; return *this; };
+
+    /**
+     * @brief Check the queue limit, discarding events as necessary
+     * 
+     * When the RAM queue exceeds the limit, all events are moved into files. 
+     * 
+     * When a priority class exceeds its own file queue limit, the oldest events in that class
+     * are discarded. When the overall file queue limit is exceeded, the oldest events in the
+     * lowest priority class that has files are discarded, so bulk data is discarded before
+     * alerts.
+     */
+    void checkQueueLimits();
+
+    /**
+     * @brief Gets the number of events in the RAM queues of all priority classes
+     */
+    size_t getRamQueueLen() const;
+
+    /**
+     * @brief Gets the number of events in the file queues of all priority classes
+     */
+    size_t getFileQueueLen() const;
+    
     /**
      * @brief Lock the queue protection mutex
      * 
@@ -310,7 +960,57 @@ public:
     /**
      * @brief Version of the file header for events
      */
-    static const uint8_t FILE_VERSION = 1;
+    static const uint8_t FILE_VERSION = 2;
+
+    /**
+     * @brief Magic bytes stored at the beginning of the cursor file
+     */
+    static const uint32_t CURSOR_MAGIC = 0x31b67664;
+
+    /**
+     * @brief Filename of the cursor file in each queue directory
+     */
+    static const char * const CURSOR_FILENAME;
+
+    /**
+     * @brief PublishQueueRecordHeader flag for a record that was superseded and must not be sent
+     */
+    static const uint8_t RECORD_FLAG_SUPERSEDED = 0x01;
+
+    /**
+     * @brief PublishQueueRecordHeader flag for a record whose event is compressed with the file's codec
+     */
+    static const uint8_t RECORD_FLAG_COMPRESSED = 0x02;
+
+    /**
+     * @brief PublishQueueRecordHeader flag for a record whose supersedeKey is a merge key
+     * 
+     * These are not counted in PublishQueueSegmentInfo::keyedCount, so a sealed segment of 
+     * merge-keyed events is not read at startup.
+     */
+    static const uint8_t RECORD_FLAG_MERGE_KEY = 0x04;
+
+    /**
+     * @brief PublishQueueFileHeader codec for a file without compressed records
+     */
+    static const uint8_t CODEC_NONE = 0;
+
+    /**
+     * @brief PublishQueueFileHeader codec for records compressed with PublishQueueLZSS
+     */
+    static const uint8_t CODEC_LZSS = 1;
+
+    /**
+     * @brief Value written after each record in a segment file
+     * 
+     * The marker is written last, so a record without it was not completely written.
+     */
+    static const uint32_t RECORD_COMMIT_MARKER = 0x52454331;
+
+    /**
+     * @brief File offset of the first record in a segment file
+     */
+    static const uint32_t SEGMENT_DATA_OFFSET = sizeof(PublishQueueFileHeader) + sizeof(PublishQueueSegmentInfo);
 
 protected:
     /**
@@ -346,74 +1046,555 @@ protected:
      * 
      * May return NULL if eventName or eventData are invalid (too long) or out of memory.
      * 
-     * You must delete the result from this method when you are done using it. 
+     * You must free the result from this method using freeEvent() when you are done using it. 
      */
     PublishQueueEvent *newRamEvent(const char *eventName, const char *eventData, PublishFlags flags);
 
+    /**
+     * @brief Allocate an event from the event pool, or the heap if the pool is full
+     * 
+     * @param eventSize Size in bytes, sizeof(PublishQueueEvent) + strlen(eventData)
+     */
+    PublishQueueEvent *allocEvent(size_t eventSize);
+
+    /**
+     * @brief Free an event allocated by allocEvent(). It's safe to pass NULL.
+     */
+    void freeEvent(PublishQueueEvent *event);
+
+    /**
+     * @brief Location of a record in the file queue that has a supersede key
+     * 
+     * Only the newest record for each merge key is kept, as that is the one that
+     * new events are merged into.
+     */
+    struct KeyedRecord {
+        uint32_t supersedeKey;      //!< Hash of the supersede or merge key
+        int fileNum;                //!< Segment file number containing the record
+        uint32_t offset;            //!< File offset of the record header
+        uint16_t size;              //!< Size of the event in the record (PublishQueueRecordHeader::size)
+        bool mergeKey;              //!< true if supersedeKey is a merge key
+    };
+
+    /**
+     * @brief State of the file queue for one priority class
+     * 
+     * The segment files themselves are tracked by the SequentialFile object. This keeps the
+     * number of unconsumed events in each segment (in the same order), the consumed offset
+     * in the oldest segment, and where to append in the newest segment.
+     */
+    struct FileQueueState {
+        std::vector<KeyedRecord> keyedRecords; //!< Unconsumed records that have a supersede key, and the newest for each merge key
+        std::deque<uint16_t> segmentEvents; //!< Number of unconsumed events in each segment, oldest first
+        size_t numEvents = 0;       //!< Total number of unconsumed events in all segments
+        int readFileNum = 0;        //!< Segment file number that readOffset refers to
+        uint32_t readOffset = 0;    //!< File offset of the first unconsumed record in readFileNum
+        uint32_t readLength = 0;    //!< Length of the record at readOffset if known, otherwise 0
+        uint32_t readIndex = 0;     //!< Number of records consumed in readFileNum
+        int appendFileNum = 0;      //!< Segment file number to append to, or 0 to start a new segment
+        uint32_t appendOffset = 0;  //!< File offset to append the next record at in appendFileNum
+        uint16_t appendCount = 0;   //!< Number of records in appendFileNum, stored when the segment is sealed
+        uint16_t appendKeyedCount = 0; //!< Number of records with a supersede key (not a merge key) in appendFileNum
+        uint8_t appendCodec = CODEC_NONE; //!< Codec in the file header of appendFileNum
+        size_t fileBytes = 0;       //!< Total size of all segment files in bytes
+        size_t unsavedCount = 0;    //!< Events consumed since the cursor was last saved
+    };
+
     /**
      * @brief Read an event from a sequentially numbered file 
      * 
-     * @param fileNum The file number to read 
+     * @param priority The priority class whose file queue contains the file
+     * 
+     * @param fileNum The file number to read. This must be the oldest file in the queue.
+     * 
+     * @param offset The offset of the record to read, or 0 for the record at the consumed offset.
+     * Set to the offset of the record that was read.
+     * 
+     * @param length Set to the length of the record, or 0 if it could not be read
+     * 
+     * @param skip Set to true if the record was superseded by a newer event, or its event or commit
+     * marker is corrupted. The result is NULL in this case and the record should be consumed without 
+     * sending it.
+     * 
+     * May return NULL if file does not exist, the record header is corrupted, or out of memory.
+     * 
+     * You must free the result from this method using freeEvent() when you are done using it. 
+     */
+    PublishQueueEvent *readQueueFile(Priority priority, int fileNum, uint32_t &offset, uint32_t &length, bool &skip);
+
+    /**
+     * @brief Opens a queue file for reading and validates its file header
+     * 
+     * @param priority The priority class whose file queue contains the file
+     * 
+     * @param fileNum The file number to open
+     * 
+     * @param hdr Filled in with the file header. hdr.version is 1 for a single event file or 2 for a segment.
+     * 
+     * @param fileSize Filled in with the size of the file in bytes
+     * 
+     * @param writable Open the file for reading and writing instead of read-only
+     * 
+     * @return A file descriptor, or -1 if the file could not be opened or the header is not valid.
+     */
+    int openQueueFile(Priority priority, int fileNum, PublishQueueFileHeader &hdr, off_t &fileSize, bool writable = false);
+
+    /**
+     * @brief Reads and validates a record header in a segment file
+     * 
+     * @param fd File descriptor from openQueueFile()
+     * 
+     * @param offset File offset of the record
+     * 
+     * @param fileSize Size of the file, used to make sure the whole record is present
+     * 
+     * @param rec Filled in with the record header
+     * 
+     * @return true if the record header is valid
+     */
+    bool readRecordHeader(int fd, uint32_t offset, off_t fileSize, PublishQueueRecordHeader &rec);
+
+    /**
+     * @brief Sets the CRC of a record header and writes it
+     * 
+     * @param fd File descriptor, positioned at the record
+     * 
+     * @param rec Record header to write. crc is set by this function.
+     * 
+     * @return true if the header was written
+     */
+    bool writeRecordHeader(int fd, PublishQueueRecordHeader &rec);
+
+    /**
+     * @brief Returns true if an event's time-to-live has passed
+     * 
+     * @param timestamp Time.now() when the event was published, or 0
      * 
-     * May return NULL if file does not exist, or out of memory.
+     * @param ttl Time-to-live in seconds, or 0
      * 
-     * You must delete the result from this method when you are done using it. 
+     * Always false if the event has no time-to-live or timestamp, or the time is not currently valid.
      */
-    PublishQueueEvent *readQueueFile(int fileNum);
+    static bool isExpired(uint32_t timestamp, uint32_t ttl);
+
+    /**
+     * @brief Returns true if the commit marker after a record is present
+     * 
+     * @param fd File descriptor from openQueueFile()
+     * 
+     * @param offset File offset of the record
+     * 
+     * @param rec Record header from readRecordHeader()
+     */
+    bool readCommitMarker(int fd, uint32_t offset, const PublishQueueRecordHeader &rec);
+
+    /**
+     * @brief Reads the event in a record, decompressing it if necessary
+     * 
+     * @param fd File descriptor from openQueueFile(), positioned after the record header
+     * 
+     * @param hdr File header from openQueueFile()
+     * 
+     * @param rec Record header from readRecordHeader()
+     * 
+     * @param eventSize Set to the size of the event
+     * 
+     * @param corrupted Set to true if the event could not be read, could not be decompressed,
+     * or does not match the payload CRC. The result is NULL in this case.
+     * 
+     * @return The event, which must be freed using freeEvent(), or NULL
+     */
+    PublishQueueEvent *readRecordEvent(int fd, const PublishQueueFileHeader &hdr, const PublishQueueRecordHeader &rec, size_t &eventSize, bool &corrupted);
+
+    /**
+     * @brief Compresses an event for storing in a record with RECORD_FLAG_COMPRESSED
+     * 
+     * @param event The event to compress
+     * 
+     * @param eventSize Size of the event
+     * 
+     * @param maxSize The compressed record data must be smaller than this
+     * 
+     * @param packedSize Set to the size of the compressed record data
+     * 
+     * @return The compressed record data, which must be freed using freeEvent(), or NULL if the 
+     * event doesn't compress to less than maxSize
+     */
+    PublishQueueEvent *compressEvent(PublishQueueEvent *event, size_t eventSize, size_t maxSize, size_t &packedSize);
+
+    /**
+     * @brief Reads the PublishQueueSegmentInfo from a segment file
+     * 
+     * @return true if the segment is sealed and info is valid
+     */
+    bool readSegmentInfo(int fd, PublishQueueSegmentInfo &info);
+
+    /**
+     * @brief Writes the record counts to the PublishQueueSegmentInfo of the segment being appended to
+     * 
+     * Called when a new segment is started; no more records are appended to a sealed segment.
+     */
+    void sealSegment(Priority priority);
+
+    /**
+     * @brief Gets the length of a record in a segment file, including the header and commit marker
+     */
+    static uint32_t recordLength(const PublishQueueRecordHeader &rec) { return rec.headerSize + rec.size + sizeof(uint32_t); };
+
+    /**
+     * @brief Scans the file queue for a priority class at startup
+     * 
+     * Reads the cursor and counts the unconsumed events in each segment. Segments before the 
+     * cursor, and segments that do not contain any valid events, are deleted.
+     */
+    void loadFileQueue(Priority priority);
+
+    /**
+     * @brief Counts the unconsumed records in a segment file
+     * 
+     * For a sealed segment the count comes from the PublishQueueSegmentInfo and the records are
+     * only read if there are records with a supersede key to find. Merge-keyed records are only
+     * indexed from a segment that is not sealed. A segment that is not sealed is checked 
+     * record by record, and is truncated after the last completely written record.
+     * 
+     * @param priority The priority class whose file queue contains the file
+     * 
+     * @param fileNum The file number to scan
+     * 
+     * @param startOffset File offset of the first unconsumed record from the cursor, or 0 to start 
+     * at the first record. Updated if the offset is not a valid record and startIndex was used instead.
+     * 
+     * @param startIndex Number of records consumed from the cursor. Updated to match startOffset.
+     * 
+     * @param endOffset Filled in with the offset after the last valid record, or 0 if records
+     * cannot be appended to this file (sealed segment or single event file)
+     * 
+     * @param keyedRecords (optional) Unconsumed records with a supersede key that were not superseded are added to this vector
+     * 
+     * @return The number of unconsumed records
+     */
+    size_t scanQueueFile(Priority priority, int fileNum, uint32_t &startOffset, uint32_t &startIndex, uint32_t &endOffset, std::vector<KeyedRecord> *keyedRecords = 0);
+
+    /**
+     * @brief Adds a record to keyedRecords, replacing the older record with the same merge key if there is one
+     */
+    static void addKeyedRecord(std::vector<KeyedRecord> &keyedRecords, const KeyedRecord &keyed);
+
+    /**
+     * @brief Replaces a queued event that has the same supersede key as event
+     * 
+     * @param priority The priority class to look in
+     * 
+     * @param event The new event. Its block header contains the supersede key hash.
+     * 
+     * @return true if event replaced a queued event and has been freed or stored in the RAM queue. 
+     * false if the caller should queue event normally; any older event with the same key in the
+     * file queue has been marked as superseded.
+     * 
+     * Must be called with the queue locked.
+     */
+    bool supersedeEvent(Priority priority, PublishQueueEvent *event);
+
+    /**
+     * @brief Combines event with a queued event that has the same merge key
+     * 
+     * @param priority The priority class to look in
+     * 
+     * @param event The new event. Its block header contains the merge key hash. If the result
+     * is true, this is replaced with a new event containing the merged data, which should then be 
+     * passed to supersedeEvent() to replace the queued event.
+     * 
+     * @return true if the events were merged, false if the caller should queue event normally
+     * 
+     * Must be called with the queue locked. The merged data is built in writeBuffer.
+     */
+    bool mergeEvent(Priority priority, PublishQueueEvent *&event);
+
+    /**
+     * @brief Reads the event for a keyed record from the file queue
+     * 
+     * @return The event, which must be freed using freeEvent(), or NULL if it could not be read
+     */
+    PublishQueueEvent *readKeyedEvent(Priority priority, const KeyedRecord &keyed);
+
+    /**
+     * @brief Starts or stops merging events based on the file queue length and withSummaryPolicy() settings
+     */
+    void updateSummarizing();
+
+    /**
+     * @brief Gets the timestamp of the oldest event in the file queue for a priority class
+     * 
+     * @return Time.now() value when the event was published, or 0 if not known. Reads the record
+     * header from the file system.
+     */
+    uint32_t getFileQueueTimestamp(Priority priority);
+
+    /**
+     * @brief Updates the statistics after an event has been sent successfully
+     */
+    void updateSentStats(PublishQueueEvent *event);
+
+    /**
+     * @brief Calculates the hash stored for a supersede key. Never returns 0.
+     */
+    static uint32_t supersedeKeyHash(const char *supersedeKey);
+
+    /**
+     * @brief Finds the file offset of a record in a segment file by walking the record headers
+     * 
+     * @param fd File descriptor from openQueueFile()
+     * 
+     * @param fileSize Size of the file
+     * 
+     * @param index The record to find, 0 is the first record in the file
+     * 
+     * @return The file offset of the record, or 0 if there is no valid record with that index
+     */
+    uint32_t findRecordOffset(int fd, off_t fileSize, uint32_t index);
+
+    /**
+     * @brief Writes a buffer of records to a segment file
+     * 
+     * @param fd File descriptor, positioned at the append offset
+     * 
+     * @param buf Records to write
+     * 
+     * @param len Number of bytes in buf
+     * 
+     * @return true if all of the bytes were written
+     */
+    bool writeRecords(int fd, const uint8_t *buf, size_t len);
+
+    /**
+     * @brief Marks the oldest event in the file queue for a priority class as consumed
+     * 
+     * Advances the consumed offset, and deletes the segment once all of its events have been consumed.
+     * Used after successfully publishing an event from a file and to discard events.
+     */
+    void consumeFileEvent(Priority priority);
+
+    /**
+     * @brief Deletes the oldest segment file for a priority class, discarding any events left in it
+     */
+    void removeOldestSegment(Priority priority);
+
+    /**
+     * @brief Saves the consumed offset for a priority class to its cursor file
+     * 
+     * @param priority The priority class
+     * 
+     * @param force If false, only saves if events have been consumed since the last save
+     */
+    void saveCursor(Priority priority, bool force = false);
+
+    /**
+     * @brief Saves the consumed offset and SequentialFile manifest for all priority classes, if changed
+     */
+    void saveCursors();
+
+    /**
+     * @brief Discard the oldest event in the file queue for a priority class
+     * 
+     * @param priority The priority class to discard from
+     */
+    void discardOldestFile(Priority priority);
+
+    /**
+     * @brief Calculates a CRC32 (IEEE 802.3)
+     * 
+     * @param data Pointer to the data
+     * 
+     * @param len Length of the data in bytes
+     * 
+     * @param crc Initial value, or the result of a previous call to continue a calculation
+     */
+    static uint32_t crc32(const void *data, size_t len, uint32_t crc = 0);
 
     /**
      * @brief Callback for BackgroundPublishRK library
+     * 
+     * @param id The InFlightEvent id passed as the publish context
      */
-    void publishCompleteCallback(bool succeeded, const char *eventName, const char *eventData);
+    void publishCompleteCallback(bool succeeded, const char *eventName, const char *eventData, uint32_t id);
 
     /**
-     * @brief State handler for waiting to connect to the Particle cloud
+     * @brief Takes the next event to send and starts publishing it
      * 
-     * Next state: stateWait
+     * @return true if a publish was started, false if there is nothing that can be sent now
+     * 
+     * Events in a file segment can only be released in order, so while any events from the 
+     * oldest segment of a priority class are in flight, the next event is the one after the 
+     * last of them. Nothing after that segment is sent until they have all completed.
      */
-    void stateConnectWait();
+    bool publishNextEvent();
 
     /**
-     * @brief State handler for waiting to publish
+     * @brief Releases completed publishes from the front of inFlight, in order
      * 
-     * stateTime and durationMs determine whether to stay in this state waiting, or whether
-     * to publish and go into statePublishWait.
+     * Called from loop(). Once a failed publish is at the front and all of the others have 
+     * completed, the events that were not released are put back and the failure backoff starts.
+     */
+    void releaseCompletedEvents();
+
+    /**
+     * @brief Reads the next event from the file queue into readAhead, if it's not full
      * 
-     * Next state: statePublishWait or stateConnectWait
+     * Called from loop(). Reads from the same priority class and oldest segment publishNextEvent() 
+     * would, continuing after the events that are in flight and already read ahead.
      */
-    void stateWait();
+    void readAheadEvent();
+
+    /**
+     * @brief Takes the record at offset from readAhead
+     * 
+     * @param offset The offset of the record to take, or 0 for the record at the consumed offset.
+     * Set to the offset of the record that was taken.
+     * 
+     * @param length Set to the length of the record
+     * 
+     * @param skip Set to true if the record should be consumed without sending it
+     * 
+     * @param event Set to the event, which the caller must free, or NULL if skip is true
+     * 
+     * @return true if the record was read ahead, false if it must be read with readQueueFile()
+     * 
+     * Read-ahead events for records that have already been consumed or discarded are freed.
+     */
+    bool takeReadAhead(Priority priority, int fileNum, uint32_t &offset, uint32_t &length, bool &skip, PublishQueueEvent *&event);
+
+    /**
+     * @brief Frees the read-ahead events from a priority class, starting with the record at fileNum and offset
+     * 
+     * Used when that record is changed on the flash file system. The records after it are freed too
+     * because read-ahead records must be consecutive.
+     */
+    void dropReadAhead(Priority priority, int fileNum, uint32_t offset);
+
+    /**
+     * @brief Frees all read-ahead events
+     */
+    void clearReadAhead();
 
     /**
-     * @brief State handler for waiting for publish to complete
+     * @brief Gets the offset of the record after the ones from fileNum that are in flight (and optionally read ahead)
+     * 
+     * @param count Set to the number of those records
+     * 
+     * @return The offset, or 0 for the record at the consumed offset
+     */
+    uint32_t getNextReadOffset(Priority priority, int fileNum, bool includeReadAhead, size_t &count) const;
+
+    /**
+     * @brief Gets the number of publishes that have been started but not released
+     * 
+     * Records that were skipped (superseded or corrupted) while other events were in flight 
+     * are not counted.
+     */
+    size_t getNumInFlight() const;
+
+    /**
+     * @brief Returns true if the record at fileNum and offset is being published
+     */
+    bool isInFlight(Priority priority, int fileNum, uint32_t offset) const;
+
+    /**
+     * @brief Adds tokens to the publish rate limit bucket for the time since the last call
+     * 
+     * @return true if there is a token available to publish
+     */
+    bool refillPublishTokens();
+
+    /**
+     * @brief Gets how long to wait before retrying after consecutiveFailures failed publishes
+     */
+    unsigned long getFailureBackoff() const;
+
+    /**
+     * @brief State handler for waiting to connect to the Particle cloud
      * 
      * Next state: stateWait
      */
-    void statePublishWait();
+    void stateConnectWait();
+
+    /**
+     * @brief State handler for waiting to publish
+     * 
+     * stateTime and durationMs (after connecting or a failure), the publish rate limit token 
+     * bucket, and the number of publishes in flight determine whether to stay in this state 
+     * waiting, or whether to publish more events.
+     * 
+     * Next state: stateConnectWait
+     */
+    void stateWait();
 
     /**
-     * @brief SequentialFileRK library object for maintaining the queue of files on the POSIX file system
+     * @brief SequentialFileRK library objects for maintaining the queue of files on the POSIX file system, one per priority class
      */
-    SequentialFile fileQueue;
+    SequentialFile fileQueue[NUM_PRIORITIES];
 
 
-    size_t ramQueueSize = 2; //!< size of the queue in RAM
-    size_t fileQueueSize = 100; //!< size of the queue on the flash file system
+    size_t ramQueueSize = 2; //!< size of the queue in RAM (all priority classes)
+    size_t fileQueueSize = 100; //!< size of the queue on the flash file system (all priority classes)
+    size_t priorityFileQueueSize[NUM_PRIORITIES] = {0}; //!< per-priority class file queue size, 0 = no per-class limit
 
     os_mutex_recursive_t mutex; //!< mutex for protecting the queue
-    std::deque<PublishQueueEvent*> ramQueue; //!< Queue in RAM
+    PublishQueueEventList ramQueue[NUM_PRIORITIES]; //!< Queue in RAM, one per priority class
+
+    PublishQueueEventPool eventPool; //!< Allocator for events in RAM
+    size_t eventPoolCounts[PublishQueueEventPool::NUM_SIZE_CLASSES] = { 6, 3, 2 }; //!< Number of blocks in each event pool size class
+
+    size_t segmentSize = 4096; //!< maximum size of a segment file in bytes
+    uint8_t *writeBuffer = 0; //!< Buffer for writing several records at once in writeQueueToFiles(), allocated in setup()
+    static const size_t WRITE_BUFFER_SIZE = 1024; //!< Size of writeBuffer in bytes
+    size_t cursorSaveInterval = 8; //!< save the cursor after this many events are consumed from a segment
+    FileQueueState fileState[NUM_PRIORITIES]; //!< File queue state, one per priority class
 
-    PublishQueueEvent *curEvent = 0; //!< Current event being published
-    int curFileNum = 0; //!< Current file number being published (0 if from RAM queue)
+    /**
+     * @brief An event that is being published, or a skipped record waiting to be consumed in order
+     * 
+     * Also used for events read ahead from the file queue.
+     */
+    struct InFlightEvent {
+        uint32_t id; //!< Unique id, passed as the publish context
+        PublishQueueEvent *event; //!< The event, NULL for a skipped record
+        Priority priority; //!< Priority class of the event
+        int fileNum; //!< File number the event was read from (0 if from RAM queue)
+        uint32_t offset; //!< File offset of the record in fileNum
+        uint32_t length; //!< Length of the record in fileNum
+        bool complete; //!< true if the publish has completed (successfully or not)
+        bool success; //!< true if the publish succeeded
+    };
+    std::deque<InFlightEvent> inFlight; //!< Publishes in progress, oldest first
+    uint32_t nextInFlightId = 1; //!< id for the next InFlightEvent
+    size_t maxInFlight = 1; //!< maximum number of publishes in progress at once
+    std::deque<InFlightEvent> readAhead; //!< Events read from the file queue ahead of publishing, in queue order
+    size_t readAheadCount = 0; //!< number of events to keep in readAhead
+    uint8_t codec = CODEC_NONE; //!< codec for compressing events in new segment files
+    std::vector<uint8_t> compressionDict; //!< Preset dictionary for PublishQueueLZSS, a PublishQueueEvent, or empty
+    QueueStats stats = {}; //!< Queue statistics; the depth and age fields are only filled in by getStats()
+    String statsEventName; //!< Event name for periodic statistics events
+    unsigned long statsEventPeriodMs = 0; //!< How often to publish statistics events, 0 = never
+    unsigned long statsEventLastMs = 0; //!< millis() value when the last statistics event was queued
     unsigned long stateTime = 0; //!< millis() value when entering the state, used for stateWait
     unsigned long durationMs = 0; //!< how long to wait before publishing in milliseconds, used in stateWait
-    bool publishComplete = false; //!< true if the publish has completed (successfully or not)
-    bool publishSuccess = false; //!< true if the publish succeeded
     bool pausePublishing = false; //!< flag to pause publishing (used from automated test)
     bool canSleep = false; //!< returns true if this is a good time to go to sleep
 
     unsigned long waitAfterConnect = 2000; //!< time to wait after Particle.connected() before publishing
-    unsigned long waitBetweenPublish = 1000; //!< how long to wait in milliseconds between publishes
-    unsigned long waitAfterFailure = 30000; //!< how long to wait after failing to publish before trying again
+
+    unsigned long publishIntervalMs = 1000; //!< token bucket refill interval, the average time between publishes
+    size_t publishBurst = 4; //!< token bucket size, the number of publishes that can be sent back-to-back
+    unsigned long bucketCreditMs = 0; //!< token bucket level in milliseconds; each publish uses publishIntervalMs
+    unsigned long bucketLastMs = 0; //!< millis() value when bucketCreditMs was last updated
+
+    unsigned long failureBackoffMinMs = 10000; //!< delay after the first failed publish, before jitter
+    unsigned long failureBackoffMaxMs = 300000; //!< maximum delay after consecutive failed publishes, before jitter
+    unsigned int consecutiveFailures = 0; //!< number of failed publishes since the last successful one
+
+    size_t summaryHighWater = 0; //!< file queue length to start merging events, 0 = never
+    size_t summaryLowWater = 0; //!< file queue length to stop merging events
+    MergeCallback mergeCallback = 0; //!< combines events with the same merge key
+    bool summarizing = false; //!< true if events with a merge key are being merged
 
     std::function<void(bool succeeded, const char *eventName, const char *eventData)> publishCompleteUserCallback = 0; //!< User callback for publish complete
 
@@ -1,5 +1,6 @@
 #include "SequentialFileRK.h"
 
+#include <algorithm>
 #include <dirent.h>
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -7,6 +8,18 @@
 
 static Logger _log("app.seqfile");
 
+const char * const SequentialFile::MANIFEST_FILENAME = "manifest";
+
+/**
+ * @brief Contents of the manifest file
+ */
+struct SequentialFileManifest {
+    uint32_t magic;         //!< SequentialFile::MANIFEST_MAGIC
+    int32_t headFileNum;    //!< First file number in the queue (greater than tailFileNum if empty)
+    int32_t tailFileNum;    //!< Last file number used
+    uint32_t checksum;      //!< SequentialFile::manifestChecksum() of headFileNum and tailFileNum
+};
+
 
 SequentialFile::SequentialFile() {
 
@@ -36,6 +49,11 @@ bool SequentialFile::scanDir(void) {
         return false;
     }
 
+    if (useManifest && loadManifest()) {
+        scanDirCompleted = true;
+        return true;
+    }
+
     _log.trace("scanning %s with pattern %s", dirPath.c_str(), pattern.c_str());
 
     DIR *dir = opendir(dirPath);
@@ -74,11 +92,122 @@ bool SequentialFile::scanDir(void) {
         }
     }
     closedir(dir);
+
+    // readdir() does not guarantee the order
+    queueMutexLock();
+    std::sort(queue.begin(), queue.end());
+    queueMutexUnlock();
     
+    lastAddedFileNum = lastFileNum;
     scanDirCompleted = true;
+
+    if (useManifest) {
+        manifestHead = manifestTail = 0;
+        saveManifest();
+    }
+    return true;
+}
+
+bool SequentialFile::loadManifest() {
+    SequentialFileManifest manifest;
+    bool valid = false;
+
+    String path = dirPath + String("/") + MANIFEST_FILENAME;
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        valid = (read(fd, &manifest, sizeof(manifest)) == sizeof(manifest) &&
+            manifest.magic == MANIFEST_MAGIC &&
+            manifest.checksum == manifestChecksum(manifest.headFileNum, manifest.tailFileNum) &&
+            manifest.headFileNum > 0 && manifest.headFileNum <= manifest.tailFileNum + 1);
+        close(fd);
+    }
+    if (!valid) {
+        _log.trace("no valid manifest in %s", dirPath.c_str());
+        return false;
+    }
+
+    int head = manifest.headFileNum;
+    int tail = manifest.tailFileNum;
+
+    // Files may have been removed from the head or added at the tail since the manifest was saved
+    while(head <= tail && !fileNumExists(head)) {
+        head++;
+    }
+    while(fileNumExists(tail + 1)) {
+        tail++;
+    }
+
+    queueMutexLock();
+    for(int fileNum = head; fileNum <= tail; fileNum++) {
+        if (preScanAddHook(getNameForFileNum(fileNum))) {
+            queue.push_back(fileNum); 
+        }
+    }
+    lastFileNum = lastAddedFileNum = tail;
+    queueMutexUnlock();
+
+    manifestHead = manifest.headFileNum;
+    manifestTail = manifest.tailFileNum;
+
+    _log.trace("loaded manifest %s head=%d tail=%d", dirPath.c_str(), head, tail);
     return true;
 }
 
+bool SequentialFile::saveManifest() {
+    if (!useManifest || !scanDirCompleted) {
+        return false;
+    }
+
+    SequentialFileManifest manifest;
+    manifest.magic = MANIFEST_MAGIC;
+
+    queueMutexLock();
+    manifest.tailFileNum = lastAddedFileNum;
+    manifest.headFileNum = queue.empty() ? (lastAddedFileNum + 1) : queue.front();
+    queueMutexUnlock();
+
+    if (manifest.headFileNum == manifestHead && manifest.tailFileNum == manifestTail) {
+        // Already saved
+        return true;
+    }
+    manifest.checksum = manifestChecksum(manifest.headFileNum, manifest.tailFileNum);
+
+    bool result = false;
+    String path = dirPath + String("/") + MANIFEST_FILENAME;
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC);
+    if (fd >= 0) {
+        result = (write(fd, &manifest, sizeof(manifest)) == sizeof(manifest));
+        close(fd);
+    }
+    if (result) {
+        manifestHead = manifest.headFileNum;
+        manifestTail = manifest.tailFileNum;
+        _log.trace("saved manifest %s head=%d tail=%d", dirPath.c_str(), manifestHead, manifestTail);
+    }
+    else {
+        unlink(path);
+        manifestHead = manifestTail = 0;
+    }
+    return result;
+}
+
+bool SequentialFile::fileNumExists(int fileNum) {
+    struct stat sb;
+    return stat(getPathForFileNum(fileNum), &sb) == 0;
+}
+
+// [static]
+uint32_t SequentialFile::manifestChecksum(int headFileNum, int tailFileNum) {
+    // FNV-1a
+    uint32_t hash = 2166136261UL;
+    const int values[2] = { headFileNum, tailFileNum };
+    const uint8_t *p = (const uint8_t *)values;
+    for(size_t ii = 0; ii < sizeof(values); ii++) {
+        hash = (hash ^ p[ii]) * 16777619UL;
+    }
+    return hash;
+}
+
 int SequentialFile::reserveFile(void) {
     if (!scanDirCompleted) {
         scanDir();
@@ -95,6 +224,18 @@ void SequentialFile::addFileToQueue(int fileNum) {
         lastFileNum = fileNum;
     }
 
+    if (useManifest && manifestHead && fileNum > lastAddedFileNum + 1) {
+        // The manifest can't find files after a gap in the file numbers, so make the 
+        // next scanDir() do a full scan unless the manifest is saved again
+        String path = dirPath + String("/") + MANIFEST_FILENAME;
+        unlink(path);
+        manifestHead = manifestTail = 0;
+        _log.trace("removed manifest, file %d added after %d", fileNum, lastAddedFileNum);
+    }
+    if (fileNum > lastAddedFileNum) {
+        lastAddedFileNum = fileNum;
+    }
+
     queueMutexLock();
     queue.push_back(fileNum); 
     queueMutexUnlock();
@@ -174,6 +315,15 @@ void SequentialFile::removeFileNum(int fileNum, bool allExtensions) {
         unlink(path);
         _log.trace("removed %s", path.c_str());
     }
+
+    if (useManifest && manifestHead && fileNum > manifestTail) {
+        // Files after the manifest tail are found by probing for consecutive file numbers,
+        // which no longer works once one of them is removed
+        String path = dirPath + String("/") + MANIFEST_FILENAME;
+        unlink(path);
+        _log.trace("removed manifest, file %d removed after %d", fileNum, manifestTail);
+        manifestHead = manifestTail = 0;
+    }
 }
 
 void SequentialFile::removeAll(bool removeDir) {
@@ -204,6 +354,8 @@ void SequentialFile::removeAll(bool removeDir) {
         rmdir(dirPath);
     }
     lastFileNum = 0;
+    lastAddedFileNum = 0;
+    manifestHead = manifestTail = 0;
     scanDirCompleted = false;
 
     queueMutexUnlock();
@@ -217,6 +369,14 @@ int SequentialFile::getQueueLen() const {
     return size;
 }
 
+std::deque<int> SequentialFile::getQueueFileNums() const {
+    queueMutexLock();
+    std::deque<int> result = queue;
+    queueMutexUnlock();
+
+    return result;
+}
+
 
 void SequentialFile::queueMutexLock() const {
     if (!queueMutex) {
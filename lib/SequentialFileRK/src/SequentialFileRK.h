@@ -102,6 +102,31 @@ public:
      */
     const char *getFilenameExtension() const { return filenameExtension; };
 
+    /**
+     * @brief Use a manifest file to avoid scanning the queue directory at startup (default: false)
+     * 
+     * @param value true to enable the manifest
+     * 
+     * The manifest is a small file in the queue directory ("manifest") containing the first and 
+     * last file numbers in the queue and a checksum. When it's valid, scanDir() builds the queue from
+     * the file number range instead of reading the directory, and only checks whether files were 
+     * added or removed at either end of the queue since it was saved. If it's missing or invalid,
+     * the directory is scanned as usual and a new manifest is saved.
+     * 
+     * The queue must be processed in order (the oldest file removed first) for this to work. 
+     * It is updated by saveManifest(), which you should call before sleep or reset, but it does 
+     * not need to be up to date. If a reserved file number is not added to the queue, the manifest 
+     * is removed so the next scanDir() does a full scan.
+     */
+    SequentialFile &withManifest(bool value = true) { useManifest = value; return *this; };
+
+    /**
+     * @brief Saves the manifest, if withManifest() is enabled and the queue has changed since it was last saved
+     * 
+     * @return true if the manifest is up to date
+     */
+    bool saveManifest();
+
     /**
      * @brief Scans the queue directory for files. Typically called during setup().
      */
@@ -198,6 +223,11 @@ public:
      */
     int getQueueLen() const;
 
+    /**
+     * @brief Gets a copy of the file numbers in the queue, oldest first
+     */
+    std::deque<int> getQueueFileNums() const;
+
     /**
      * @brief This class is not copyable
      */
@@ -240,7 +270,24 @@ protected:
      * This would allow a subclass to do some validation of the file before adding
      * it to the queue when reading the files from disk after reboot.
      */
-    virtual bool preScanAddHook(const char *name) { return true; };
+    virtual bool preScanAddHook(const char * /*name*/) { return true; };
+
+    /**
+     * @brief Builds the queue from the manifest file, called from scanDir()
+     * 
+     * @return true if the manifest was valid and the queue was loaded, false if a full scan is required
+     */
+    bool loadManifest();
+
+    /**
+     * @brief Returns true if the file for fileNum exists
+     */
+    bool fileNumExists(int fileNum);
+
+    /**
+     * @brief Calculates the checksum stored in the manifest file
+     */
+    static uint32_t manifestChecksum(int headFileNum, int tailFileNum);
 
     /**
      * @brief Lock the mutex used to protect the queue
@@ -273,6 +320,26 @@ protected:
      */
     bool scanDirCompleted = false;
 
+    /**
+     * @brief Use a manifest file, see withManifest()
+     */
+    bool useManifest = false;
+
+    /**
+     * @brief Head file number last written to the manifest file, or 0 if not written
+     */
+    int manifestHead = 0;
+
+    /**
+     * @brief Tail file number last written to the manifest file, or 0 if not written
+     */
+    int manifestTail = 0;
+
+    /**
+     * @brief Last file number added to the queue, used to detect file numbers that were reserved but not used
+     */
+    int lastAddedFileNum = 0;
+
     /**
      * @brief Last file number used.
      * 
@@ -286,6 +353,16 @@ protected:
      */
     mutable os_mutex_t queueMutex = 0;
 
+    /**
+     * @brief Filename of the manifest file in the queue directory
+     */
+    static const char * const MANIFEST_FILENAME;
+
+    /**
+     * @brief Magic bytes at the beginning of the manifest file
+     */
+    static const uint32_t MANIFEST_MAGIC = 0x5166f3a2;
+
     /**
      * @brief Queue of files
      * 
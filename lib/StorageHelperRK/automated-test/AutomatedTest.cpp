@@ -1,4 +1,24 @@
 #include "Particle.h"
+
+// Stand-in for the RTC RAM of the AB1805_RK library, which enables PersistentDataAB1805
+#define __AB1805RK_H
+class AB1805 {
+public:
+	size_t length() { return sizeof(ram); }
+
+	bool readRam(size_t ramAddr, uint8_t *data, size_t dataLen, bool lock = true) {
+		memcpy(data, &ram[ramAddr], dataLen);
+		return true;
+	}
+
+	bool writeRam(size_t ramAddr, const uint8_t *data, size_t dataLen, bool lock = true) {
+		memcpy(&ram[ramAddr], data, dataLen);
+		return true;
+	}
+
+	uint8_t ram[256] = {0};
+};
+
 #include "StorageHelperRK.h"
 
 
@@ -257,6 +277,13 @@ void customPersistentDataTest() {
 	s = data.getValue_test4();
 	assertStr("", s, "testing1!");
 
+	// A stored string that is not terminated, as in corrupted data, is only compared within the field
+	memset(data.myData.test4, 'x', sizeof(data.myData.test4));
+	bResult = data.setValue_test4("testing1!");
+	assertInt("", bResult, true);
+	s = data.getValue_test4();
+	assertStr("", s, "testing1!");
+
 	data.save();
 
 
@@ -293,6 +320,35 @@ void customPersistentDataTest() {
 }
 
 
+void lazyHashTest() {
+	unlink(persistentDataPath);
+
+	MyPersistentData data;
+	data.load();
+
+	// Setting values only marks the hash out of date; it's calculated when saved
+	uint32_t hash = data.myData.header.hash;
+	data.setValue_test1(1234);
+	data.setValue_test2(true);
+	data.setValue_test4("lazy");
+	assertInt("", data.myData.header.hash, hash);
+
+	data.flush(true);
+	assertInt("", data.myData.header.hash, data.getHash());
+
+	// Without a worker thread, the save is complete when flush() returns
+	assertInt("", data.waitForSave(0), true);
+
+	MyPersistentData data2;
+	data2.load();
+	assertInt("", data2.getValue_test1(), 1234);
+	assertInt("", data2.getValue_test2(), true);
+	assertStr("", data2.getValue_test4(), "lazy");
+
+	unlink(persistentDataPath);
+}
+
+
 class RetainedDataTest : public StorageHelperRK::PersistentDataBase {
 public:
 	class MyData {
@@ -401,9 +457,436 @@ void customRetainedDataTest() {
 }
 
 
+void transactionTest() {
+	RetainedDataTest::MyData retainedData;
+	memset(&retainedData, 0, sizeof(retainedData));
+
+	RetainedDataTest data(&retainedData.header);
+	data.load();
+
+	// Retained data is normally rehashed on every change, but only once at the end of a transaction
+	uint32_t hash = retainedData.header.hash;
+	{
+		StorageHelperRK::PersistentDataBase::Transaction transaction(data);
+		data.setValue_test1(5678);
+		data.setValue_test3(1.5);
+		{
+			StorageHelperRK::PersistentDataBase::Transaction nested(data);
+			data.setValue_test4("nested");
+		}
+		assertInt("", retainedData.header.hash, hash);
+		assertInt("", data.getValue_test1(), 5678);
+	}
+	assertInt("", retainedData.header.hash, data.getHash());
+
+	// No change, no new hash
+	hash = retainedData.header.hash;
+	{
+		StorageHelperRK::PersistentDataBase::Transaction transaction(data);
+		data.setValue_test1(5678);
+	}
+	assertInt("", retainedData.header.hash, hash);
+
+	RetainedDataTest data2(&retainedData.header);
+	data2.load();
+	assertInt("", data2.getValue_test1(), 5678);
+	assertDouble("", data2.getValue_test3(), 1.5, 0.001);
+	assertStr("", data2.getValue_test4(), "nested");
+
+	// File data with lazy hashing
+	unlink(persistentDataPath);
+
+	MyPersistentData fileData;
+	fileData.load();
+	{
+		StorageHelperRK::PersistentDataBase::Transaction transaction(fileData);
+		fileData.setValue_test1(4321);
+		fileData.setValue_test2(true);
+	}
+	fileData.flush(true);
+	assertInt("", fileData.myData.header.hash, fileData.getHash());
+
+	MyPersistentData fileData2;
+	fileData2.load();
+	assertInt("", fileData2.getValue_test1(), 4321);
+	assertInt("", fileData2.getValue_test2(), true);
+
+	unlink(persistentDataPath);
+}
+
+void dualSlotTest() {
+	String slotB = String(persistentDataPath) + ".b";
+	unlink(persistentDataPath);
+	unlink(slotB);
+
+	// Data saved before dual slot was enabled is loaded from the single file
+	{
+		MyPersistentData data;
+		data.load();
+		data.setValue_test1(1);
+		data.save();
+	}
+
+	MyPersistentData data;
+	data.withDualSlot().load();
+	assertInt("", data.getValue_test1(), 1);
+
+	// Saves alternate between the slots
+	data.setValue_test1(2);
+	data.save();
+	assertInt("", data.myData.header.generation, 1);
+
+	data.setValue_test1(3);
+	data.save();
+	assertInt("", data.myData.header.generation, 2);
+
+	{
+		MyPersistentData data2;
+		data2.withDualSlot().load();
+		assertInt("", data2.getValue_test1(), 3);
+	}
+
+	// Simulate power loss after the truncate of the next save (slot B)
+	int fd = open(slotB, O_RDWR | O_TRUNC);
+	close(fd);
+	{
+		MyPersistentData data2;
+		data2.withDualSlot().load();
+		assertInt("", data2.getValue_test1(), 3);
+
+		// The next save goes to the damaged slot, not over the good copy
+		data2.setValue_test1(4);
+		data2.save();
+		assertInt("", data2.myData.header.generation, 3);
+	}
+
+	// Simulate a partially written newest slot (B)
+	fd = open(slotB, O_RDWR);
+	lseek(fd, offsetof(MyPersistentData::MyData, test1), SEEK_SET);
+	write(fd, "\xff", 1);
+	close(fd);
+	{
+		MyPersistentData data2;
+		data2.withDualSlot().load();
+		assertInt("", data2.getValue_test1(), 3);
+		assertInt("", data2.myData.header.generation, 2);
+
+		// Still newer than the damaged slot
+		data2.setValue_test1(5);
+		data2.save();
+		assertInt("", data2.myData.header.generation, 4);
+	}
+	{
+		MyPersistentData data2;
+		data2.withDualSlot().load();
+		assertInt("", data2.getValue_test1(), 5);
+	}
+
+	unlink(persistentDataPath);
+	unlink(slotB);
+}
+
+void partialWriteTest() {
+	const size_t headerSize = sizeof(StorageHelperRK::PersistentDataBase::SavedDataHeader);
+	String slotB = String(persistentDataPath) + ".b";
+	unlink(persistentDataPath);
+	unlink(slotB);
+
+	MyPersistentData data;
+	data.load();
+
+	// Not loaded from the file, so the first save writes all of it
+	data.setValue_test1(1);
+	data.save();
+	assertInt("", data.getBytesWritten(), sizeof(MyPersistentData::MyData));
+
+	// Only the header and test1
+	data.setValue_test1(2);
+	data.save();
+	assertInt("", data.getBytesWritten(), sizeof(MyPersistentData::MyData) + headerSize + sizeof(int));
+
+	{
+		MyPersistentData data2;
+		data2.load();
+		assertInt("", data2.getValue_test1(), 2);
+
+		// Changing every field is cheaper as a full write
+		data2.setValue_test1(3);
+		data2.setValue_test2(true);
+		data2.setValue_test3(3.5);
+		data2.setValue_test4("partial");
+		data2.save();
+		assertInt("", data2.getBytesWritten(), sizeof(MyPersistentData::MyData));
+
+		data2.setValue_test4("part");
+		data2.save();
+		assertInt("", data2.getBytesWritten(), sizeof(MyPersistentData::MyData) + headerSize + sizeof(MyPersistentData::MyData::test4));
+	}
+	{
+		MyPersistentData data2;
+		data2.load();
+		assertInt("", data2.getValue_test1(), 3);
+		assertInt("", data2.getValue_test2(), true);
+		assertDouble("", data2.getValue_test3(), 3.5, 0.001);
+		assertStr("", data2.getValue_test4(), "part");
+	}
+
+	// With dual slot, each slot gets the changes since it was last written
+	{
+		MyPersistentData data2;
+		data2.withDualSlot().load();
+
+		data2.setValue_test1(4);
+		data2.save(); // slot B doesn't exist yet: full write
+		assertInt("", data2.getBytesWritten(), sizeof(MyPersistentData::MyData));
+
+		data2.setValue_test4("dual");
+		data2.save(); // slot A: test1 and test4, two ranges that cost more than a full write
+		assertInt("", data2.getBytesWritten(), 2 * sizeof(MyPersistentData::MyData));
+
+		data2.setValue_test4("dual2");
+		data2.save(); // slot B: test4
+		assertInt("", data2.getBytesWritten(), 2 * sizeof(MyPersistentData::MyData) + headerSize + sizeof(MyPersistentData::MyData::test4));
+
+		data2.setValue_test1(5);
+		data2.save(); // slot A: test4 and test1
+		assertInt("", data2.getBytesWritten(), 3 * sizeof(MyPersistentData::MyData) + headerSize + sizeof(MyPersistentData::MyData::test4));
+
+		data2.setValue_test1(6);
+		data2.save(); // slot B: test1
+		assertInt("", data2.getBytesWritten(), 3 * sizeof(MyPersistentData::MyData) + 2 * headerSize + sizeof(MyPersistentData::MyData::test4) + sizeof(int));
+	}
+	{
+		MyPersistentData data2;
+		data2.withDualSlot().load();
+		assertInt("", data2.getValue_test1(), 6);
+		assertStr("", data2.getValue_test4(), "dual2");
+		assertInt("", data2.myData.header.generation, 5);
+	}
+
+	// Both slots must also be complete copies on their own
+	unlink(slotB);
+	{
+		MyPersistentData data2;
+		data2.withDualSlot().load();
+		assertInt("", data2.getValue_test1(), 5);
+		assertStr("", data2.getValue_test4(), "dual2");
+		assertDouble("", data2.getValue_test3(), 3.5, 0.001);
+	}
+
+	unlink(persistentDataPath);
+	unlink(slotB);
+}
+
+void journalTest() {
+	const size_t headerSize = sizeof(StorageHelperRK::PersistentDataBase::SavedDataHeader);
+	const size_t recordSize = StorageHelperRK::PersistentDataFileSystem::JOURNAL_RECORD_OVERHEAD + sizeof(int);
+	String journal = String(persistentDataPath) + ".log";
+	struct stat sb;
+	unlink(persistentDataPath);
+	unlink(journal);
+
+	{
+		MyPersistentData data;
+		data.withJournal(3 * recordSize).load();
+
+		// Not loaded from the file, so the first save writes the data file
+		data.setValue_test1(1);
+		data.save();
+		assertInt("", data.getBytesWritten(), sizeof(MyPersistentData::MyData));
+		assertInt("", data.myData.header.generation, 1);
+
+		// Then only a record for each change
+		data.setValue_test1(2);
+		data.save();
+		data.setValue_test1(3);
+		data.save();
+		data.save(); // nothing changed
+		assertInt("", data.getBytesWritten(), sizeof(MyPersistentData::MyData) + 2 * recordSize);
+	}
+	{
+		MyPersistentData data;
+		data.withJournal(3 * recordSize).load();
+		assertInt("", data.getValue_test1(), 3);
+
+		// The third record fits
+		data.setValue_test1(4);
+		data.save();
+		assertInt("", data.getBytesWritten(), recordSize);
+
+		// The fourth compacts: the data file gets a partial write of test1 and the journal is truncated
+		data.setValue_test1(5);
+		data.save();
+		assertInt("", data.getBytesWritten(), recordSize + headerSize + sizeof(int));
+		assertInt("", data.myData.header.generation, 2);
+		stat(journal, &sb);
+		assertInt("", (int)sb.st_size, 0);
+
+		data.setValue_test4("journal");
+		data.save();
+		data.setValue_test1(6);
+		data.save();
+	}
+	{
+		MyPersistentData data;
+		data.withJournal(3 * recordSize).load();
+		assertInt("", data.getValue_test1(), 6);
+		assertStr("", data.getValue_test4(), "journal");
+	}
+
+	// Without the journal, the data file is the last compaction
+	{
+		MyPersistentData data;
+		data.load();
+		assertInt("", data.getValue_test1(), 5);
+		assertStr("", data.getValue_test4(), "");
+	}
+
+	// Simulate power loss while appending the last record (test1 = 6)
+	stat(journal, &sb);
+	truncate(journal, sb.st_size - 1);
+	{
+		MyPersistentData data;
+		data.withJournal(3 * recordSize).load();
+		assertInt("", data.getValue_test1(), 5);
+		assertStr("", data.getValue_test4(), "journal");
+
+		// The journal end isn't known, so the next save compacts, including the changes from the journal
+		data.setValue_test2(true);
+		data.save();
+		assertInt("", data.myData.header.generation, 3);
+		stat(journal, &sb);
+		assertInt("", (int)sb.st_size, 0);
+	}
+	{
+		MyPersistentData data;
+		data.load();
+		assertInt("", data.getValue_test1(), 5);
+		assertInt("", data.getValue_test2(), true);
+		assertStr("", data.getValue_test4(), "journal");
+	}
+
+	// Simulate power loss after a compaction wrote the data file, but before it truncated the journal
+	char *oldJournal;
+	size_t oldJournalSize;
+	{
+		MyPersistentData data;
+		data.withJournal(3 * recordSize).load();
+		data.setValue_test1(7);
+		data.save();
+		readTestData(journal, oldJournal, oldJournalSize);
+
+		data.setValue_test3(7.5);
+		data.setValue_test1(8);
+		data.save(); // compacts
+	}
+	FILE *fd = fopen(journal, "w");
+	fwrite(oldJournal, 1, oldJournalSize, fd);
+	fclose(fd);
+	free(oldJournal);
+	{
+		MyPersistentData data;
+		data.withJournal(3 * recordSize).load();
+		assertInt("", data.getValue_test1(), 8);
+		assertDouble("", data.getValue_test3(), 7.5, 0.001);
+	}
+
+	unlink(persistentDataPath);
+	unlink(journal);
+}
+
+class RtcPersistentData : public StorageHelperRK::PersistentDataAB1805 {
+public:
+	class MyData {
+	public:
+		// This structure must always begin with the header (16 bytes)
+		StorageHelperRK::PersistentDataBase::SavedDataHeader header;
+		int test1;
+		char test4[10];
+	};
+
+	static const uint32_t DATA_MAGIC = 0x5c3e81a7;
+	static const uint16_t DATA_VERSION = 1;
+
+	RtcPersistentData(AB1805 &ab1805) : PersistentDataAB1805(ab1805, 32, persistentDataPath, &myData.header, sizeof(MyData), DATA_MAGIC, DATA_VERSION) {};
+
+	int getValue_test1() const {
+		return getValue<int>(offsetof(MyData, test1));
+	}
+
+	void setValue_test1(int value) {
+		setValue<int>(offsetof(MyData, test1), value);
+	}
+
+	MyData myData;
+};
+
+void ab1805Test() {
+	AB1805 ab1805;
+	unlink(persistentDataPath);
+
+	RtcPersistentData data(ab1805);
+	data.withCheckpointIntervalMs(3600000).withSaveDelayMs(0);
+	data.load();
+
+	// Saves only go to the RTC RAM until the checkpoint
+	data.setValue_test1(1);
+	assertInt("", data.getBytesWritten(), 0);
+	{
+		RtcPersistentData data2(ab1805);
+		data2.load();
+		assertInt("", data2.getValue_test1(), 1);
+	}
+
+	data.checkpoint();
+	assertInt("", data.getBytesWritten(), sizeof(RtcPersistentData::MyData));
+
+	data.setValue_test1(2);
+	data.flush(false);
+	assertInt("", data.getBytesWritten(), sizeof(RtcPersistentData::MyData));
+	{
+		RtcPersistentData data2(ab1805);
+		data2.load();
+		assertInt("", data2.getValue_test1(), 2);
+	}
+
+	// RTC lost power: recover from the last checkpoint
+	memset(ab1805.ram, 0, sizeof(ab1805.ram));
+	{
+		RtcPersistentData data2(ab1805);
+		data2.withCheckpointIntervalMs(0);
+		data2.load();
+		assertInt("", data2.getValue_test1(), 1);
+
+		// The RTC RAM is restored from the file
+		RtcPersistentData data3(ab1805);
+		data3.load();
+		assertInt("", data3.getValue_test1(), 1);
+
+		// With a checkpoint interval of 0, every save also goes to the file
+		data2.setValue_test1(3);
+		data2.flush(true);
+		assertInt("", data2.getBytesWritten(), sizeof(RtcPersistentData::MyData));
+	}
+	memset(ab1805.ram, 0, sizeof(ab1805.ram));
+	{
+		RtcPersistentData data2(ab1805);
+		data2.load();
+		assertInt("", data2.getValue_test1(), 3);
+	}
+
+	unlink(persistentDataPath);
+}
+
 
 int main(int argc, char *argv[]) {
 	customPersistentDataTest();
+	lazyHashTest();
 	customRetainedDataTest();
+	transactionTest();
+	dualSlotTest();
+	partialWriteTest();
+	journalTest();
+	ab1805Test();
 	return 0;
 }
@@ -0,0 +1,122 @@
+// Microbenchmark for the cost of setValue() with the hash calculated on every change (PersistentDataBase,
+// as used for retained memory), with the five setters in one transaction, and with the hash only 
+// calculated when saved (PersistentDataFile).
+//
+// Build and run from the automated-test directory:
+//
+// g++ HashBenchmark.cpp ../src/StorageHelperRK.cpp UnitTestLib/helpers.cpp UnitTestLib/spark_wiring_json.cpp UnitTestLib/spark_wiring_print.cpp UnitTestLib/spark_wiring_string.cpp UnitTestLib/spark_wiring_time.cpp -include time.h UnitTestLib/time_compat.cpp -x c UnitTestLib/jsmn.c -x none -DUNITTEST -std=c++11 -O2 -w -IUnitTestLib -I../src -o HashBenchmark && ./HashBenchmark
+
+#include "Particle.h"
+#include "StorageHelperRK.h"
+
+#include <chrono>
+
+// Same fields as the application's current status data, optionally followed by padding to make it larger
+template<size_t PADDING>
+class BenchData {
+public:
+	StorageHelperRK::PersistentDataBase::SavedDataHeader header;
+	uint16_t faceNumber;
+	uint16_t faceScore;
+	uint16_t gestureType;
+	uint16_t gestureScore;
+	uint32_t lastCountTime;
+	float internalTempC;
+	float externalTempC;
+	uint8_t alertCode;
+	uint32_t lastAlertTime;
+	float stateOfCharge;
+	uint8_t batteryState;
+	uint8_t padding[PADDING];
+};
+
+// Sets the five fields GestureFaceSensor::loop() sets for each sample
+template<class Base, class Data>
+class BenchPersistentData : public Base {
+public:
+	BenchPersistentData(Data *data) : Base(data) {}
+
+	void sample(uint32_t ii) {
+		this->template setValue<uint16_t>(offsetof(Data, faceNumber), (uint16_t)(ii % 7));
+		this->template setValue<uint16_t>(offsetof(Data, faceScore), (uint16_t)(ii % 101));
+		this->template setValue<uint16_t>(offsetof(Data, gestureType), (uint16_t)(ii % 5));
+		this->template setValue<uint16_t>(offsetof(Data, gestureScore), (uint16_t)(ii % 97));
+		this->template setValue<uint32_t>(offsetof(Data, lastCountTime), ii);
+	}
+
+	void sampleTransaction(uint32_t ii) {
+		StorageHelperRK::PersistentDataBase::Transaction transaction(*this);
+		sample(ii);
+	}
+
+	// The part of save() that depends on lazy hashing, without the file write
+	void saveHash() {
+		this->finalizeHash();
+	}
+};
+
+template<class Data>
+class EagerBase : public StorageHelperRK::PersistentDataBase {
+public:
+	EagerBase(Data *data) : PersistentDataBase(&data->header, sizeof(Data), 0x4c8b2a51, 1) {
+		withSaveDelayMs(3600000);
+	}
+};
+
+template<class Data>
+class LazyBase : public StorageHelperRK::PersistentDataFile {
+public:
+	LazyBase(Data *data) : PersistentDataFile("./bench.dat", &data->header, sizeof(Data), 0x4c8b2a51, 1) {
+		withSaveDelayMs(3600000);
+	}
+};
+
+template<class Bench>
+double nsPerSample(Bench &bench, uint32_t samples, bool saveEachSample, bool transaction = false) {
+	auto start = std::chrono::steady_clock::now();
+	for(uint32_t ii = 1; ii <= samples; ii++) {
+		if (transaction) {
+			bench.sampleTransaction(ii);
+		}
+		else {
+			bench.sample(ii);
+		}
+		if (saveEachSample) {
+			bench.saveHash();
+		}
+	}
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / samples;
+}
+
+template<size_t PADDING>
+void run(uint32_t samples) {
+	typedef BenchData<PADDING> Data;
+
+	Data eagerData = {};
+	BenchPersistentData<EagerBase<Data>, Data> eager(&eagerData);
+	eager.load();
+
+	Data lazyData = {};
+	BenchPersistentData<LazyBase<Data>, Data> lazy(&lazyData);
+	unlink("./bench.dat");
+	lazy.load();
+
+	double eagerNs = nsPerSample(eager, samples, false);
+	double eagerTransactionNs = nsPerSample(eager, samples, false, true);
+	double lazyNs = nsPerSample(lazy, samples, false);
+	double lazySaveNs = nsPerSample(lazy, samples, true);
+
+	printf("%4u bytes  hash on every set %7.1f ns/setter  transaction %6.1f ns/setter  hash at save %6.1f ns/setter  hash at save, saved every sample %7.1f ns/setter\n",
+		(unsigned)sizeof(Data), eagerNs / 5, eagerTransactionNs / 5, lazyNs / 5, lazySaveNs / 5);
+}
+
+int main(int argc, char *argv[]) {
+	uint32_t samples = (argc > 1) ? (uint32_t)atoi(argv[1]) : 1000000;
+
+	run<1>(samples);
+	run<256>(samples);
+	run<1024>(samples);
+
+	unlink("./bench.dat");
+	return 0;
+}
@@ -158,6 +158,10 @@ public:
         ::printf("%s", buf);
     }
 
+    void print(const char *str) const {
+        ::printf("%s", str);
+    }
+
     void dump(const void *data, size_t size) const {
         dump(LOG_LEVEL_TRACE, data, size);
     }
@@ -218,6 +222,7 @@ const PublishFlag WITH_ACK(PUBLISH_EVENT_FLAG_WITH_ACK);
 
 
 uint32_t millis();
+void delay(uint32_t ms);
 
 using namespace spark;
 
@@ -25,8 +25,8 @@ bool StorageHelperRK::PersistentDataBase::load() {
 void StorageHelperRK::PersistentDataBase::flush(bool force) {
     if (lastUpdate) {
         if (force || (millis() - lastUpdate >= saveDelayMs)) {
-            save();
             lastUpdate = 0;
+            requestSave();
         }
     }
 }
@@ -36,10 +36,67 @@ void StorageHelperRK::PersistentDataBase::saveOrDefer() {
         lastUpdate = millis();
     }
     else {
-        save();
+        requestSave();
     }
 }
 
+void StorageHelperRK::PersistentDataBase::requestSave() {
+    WITH_LOCK(*this) {
+        savesRequested++;
+#ifndef UNITTEST
+        if (worker) {
+            if (saveQueued || worker->enqueue(this)) {
+                saveQueued = true;
+                return;
+            }
+            Log.error("persistent data worker queue full, saving from this thread");
+        }
+#endif
+    }
+    workerSave();
+}
+
+void StorageHelperRK::PersistentDataBase::workerSave() {
+    uint32_t requested;
+    WITH_LOCK(*this) {
+        // Changes after this point queue another save
+        saveQueued = false;
+        requested = savesRequested;
+    }
+
+    save();
+
+    WITH_LOCK(*this) {
+        if ((int32_t)(requested - savesCompleted) > 0) {
+            savesCompleted = requested;
+        }
+    }
+}
+
+bool StorageHelperRK::PersistentDataBase::waitForSave(uint32_t timeoutMs) {
+    uint32_t requested;
+    WITH_LOCK(*this) {
+        requested = savesRequested;
+    }
+
+    uint32_t start = millis();
+    while((int32_t)(savesCompleted - requested) < 0) {
+        if (millis() - start >= timeoutMs) {
+            return false;
+        }
+        delay(1);
+    }
+    return true;
+}
+
+#ifndef UNITTEST
+StorageHelperRK::PersistentDataBase &StorageHelperRK::PersistentDataBase::withWorker(PersistentDataWorker &worker) {
+    worker.start();
+    this->worker = &worker;
+    return *this;
+}
+#endif
+
 
 
 bool StorageHelperRK::PersistentDataBase::getValueString(size_t offset, size_t size, String &value) const {
@@ -64,10 +121,12 @@ bool StorageHelperRK::PersistentDataBase::setValueString(size_t offset, size_t s
             char *p = (char *)savedDataHeader;
             p += offset;
 
-            if (strcmp(value, p) != 0) {
+            // Bounded by size, as the stored string may not be terminated if the saved data is corrupted
+            if (strncmp(value, p, size) != 0) {
                 memset(p, 0, size);
                 strcpy(p, value);
-                updateHash();
+                rangeChanged(offset, size);
+                dataChanged();
             }
             result = true;
         }
@@ -99,8 +158,50 @@ uint32_t StorageHelperRK::PersistentDataBase::getHash() const {
     return hash;
 }
 
+#ifndef UNITTEST
+//
+// PersistentDataWorker
+//
+
+StorageHelperRK::PersistentDataWorker *StorageHelperRK::PersistentDataWorker::_instance;
+
+// [static]
+StorageHelperRK::PersistentDataWorker &StorageHelperRK::PersistentDataWorker::instance() {
+    if (!_instance) {
+        _instance = new PersistentDataWorker();
+    }
+    return *_instance;
+}
+
+void StorageHelperRK::PersistentDataWorker::start() {
+    if (!thread) {
+        os_queue_create(&queue, sizeof(PersistentDataBase *), QUEUE_SIZE, 0);
+
+        thread = new Thread("PersistentData", [this]() { threadFunction(); }, OS_THREAD_PRIORITY_DEFAULT, STACK_SIZE);
+    }
+}
+
+bool StorageHelperRK::PersistentDataWorker::enqueue(PersistentDataBase *data) {
+    return queue && os_queue_put(queue, &data, 0, 0) == 0;
+}
+
+void StorageHelperRK::PersistentDataWorker::threadFunction() {
+    while(true) {
+        PersistentDataBase *data;
+        if (os_queue_take(queue, &data, CONCURRENT_WAIT_FOREVER, 0) == 0) {
+            data->workerSave();
+        }
+    }
+}
+#endif // UNITTEST
+
 void StorageHelperRK::PersistentDataBase::updateHash() {
-    savedDataHeader->hash = getHash();
+    WITH_LOCK(*this) {
+        // Called after changing fields directly, so any byte may have changed
+        rangeChanged(0, savedDataSize);
+        savedDataHeader->hash = getHash();
+        hashDirty = false;
+    }
 #ifdef LOG_HASH
         Log.trace("updateHash size=%u hash=%08lx", (int)savedDataHeader->size, savedDataHeader->hash);
         Log.dump((const uint8_t *)savedDataHeader, savedDataHeader->size);
@@ -109,6 +210,41 @@ void StorageHelperRK::PersistentDataBase::updateHash() {
     saveOrDefer();
 }
 
+void StorageHelperRK::PersistentDataBase::dataChanged() {
+    if (transactionDepth) {
+        transactionChanged = true;
+    }
+    else if (lazyHash) {
+        hashDirty = true;
+        saveOrDefer();
+    }
+    else {
+        updateHash();
+    }
+}
+
+void StorageHelperRK::PersistentDataBase::beginTransaction() {
+    lock();
+    transactionDepth++;
+}
+
+void StorageHelperRK::PersistentDataBase::endTransaction() {
+    if (transactionDepth && --transactionDepth == 0 && transactionChanged) {
+        transactionChanged = false;
+        dataChanged();
+    }
+    unlock();
+}
+
+void StorageHelperRK::PersistentDataBase::finalizeHash() {
+    WITH_LOCK(*this) {
+        if (hashDirty) {
+            savedDataHeader->hash = getHash();
+            hashDirty = false;
+        }
+    }
+}
+
 bool StorageHelperRK::PersistentDataBase::validate(size_t dataSize) {
     bool isValid = false;
 
@@ -136,6 +272,7 @@ bool StorageHelperRK::PersistentDataBase::validate(size_t dataSize) {
             }
             savedDataHeader->size = (uint16_t) savedDataSize;
             savedDataHeader->hash = getHash();
+            hashDirty = false;
             isValid = true;
         }
     }   
@@ -154,10 +291,15 @@ void StorageHelperRK::PersistentDataBase::initialize() {
     savedDataHeader->version = savedDataVersion;
     savedDataHeader->size = (uint16_t) savedDataSize;
     savedDataHeader->hash = getHash();
+    hashDirty = false;
 }
 
 void StorageHelperRK::PersistentDataBase::save() {
-    savedDataHeader->hash = getHash();
+    if (!lazyHash) {
+        // The data may have been changed directly, and this is the saved copy
+        hashDirty = true;
+    }
+    finalizeHash();
     if (logData) {
         Log.info("saving data size=%d", (int)savedDataHeader->size);
         Log.dump((const uint8_t *)savedDataHeader, savedDataHeader->size);
@@ -199,6 +341,7 @@ bool StorageHelperRK::PersistentDataEEPROM::load() {
 
 void StorageHelperRK::PersistentDataEEPROM::save() {
     WITH_LOCK(*this) {
+        finalizeHash();
 #ifdef USE_HAL_EEPROM
         HAL_EEPROM_Put(eepromOffset, savedDataHeader, savedDataSize);        
 #else
@@ -225,47 +368,398 @@ void StorageHelperRK::PersistentDataEEPROM::save() {
 }
 #endif // UNITTEST
 
+String StorageHelperRK::PersistentDataFileSystem::getSlotFilename(int slot) const {
+    return (slot == 0) ? filename : (filename + ".b");
+}
+
+bool StorageHelperRK::PersistentDataFileSystem::readSlotGeneration(int slot, uint32_t &generation) {
+    bool result = false;
+
+    if (fs->open(getSlotFilename(slot).c_str(), O_RDONLY)) {
+        SavedDataHeader header;
+        if (fs->read((uint8_t *)&header, sizeof(header)) == sizeof(header) && header.magic == savedDataMagic) {
+            generation = header.generation;
+            result = true;
+        }
+        fs->close();
+    }
+    return result;
+}
+
+int StorageHelperRK::PersistentDataFileSystem::findNewestSlot(bool found[2]) {
+    uint32_t generation[2] = {0, 0};
+    for(int slot = 0; slot < 2; slot++) {
+        found[slot] = readSlotGeneration(slot, generation[slot]);
+    }
+
+    int newest = (found[1] && (!found[0] || (int32_t)(generation[1] - generation[0]) > 0)) ? 1 : 0;
+    lastGeneration = generation[newest];
+    currentSlot = newest;
+
+    return newest;
+}
+
+bool StorageHelperRK::PersistentDataFileSystem::loadSlot(int slot) {
+    bool loaded = false;
+    int dataSize = 0;
+
+    String slotFilename = getSlotFilename(slot);
+    if (fs->open(slotFilename.c_str(), O_RDONLY)) {
+        dataSize = fs->read((uint8_t *)savedDataHeader, savedDataSize);
+
+        // Log.info("request to read %d, got %d bytes", (int)savedDataSize, (int) dataSize);
+        // Log.dump((const uint8_t *)savedDataHeader, dataSize);
+
+        if (validate(dataSize)) {
+            loaded = true;
+        }
+        fs->close();
+    }
+    else {
+        Log.trace("did not open file %s", slotFilename.c_str());
+    }
+
+    // A slot can only be partially written if it's the same size as the data. If the structure
+    // grew, validate() padded it, and the next save to this slot writes the whole file.
+    slotCurrent[slot] = loaded && dataSize == (int)savedDataSize;
+    dirtyRanges[slot].clear();
+
+    return loaded;
+}
+
 bool StorageHelperRK::PersistentDataFileSystem::load() {
     WITH_LOCK(*this) {
         bool loaded = false;
 
-        int dataSize = 0;
+        slotCurrent[0] = slotCurrent[1] = false;
 
-        int fd = fs->open(filename, O_RDONLY);
-        if (fd != -1) {
-            dataSize = fs->read((uint8_t *)savedDataHeader, savedDataSize);
+        if (dualSlot) {
+            // Try the newest slot first. If it's not valid (power was lost while saving it), use the other one.
+            bool found[2];
+            int newest = findNewestSlot(found);
 
-            // Log.info("request to read %d, got %d bytes", (int)savedDataSize, (int) dataSize);
-            // Log.dump((const uint8_t *)savedDataHeader, dataSize);
-
-            if (validate(dataSize)) {
-                loaded = true;
+            for(int ii = 0; ii < 2 && !loaded; ii++) {
+                int slot = newest ^ ii;
+                if (found[slot] && loadSlot(slot)) {
+                    currentSlot = slot;
+                    loaded = true;
+                }
             }
-            fs->close();
         }
         else {
-            Log.trace("did not open file %s", filename.c_str());
+            loaded = loadSlot(0);
         }
         
         if (!loaded) {
+            slotCurrent[0] = slotCurrent[1] = false;
+            journalCurrent = false;
             initialize();
         }
+        else if (maxJournalSize) {
+            if (!dualSlot) {
+                lastGeneration = savedDataHeader->generation;
+            }
+            replayJournal();
+        }
     }
 
     return true;
 }
 
+bool StorageHelperRK::PersistentDataFileSystem::writeSlotFull(int slot, const uint8_t *data) {
+    bool result = false;
+
+    if (fs->open(getSlotFilename(slot).c_str(), O_RDWR | O_CREAT | O_TRUNC)) {
+        size_t count = fs->write(data, savedDataSize);
+
+        // Log.info("request to write %d, wrote %d bytes", (int)savedDataSize, (int) count);
+        // Log.dump(data, savedDataSize);
+
+        fs->close();
+
+        bytesWritten += count;
+        result = (count == savedDataSize);
+    }
+    return result;
+}
+
+bool StorageHelperRK::PersistentDataFileSystem::writeSlotPartial(int slot, const uint8_t *data, const DirtyRanges &ranges) {
+    bool result = false;
+
+    if (fs->open(getSlotFilename(slot).c_str(), O_RDWR)) {
+        result = true;
+        for(size_t ii = 0; ii < ranges.count && result; ii++) {
+            size_t size = ranges.end[ii] - ranges.start[ii];
+            size_t count = 0;
+            if (fs->seek(ranges.start[ii])) {
+                count = fs->write(data + ranges.start[ii], size);
+            }
+            bytesWritten += count;
+            result = (count == size);
+        }
+
+        // Header last; it includes the hash (and generation) for the data written above
+        if (result && fs->seek(0)) {
+            size_t count = fs->write(data, sizeof(SavedDataHeader));
+            bytesWritten += count;
+            result = (count == sizeof(SavedDataHeader));
+        }
+        else {
+            result = false;
+        }
+        fs->close();
+    }
+    return result;
+}
+
+void StorageHelperRK::PersistentDataFileSystem::rangeChanged(size_t offset, size_t size) {
+    size_t end = offset + size;
+    if (end > savedDataSize) {
+        end = savedDataSize;
+    }
+    // The header is always written
+    if (offset < sizeof(SavedDataHeader)) {
+        offset = sizeof(SavedDataHeader);
+    }
+    if (offset < end) {
+        dirtyRanges[0].add((uint16_t)offset, (uint16_t)end);
+        dirtyRanges[1].add((uint16_t)offset, (uint16_t)end);
+        journalRanges.add((uint16_t)offset, (uint16_t)end);
+    }
+}
+
+uint32_t StorageHelperRK::PersistentDataFileSystem::getJournalRecordHash(const JournalRecordHeader &record, const uint8_t *data) {
+    return murmur3_32(data, record.size, murmur3_32((const uint8_t *)&record, sizeof(record), 0));
+}
+
+void StorageHelperRK::PersistentDataFileSystem::replayJournal() {
+    journalSize = 0;
+    journalCurrent = false;
+    journalRanges.clear();
+
+    String journalFilename = getJournalFilename();
+    if (!fs->open(journalFilename.c_str(), O_RDONLY)) {
+        // No journal yet; the first save creates it
+        journalCurrent = true;
+        return;
+    }
+
+    uint8_t *buf = new uint8_t[savedDataSize];
+    size_t applied = 0;
+
+    while(buf) {
+        JournalRecordHeader record;
+        uint32_t hash;
+
+        size_t count = fs->read((uint8_t *)&record, sizeof(record));
+        if (count == 0) {
+            // End of the journal, with every record valid
+            journalCurrent = true;
+            break;
+        }
+        if (count != sizeof(record) || 
+            record.generation != savedDataHeader->generation || 
+            record.offset < sizeof(SavedDataHeader) || 
+            record.offset + record.size > savedDataSize ||
+            fs->read(buf, record.size) != record.size ||
+            fs->read((uint8_t *)&hash, sizeof(hash)) != sizeof(hash) ||
+            hash != getJournalRecordHash(record, buf)) {
+            // Incomplete record from a power loss while appending, or records from before the last compaction.
+            // The next save compacts, which also removes them.
+            break;
+        }
+
+        memcpy((uint8_t *)savedDataHeader + record.offset, buf, record.size);
+
+        // The data file doesn't have these changes yet
+        dirtyRanges[0].add(record.offset, record.offset + record.size);
+        dirtyRanges[1].add(record.offset, record.offset + record.size);
+
+        journalSize += JOURNAL_RECORD_OVERHEAD + record.size;
+        applied++;
+    }
+    fs->close();
+    delete[] buf;
+
+    if (applied) {
+        Log.trace("applied %u journal records from %s", (unsigned)applied, journalFilename.c_str());
+
+        hashDirty = true;
+        finalizeHash();
+        if (!validate(savedDataSize)) {
+            slotCurrent[0] = slotCurrent[1] = false;
+            journalCurrent = false;
+            initialize();
+        }
+    }
+}
+
+bool StorageHelperRK::PersistentDataFileSystem::appendJournal(const uint8_t *data, const DirtyRanges &ranges) {
+    bool result = false;
+
+    if (fs->open(getJournalFilename().c_str(), O_RDWR | O_CREAT)) {
+        result = fs->seek(journalSize);
+        for(size_t ii = 0; ii < ranges.count && result; ii++) {
+            JournalRecordHeader record;
+            record.generation = ((const SavedDataHeader *)data)->generation;
+            record.offset = ranges.start[ii];
+            record.size = ranges.end[ii] - ranges.start[ii];
+            uint32_t hash = getJournalRecordHash(record, data + record.offset);
+
+            size_t count = fs->write((const uint8_t *)&record, sizeof(record));
+            count += fs->write(data + record.offset, record.size);
+            count += fs->write((const uint8_t *)&hash, sizeof(hash));
+
+            bytesWritten += count;
+            result = (count == JOURNAL_RECORD_OVERHEAD + record.size);
+            if (result) {
+                journalSize += count;
+            }
+        }
+        fs->close();
+    }
+    return result;
+}
+
+bool StorageHelperRK::PersistentDataFileSystem::truncateJournal() {
+    bool result = false;
+
+    if (fs->open(getJournalFilename().c_str(), O_RDWR | O_CREAT | O_TRUNC)) {
+        fs->close();
+        result = true;
+    }
+    return result;
+}
+
+void StorageHelperRK::PersistentDataFileSystem::DirtyRanges::add(uint16_t newStart, uint16_t newEnd) {
+    // Merge with any ranges it overlaps or touches
+    for(size_t ii = 0; ii < count; ) {
+        if (newStart <= end[ii] && newEnd >= start[ii]) {
+            newStart = (start[ii] < newStart) ? start[ii] : newStart;
+            newEnd = (end[ii] > newEnd) ? end[ii] : newEnd;
+            count--;
+            start[ii] = start[count];
+            end[ii] = end[count];
+        }
+        else {
+            ii++;
+        }
+    }
+
+    if (count < MAX_RANGES) {
+        start[count] = newStart;
+        end[count] = newEnd;
+        count++;
+        return;
+    }
+
+    // Full: extend the range with the smallest gap to the new one
+    size_t nearest = 0;
+    uint16_t nearestGap = 0xffff;
+    for(size_t ii = 0; ii < count; ii++) {
+        uint16_t gap = (newStart > end[ii]) ? (newStart - end[ii]) : (start[ii] - newEnd);
+        if (gap < nearestGap) {
+            nearestGap = gap;
+            nearest = ii;
+        }
+    }
+    start[nearest] = (start[nearest] < newStart) ? start[nearest] : newStart;
+    end[nearest] = (end[nearest] > newEnd) ? end[nearest] : newEnd;
+}
+
+size_t StorageHelperRK::PersistentDataFileSystem::DirtyRanges::getTotalSize() const {
+    size_t total = 0;
+    for(size_t ii = 0; ii < count; ii++) {
+        total += end[ii] - start[ii];
+    }
+    return total;
+}
+
 void StorageHelperRK::PersistentDataFileSystem::save() {
-    WITH_LOCK(*this) {
-        int fd = fs->open(filename, O_RDWR | O_CREAT | O_TRUNC);
-        if (fd != -1) {            
-            /* size_t count = */fs->write((const uint8_t *)savedDataHeader, savedDataSize);
+    // Do not call with this object locked from a thread other than the worker, as the worker locks
+    // saveMutex and then this object.
+    WITH_LOCK(saveMutex) {
+        int slot = 0;
+        bool journal = false;
+        bool partial = false;
+        DirtyRanges ranges;
+        const uint8_t *data;
+
+        lock();
+        // With a journal, append the changes to it if they fit, otherwise compact by writing the data file
+        if (maxJournalSize && journalCurrent) {
+            ranges = journalRanges;
+            journal = (journalSize + ranges.getTotalSize() + ranges.count * JOURNAL_RECORD_OVERHEAD) <= maxJournalSize;
+        }
+
+        if (journal) {
+            journalRanges.clear();
+        }
+        else {
+            if (dualSlot) {
+                // Never overwrite the newest copy
+                slot = currentSlot ^ 1;
+            }
+            if (dualSlot || maxJournalSize) {
+                // The generation is part of the hashed data. Journal records are only applied to the generation they were written for.
+                savedDataHeader->generation = ++lastGeneration;
+                hashDirty = true;
+            }
+
+            // Write only the header and changed bytes if the slot's file holds the previous save, 
+            // unless that's about as much as rewriting the whole file
+            ranges = dirtyRanges[slot];
+            dirtyRanges[slot].clear();
+            journalRanges.clear();
+            partial = slotCurrent[slot] && 
+                (sizeof(SavedDataHeader) + ranges.getTotalSize() + (ranges.count + 1) * PARTIAL_WRITE_OVERHEAD) < savedDataSize;
+        }
+        finalizeHash();
+
+        // Write from a copy so other threads can use the data while the file is written
+        if (!snapshot) {
+            snapshot = new uint8_t[savedDataSize];
+        }
+        if (snapshot) {
+            memcpy(snapshot, savedDataHeader, savedDataSize);
+            data = snapshot;
+            unlock();
+        }
+        else {
+            data = (const uint8_t *)savedDataHeader;
+        }
+
+        bool written;
+        bool truncated = false;
+        if (journal) {
+            written = (ranges.count == 0) || appendJournal(data, ranges);
+        }
+        else {
+            written = partial ? writeSlotPartial(slot, data, ranges) : writeSlotFull(slot, data);
 
-            // Log.info("request to write %d, wrote %d bytes", (int)savedDataSize, (int) count);
-            // Log.dump((const uint8_t *)savedDataHeader, savedDataSize);
+            // Records in the journal are for the previous generation now
+            truncated = written && maxJournalSize && truncateJournal();
+        }
 
-            fs->close();
+        if (snapshot) {
+            lock();
+        }
+        if (journal) {
+            // If not written, the end of the journal is no longer known, so the next save compacts
+            journalCurrent = written;
+        }
+        else {
+            if (written) {
+                currentSlot = slot;
+            }
+            // If not written, the slot's file is no longer known, so the next save to it is a full write
+            slotCurrent[slot] = written;
+            journalCurrent = truncated;
+            if (truncated) {
+                journalSize = 0;
+            }
         }
+        unlock();
     }
     PersistentDataBase::save();
 }
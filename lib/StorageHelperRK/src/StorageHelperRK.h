@@ -549,6 +549,8 @@ public:
 
     #endif /* HAL_PLATFORM_FILESYSTEM || defined(UNITTEST) || defined(DOXYGEN_BUILD) */
 
+    class PersistentDataWorker;
+
     /**
      * @brief Base class for storing persistent binary data to a file or retained memory
      * 
@@ -568,7 +570,7 @@ public:
             uint16_t version;               //!< savedDataVersion, should rarely, if ever, change
             uint16_t size;                  //!< size of the whole structure, including the user data after it
             uint32_t hash;                  //!< hash value for verifying data integrity
-            uint32_t reserved1;             //!< reserved for future use
+            uint32_t generation;            //!< incremented on each save with PersistentDataFileSystem::withDualSlot(), otherwise 0
             // You cannot change the size of this structure without changing the version number!
         };
         
@@ -617,6 +619,20 @@ public:
             return *this;
         }
 
+        /**
+         * @brief Save from a worker thread instead of the thread that calls flush() or sets a value
+         * 
+         * @param worker The worker, normally PersistentDataWorker::instance(). It's started if necessary.
+         * @return PersistentDataBase& 
+         * 
+         * When a save is due, flush() (and setValue() with a save delay of 0) only queues this object
+         * for the worker thread, which then calls save(). Use waitForSave() when the data must be
+         * saved before continuing, such as before a reset.
+         * 
+         * Not available in unit tests, which have no threads.
+         */
+        PersistentDataBase &withWorker(PersistentDataWorker &worker);
+
 
         
 
@@ -661,6 +677,30 @@ public:
          */
         virtual void saveOrDefer();
 
+        /**
+         * @brief Saves now, or queues the save for the worker thread if withWorker() was used
+         * 
+         * This is what flush() and saveOrDefer() call when the save is due.
+         */
+        void requestSave();
+
+        /**
+         * @brief Waits until every save requested so far has been written
+         * 
+         * @param timeoutMs Maximum time to wait in milliseconds
+         * @return true if the saves completed or false on timeout
+         * 
+         * Only saves that have been requested are waited for, so call flush(true) first if the data
+         * may have changed within the save delay. Without a worker, saves are already complete when
+         * flush() returns and this returns true immediately.
+         */
+        bool waitForSave(uint32_t timeoutMs = 5000);
+
+        /**
+         * @brief Used internally by PersistentDataWorker to save the data from the worker thread
+         */
+        void workerSave();
+
         /**
          * @brief Templated class for getting integral values (uint32_t, float, double, etc.)
          * 
@@ -699,7 +739,8 @@ public:
                     T oldValue = *(T *)p;
                     if (oldValue != value) {
                         *(T *)p = value;
-                        updateHash();
+                        rangeChanged(offset, sizeof(T));
+                        dataChanged();
                     }
                 }
             }
@@ -740,9 +781,76 @@ public:
         /**
          * @brief Update the hash
          * 
+         * Use this after changing fields in the structure directly instead of using setValue(). It
+         * recalculates the hash immediately, then saves or defers the save like setValue().
          */
         void updateHash();
 
+        /**
+         * @brief Starts a group of changes that are hashed and saved as one update
+         * 
+         * Locks the object until the matching endTransaction(). While a transaction is open, setValue() 
+         * and setValueString() only record that the data changed; the hash is updated and the save is 
+         * scheduled once, by the outermost endTransaction(). Other threads block in getValue() until then, 
+         * so they never see a partially applied group of changes.
+         * 
+         * Transactions can be nested. It's usually easier to use a Transaction object than to call this directly.
+         */
+        void beginTransaction();
+
+        /**
+         * @brief Ends a group of changes started with beginTransaction() and unlocks the object
+         * 
+         * If any value changed during the outermost transaction, the hash is updated (or marked out 
+         * of date if lazyHash is set) and saveOrDefer() is called once.
+         */
+        void endTransaction();
+
+        /**
+         * @brief Applies several changes as one update for as long as this object is in scope
+         * 
+         * ```
+         * {
+         *     StorageHelperRK::PersistentDataBase::Transaction transaction(current);
+         *     current.set_faceNumber(faceNumber);
+         *     current.set_faceScore(faceScore);
+         * }
+         * ```
+         * 
+         * The constructor calls beginTransaction() and the destructor calls endTransaction().
+         */
+        class Transaction {
+        public:
+            /**
+             * @brief Begin a transaction on data
+             * 
+             * @param data The persistent data object to update. It must exist for the lifetime of this object.
+             */
+            explicit Transaction(PersistentDataBase &data) : data(data) {
+                data.beginTransaction();
+            }
+
+            /**
+             * @brief Ends the transaction, hashing and saving (or deferring the save) if anything changed
+             */
+            ~Transaction() {
+                data.endTransaction();
+            }
+
+            /**
+             * This class cannot be copied
+             */
+            Transaction(const Transaction&) = delete;
+
+            /**
+             * This class cannot be copied
+             */
+            Transaction& operator=(const Transaction&) = delete;
+
+        protected:
+            PersistentDataBase &data; //!< Object the transaction was started on
+        };
+
         static const uint32_t HASH_SEED = 0x851c2a3f; //!< Murmur32 hash seed value (randomly generated)
 
     protected:
@@ -779,6 +887,32 @@ public:
          */
         virtual void initialize();
 
+        /**
+         * @brief Called with the lock held after setValue() or setValueString() changes the data
+         * 
+         * If lazyHash is set, only marks the hash as out of date, so setting several fields in a row
+         * hashes the data once, when it's saved. Otherwise calls updateHash(). Inside a transaction,
+         * only records the change for endTransaction().
+         */
+        void dataChanged();
+
+        /**
+         * @brief Called with the lock held when bytes in the saved data change
+         * 
+         * @param offset Offset of the first changed byte from the start of the header
+         * @param size Number of bytes changed
+         * 
+         * Does nothing in this base class. PersistentDataFileSystem uses it to save only the changed bytes.
+         */
+        virtual void rangeChanged(size_t /*offset*/, size_t /*size*/) {}
+
+        /**
+         * @brief Recalculates the hash if the data has changed since it was last calculated
+         * 
+         * Subclasses that set lazyHash must call this in save() before writing the data.
+         */
+        void finalizeHash();
+
 
         SavedDataHeader *savedDataHeader = 0; //!< Pointer to the saved data header, which is followed by the data
         uint32_t savedDataSize = 0;     //!< Size of the saved data (header + actual data)
@@ -790,7 +924,77 @@ public:
         uint32_t saveDelayMs = 1000; //!< How long to wait to save before writing file to disk. Set to 0 to write immediately.
 
         bool logData = false; //!< Log data when read and saved
+
+        bool lazyHash = false; //!< Hash is only calculated in save(). Only for subclasses where savedDataHeader is not itself the saved copy.
+        bool hashDirty = false; //!< Data has changed since the hash was calculated (only when lazyHash is set)
+
+        uint16_t transactionDepth = 0; //!< Number of nested beginTransaction() calls without endTransaction()
+        bool transactionChanged = false; //!< Data has changed in the current transaction
+
+        PersistentDataWorker *worker = nullptr; //!< Worker that saves the data (see withWorker()), or null to save from the calling thread
+        bool saveQueued = false; //!< This object is in the worker's queue
+        uint32_t savesRequested = 0; //!< Number of saves requested by requestSave()
+        volatile uint32_t savesCompleted = 0; //!< Value of savesRequested when the last save started, set when it completes
+    };
+
+#ifndef UNITTEST
+    /**
+     * @brief Thread that saves persistent data objects, so flash writes don't block the loop thread
+     * 
+     * Objects are attached with PersistentDataBase::withWorker(). Their save requests go into an OS queue
+     * and the thread saves them in order. Each object is in the queue at most once; changes made before 
+     * its save starts are included in that save.
+     */
+    class PersistentDataWorker {
+    public:
+        /**
+         * @brief Gets the singleton instance of this class, allocating it if necessary
+         */
+        static PersistentDataWorker &instance();
+
+        /**
+         * @brief Creates the queue and starts the thread. Does nothing if already started.
+         */
+        void start();
+
+        /**
+         * @brief Queues an object to be saved from the worker thread
+         * 
+         * @param data The object to save
+         * @return true if queued, false if the worker is not started or the queue is full
+         */
+        bool enqueue(PersistentDataBase *data);
+
+        static const size_t QUEUE_SIZE = 8; //!< Number of save requests the queue holds
+        static const size_t STACK_SIZE = 4096; //!< Stack size of the worker thread
+
+    protected:
+        /**
+         * @brief Use instance() to get the singleton
+         */
+        PersistentDataWorker() {};
+
+        /**
+         * This class cannot be copied
+         */
+        PersistentDataWorker(const PersistentDataWorker&) = delete;
+
+        /**
+         * This class cannot be copied
+         */
+        PersistentDataWorker& operator=(const PersistentDataWorker&) = delete;
+
+        /**
+         * @brief Thread function, saves each object taken from the queue
+         */
+        void threadFunction();
+
+        os_queue_t queue = 0; //!< Queue of PersistentDataBase pointers to save
+        Thread *thread = nullptr; //!< Worker thread, allocated by start()
+
+        static PersistentDataWorker *_instance; //!< Singleton instance of this class
     };
+#endif // UNITTEST
 
     /**
      * @brief Class for persistent data stored in retained memory
@@ -837,6 +1041,7 @@ public:
          */
         PersistentDataEEPROM(int eepromOffset, SavedDataHeader *savedDataHeader, size_t savedDataSize, uint32_t savedDataMagic, uint16_t savedDataVersion) : 
             PersistentDataBase(savedDataHeader, savedDataSize, savedDataMagic, savedDataVersion), eepromOffset(eepromOffset) {
+            lazyHash = true;
         };
         
 
@@ -876,6 +1081,7 @@ public:
          */
         PersistentDataFRAM(MB85RC &fram, int framOffset, SavedDataHeader *savedDataHeader, size_t savedDataSize, uint32_t savedDataMagic, uint16_t savedDataVersion) : 
             PersistentDataBase(savedDataHeader, savedDataSize, savedDataMagic, savedDataVersion), fram(fram), framOffset(framOffset) {
+            lazyHash = true;
         };
         
         /**
@@ -900,6 +1106,7 @@ public:
          */
         virtual void save() {
             WITH_LOCK(*this) {
+                finalizeHash();
                 fram.writeData(framOffset, (const uint8_t*)savedDataHeader, savedDataSize);
             }
             PersistentDataBase::save();
@@ -935,10 +1142,12 @@ public:
          */
         PersistentDataFileSystem(FileSystemBase *fs, const char *filename, SavedDataHeader *savedDataHeader, size_t savedDataSize, uint32_t savedDataMagic, uint16_t savedDataVersion) : 
             PersistentDataBase(savedDataHeader, savedDataSize, savedDataMagic, savedDataVersion), fs(fs), filename(filename) {
+            lazyHash = true;
         };
 
         virtual ~PersistentDataFileSystem() {
             delete fs;
+            delete[] snapshot;
         }
 
         /**
@@ -952,6 +1161,103 @@ public:
             return *this;
         }
 
+        /**
+         * @brief Save alternately to two files so a power loss during a save never loses the data
+         * 
+         * @param value true to enable (default) or false to disable
+         * @return PersistentDataFileSystem& 
+         * 
+         * Without this, the file is truncated and rewritten on each save, and if power is lost between
+         * the truncate and the write, load() falls back to initialize() defaults. With it, each save 
+         * writes the slot that does not hold the newest copy of the data: the filename for slot A, and 
+         * the filename with ".b" appended for slot B. Each save increments the generation in the header,
+         * and load() uses the valid slot with the highest generation.
+         * 
+         * An existing single file is loaded as slot A, so this can be turned on for data that was saved
+         * without it. Call this before load().
+         */
+        PersistentDataFileSystem &withDualSlot(bool value = true) {
+            dualSlot = value;
+            return *this;
+        }
+
+        /**
+         * @brief Save changes as small records appended to a journal file, and rewrite the data file only when it's full
+         * 
+         * @param maxJournalSize Size of the journal file that triggers a compaction (default: 512 bytes)
+         * @return PersistentDataFileSystem& 
+         * 
+         * Each save appends a record for each range of bytes changed since the last save to the journal, 
+         * the filename with ".log" appended. A record is the generation of the data file, the offset and size
+         * of the range, the changed bytes, and a hash, so saving a 4-byte field writes JOURNAL_RECORD_OVERHEAD + 4 
+         * bytes instead of the whole file. When the records would make the journal larger than maxJournalSize,
+         * save() compacts instead: it writes the data file with a new generation (as a partial write, and to the 
+         * other slot with dual slot save) and then truncates the journal.
+         * 
+         * load() loads the data file and applies the records in the journal that have its generation, stopping at
+         * the first incomplete or corrupt record. Records from before the last compaction have an older generation and
+         * are ignored, so a power loss between writing the data file and truncating the journal does not apply them
+         * twice. Call this before load().
+         */
+        PersistentDataFileSystem &withJournal(size_t maxJournalSize = 512) {
+            this->maxJournalSize = maxJournalSize;
+            return *this;
+        }
+
+        /**
+         * @brief Number of bytes written to the file system by save() since this object was created
+         * 
+         * Includes the header on every save. Use this to compare the flash writes of partial saves
+         * against a full rewrite of savedDataSize bytes per save.
+         */
+        uint32_t getBytesWritten() const { return bytesWritten; };
+
+        /**
+         * @brief Byte ranges of the saved data changed since a slot was last written
+         * 
+         * Holds up to MAX_RANGES ranges. When full, a new range is merged with the nearest one, so the 
+         * ranges may include some unchanged bytes but never miss a changed one.
+         */
+        class DirtyRanges {
+        public:
+            /**
+             * @brief Add a range of changed bytes
+             * 
+             * @param start Offset of the first changed byte
+             * @param end Offset after the last changed byte
+             */
+            void add(uint16_t start, uint16_t end);
+
+            /**
+             * @brief Remove all ranges, after the slot is written
+             */
+            void clear() { count = 0; };
+
+            /**
+             * @brief Total number of bytes in all ranges
+             */
+            size_t getTotalSize() const;
+
+            static const size_t MAX_RANGES = 4; //!< Maximum number of separate ranges
+
+            uint16_t start[MAX_RANGES]; //!< Offset of the first byte of each range
+            uint16_t end[MAX_RANGES]; //!< Offset after the last byte of each range
+            size_t count = 0; //!< Number of ranges in use
+        };
+
+        /**
+         * @brief Header of a journal record, followed by size bytes of data and the uint32_t hash of the header and data
+         */
+        struct JournalRecordHeader {
+            uint32_t generation; //!< Generation of the data file the record applies to
+            uint16_t offset; //!< Offset of the changed bytes in the saved data
+            uint16_t size; //!< Number of changed bytes
+        };
+
+        static const size_t JOURNAL_RECORD_OVERHEAD = sizeof(JournalRecordHeader) + sizeof(uint32_t); //!< Bytes in a journal record in addition to the changed bytes
+
+        static const size_t PARTIAL_WRITE_OVERHEAD = 8; //!< Bytes a separate seek and write is counted as, in addition to its size, when choosing a partial or full write
+
         /**
          * @brief Load the persistent data file. You normally do not need to call this; it will be loaded automatically.
          * 
@@ -968,8 +1274,115 @@ public:
  
 
     protected:
+        /**
+         * @brief Get the filename for a slot
+         * 
+         * @param slot 0 for slot A (filename) or 1 for slot B (filename with ".b" appended)
+         */
+        String getSlotFilename(int slot) const;
+
+        /**
+         * @brief Read only the header of a slot, to find its generation
+         * 
+         * @param slot 0 or 1
+         * @param generation Filled in with the generation if the slot exists and has the right magic bytes
+         * @return true if the header was read and the magic bytes match
+         */
+        bool readSlotGeneration(int slot, uint32_t &generation);
+
+        /**
+         * @brief Reads the header of both slots to find the one with the highest generation
+         * 
+         * @param found Filled in with whether each slot has a header with the right magic bytes
+         * @return The newest slot (0 if neither was found)
+         * 
+         * Also sets lastGeneration and currentSlot, so the next save() writes the other slot with a higher generation.
+         */
+        int findNewestSlot(bool found[2]);
+
+        /**
+         * @brief Read a slot into the saved data and validate it
+         * 
+         * @param slot 0 or 1
+         * @return true if the slot was read and validate() returned true
+         */
+        bool loadSlot(int slot);
+
+        /**
+         * @brief Writes the whole saved data to a slot, truncating the file
+         * 
+         * @param slot 0 or 1
+         * @param data The data to write (savedDataSize bytes)
+         * @return true if the data was written
+         */
+        bool writeSlotFull(int slot, const uint8_t *data);
+
+        /**
+         * @brief Writes only the header and the dirty ranges of a slot, without truncating the file
+         * 
+         * @param slot 0 or 1. The slot must contain the data written by the last save to it (slotCurrent[slot]).
+         * @param data The data to write (savedDataSize bytes)
+         * @param ranges The ranges of data to write
+         * @return true if the data was written
+         */
+        bool writeSlotPartial(int slot, const uint8_t *data, const DirtyRanges &ranges);
+
+        /**
+         * @brief Get the filename of the journal (filename with ".log" appended)
+         */
+        String getJournalFilename() const { return filename + ".log"; };
+
+        /**
+         * @brief Hash of a journal record, stored after its data
+         */
+        static uint32_t getJournalRecordHash(const JournalRecordHeader &record, const uint8_t *data);
+
+        /**
+         * @brief Applies the journal records for the loaded generation to the saved data
+         * 
+         * Called by load() with the object locked, after the data file was loaded. Sets journalSize and journalCurrent.
+         */
+        void replayJournal();
+
+        /**
+         * @brief Appends a record to the journal for each range, at journalSize
+         * 
+         * @param data The data to write (savedDataSize bytes), with the generation in its header
+         * @param ranges The ranges of data to write
+         * @return true if all of the records were written
+         */
+        bool appendJournal(const uint8_t *data, const DirtyRanges &ranges);
+
+        /**
+         * @brief Truncates the journal after the data file was written
+         * 
+         * @return true if the journal is empty
+         */
+        bool truncateJournal();
+
+        /**
+         * @brief Adds the changed bytes to the dirty ranges of both slots
+         */
+        virtual void rangeChanged(size_t offset, size_t size);
+
         FileSystemBase *fs; //!< The file system object the persistent data will be stored on
         String filename; //!<  The filename on the file system
+
+        bool dualSlot = false; //!< Save alternately to two slots (see withDualSlot())
+        int currentSlot = 0; //!< Slot holding the newest saved copy of the data (dualSlot only)
+        uint32_t lastGeneration = 0; //!< Highest generation seen in either slot (dualSlot or journal only)
+
+        DirtyRanges dirtyRanges[2]; //!< Bytes changed since each slot was last loaded or saved
+        bool slotCurrent[2] = {false, false}; //!< Slot file is known to hold the data as of its last load or save, plus dirtyRanges
+        uint32_t bytesWritten = 0; //!< Bytes written by save(), returned by getBytesWritten()
+
+        size_t maxJournalSize = 0; //!< Journal size that triggers a compaction, or 0 to write the data file on every save (see withJournal())
+        DirtyRanges journalRanges; //!< Bytes changed since the last journal record or data file write
+        size_t journalSize = 0; //!< Bytes of valid records in the journal
+        bool journalCurrent = false; //!< Journal is known to hold only records for the loaded generation, ending at journalSize
+
+        CustomRecursiveMutex saveMutex; //!< Held for all of save(), so only one save writes the file at a time
+        uint8_t *snapshot = nullptr; //!< Copy of the data written by save(), so the object isn't locked while writing
     };
 
     #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST) || defined(DOXYGEN_BUILD)
@@ -996,6 +1409,170 @@ public:
     };
     #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST) || defined(DOXYGEN_BUILD)
 
+#if (defined(__AB1805RK_H) && (HAL_PLATFORM_FILESYSTEM || defined(UNITTEST))) || defined(DOXYGEN_BUILD)
+    /**
+     * @brief Support for the battery-backed RAM in the AB1805 RTC (AB1805_RK library), with checkpoints to a file
+     *
+     * If you include "AB1805_RK.h" before StorageHelperRK.h, this code will be enabled.
+     * 
+     * Every save writes the data to the AB1805 RAM, which survives sleep and reset without writing to flash. 
+     * The data is also saved to the file, like PersistentDataFile, at most once per checkpoint interval, 
+     * in case the RTC loses power. load() uses the RTC RAM if it's valid and the file otherwise.
+     * 
+     * The whole structure, including the 16-byte header, must fit in the 256 bytes of RTC RAM after ramAddr. 
+     * If it doesn't, an error is logged and the data is only saved to the file.
+     */
+    class PersistentDataAB1805 : public PersistentDataFile {
+    public:
+        /**
+         * @brief Class for persistent data saved in AB1805 RTC RAM and checkpointed to a file
+         * 
+         * @param ab1805 The AB1805 object. Its setup() must be called before load().
+         * @param ramAddr Address in the RTC RAM to store the data
+         * @param filename The filename or pathname to the file used for checkpoints
+         * @param savedDataHeader Pointer to the saved data header
+         * @param savedDataSize size of the whole structure, including the user data after it 
+         * @param savedDataMagic Magic bytes to use for this data
+         * @param savedDataVersion Version to use for this data
+         */
+        PersistentDataAB1805(AB1805 &ab1805, size_t ramAddr, const char *filename, SavedDataHeader *savedDataHeader, size_t savedDataSize, uint32_t savedDataMagic, uint16_t savedDataVersion) : 
+            PersistentDataFile(filename, savedDataHeader, savedDataSize, savedDataMagic, savedDataVersion), ab1805(ab1805), ramAddr(ramAddr) {
+        };
+
+        /**
+         * @brief Sets how often changed data is saved to the file. Default is 15 minutes.
+         * 
+         * @param value Value in milliseconds, or 0 to save to the file on every save
+         * @return PersistentDataAB1805& 
+         * 
+         * The checkpoint is made from flush(), so the object's flush(false) must be called from loop.
+         */
+        PersistentDataAB1805 &withCheckpointIntervalMs(uint32_t value) {
+            checkpointIntervalMs = value;
+            return *this;
+        }
+
+        /**
+         * @brief Load from the RTC RAM if valid, otherwise from the file
+         * 
+         * @return true 
+         * @return false 
+         */
+        virtual bool load() {
+            WITH_LOCK(*this) {
+                bool loaded = false;
+
+                lastCheckpoint = millis();
+                checkpointPending = false;
+
+                if (ramAddr + savedDataSize <= ab1805.length()) {
+                    if (ab1805.readRam(ramAddr, (uint8_t *)savedDataHeader, savedDataSize) && validate(savedDataSize)) {
+                        loaded = true;
+
+                        // The RTC RAM is at least as new as the file, so the next checkpoint is written
+                        // like the data changed, after the newest slot of the file
+                        slotCurrent[0] = slotCurrent[1] = false;
+                        if (dualSlot) {
+                            bool found[2];
+                            findNewestSlot(found);
+                        }
+                        checkpointPending = true;
+                    }
+                }
+                else {
+                    Log.error("data size %d does not fit in RTC RAM at %d", (int)savedDataSize, (int)ramAddr);
+                }
+
+                if (!loaded) {
+                    PersistentDataFile::load();
+                    saveRam();
+                }
+            }
+
+            return true;
+        }
+
+        /**
+         * @brief Save to the RTC RAM, and to the file if a checkpoint is due. You normally do not need to call this; it will be saved automatically.
+         */
+        virtual void save() {
+            bool checkpointDue;
+
+            WITH_LOCK(*this) {
+                finalizeHash();
+                checkpointPending = true;
+                checkpointDue = !saveRam() || isCheckpointDue();
+            }
+            if (checkpointDue) {
+                checkpoint();
+            }
+        }
+
+        /**
+         * @brief Saves to the RTC RAM if changed and the wait to save time has expired, and to the file 
+         * if changed since the last checkpoint and the checkpoint interval has expired
+         * 
+         * @param force Pass true to ignore the wait to save time. The RTC RAM survives sleep and reset, so this
+         * does not force a checkpoint; use checkpoint() for that.
+         * 
+         * With withWorker(), both are saved from the worker thread.
+         */
+        virtual void flush(bool force) {
+            PersistentDataFile::flush(force);
+
+            bool checkpointDue;
+            WITH_LOCK(*this) {
+                checkpointDue = checkpointPending && isCheckpointDue();
+            }
+            if (checkpointDue) {
+                requestSave();
+            }
+        }
+
+        /**
+         * @brief Save the data to the file now
+         * 
+         * Use this before an operation that may remove power from the RTC. This saves from the calling
+         * thread, even with withWorker(). Do not call it with this object locked.
+         */
+        void checkpoint() {
+            PersistentDataFile::save();
+
+            WITH_LOCK(*this) {
+                lastCheckpoint = millis();
+                checkpointPending = false;
+
+                // The file save may have changed the generation and hash in the header
+                saveRam();
+            }
+        }
+
+    protected:
+        /**
+         * @brief Writes the data to the RTC RAM
+         * 
+         * @return true if it fits in the RTC RAM and was written
+         */
+        bool saveRam() {
+            finalizeHash();
+            return (ramAddr + savedDataSize <= ab1805.length()) && ab1805.writeRam(ramAddr, (const uint8_t *)savedDataHeader, savedDataSize);
+        }
+
+        /**
+         * @brief Returns true if the checkpoint interval has expired since the last checkpoint
+         */
+        bool isCheckpointDue() const {
+            return checkpointIntervalMs == 0 || millis() - lastCheckpoint >= checkpointIntervalMs;
+        }
+
+        AB1805 &ab1805; //!< Reference to the AB1805 object
+        size_t ramAddr; //!< Address in the RTC RAM to save the data
+        uint32_t checkpointIntervalMs = 15 * 60 * 1000; //!< How often to save changed data to the file (0 = every save)
+        uint32_t lastCheckpoint = 0; //!< millis() value at the last checkpoint or load
+        bool checkpointPending = false; //!< Data has changed since the last checkpoint
+    };
+#endif // (defined(__AB1805RK_H) && (HAL_PLATFORM_FILESYSTEM || defined(UNITTEST))) || defined(DOXYGEN_BUILD)
+
     /**
      * @brief Murmur3 hash algorithm implementation
      * 
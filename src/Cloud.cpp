@@ -29,6 +29,7 @@
  */
 
 #include "Cloud.h"
+#include "SensorManager.h"
 
 
 // Identify the cloud ledger we will be using
@@ -47,15 +48,20 @@ Cloud &Cloud::instance() {
 
 Cloud::Cloud() {
     isFirstConfiguration = false;
+    appliedFingerprint = 0;
+    ledgerSynced = false;
+    lastIntegrityCheck = 0;
 }
 
 Cloud::~Cloud() {
 }
 
 void Cloud::setup() {
-    // Initialize ledgers but don't sync yet
+    // Initialize ledgers and register for sync notifications once; the cloud pushes changes to the device
     defaultSettings = Particle.ledger("default-settings");
     deviceSettings = Particle.ledger("device-settings");
+    defaultSettings.onSync(syncCallback);
+    deviceSettings.onSync(syncCallback);
     
     Log.info("Cloud configuration system initialized");
     
@@ -74,35 +80,33 @@ void Cloud::setup() {
 
 void Cloud::loop() {
     // Only check for updates if we're connected
-    if (Particle.connected()) {
-        
-        if (sysStatus.get_disconnectedMode()) {
-            // Disconnected mode: Check for config changes when updatesPending is set
-            // or on first connection after device startup
-            if (sysStatus.get_updatesPending()) {
-                Log.info("Disconnected mode: Updates pending, checking configuration");
-                if (loadConfigurationFromCloud()) {
-                    Log.info("Configuration loaded and saved successfully");
-                } else {
-                    Log.warn("Failed to load configuration from cloud");
-                }
-            }
-        } else {
-            // Connected mode: Check once per hour using real time
-            static time_t lastConfigCheck = 0;
-            const time_t configCheckInterval = 3600; // 1 hour in seconds
-            
-            time_t currentTime = Time.now();
-            if (currentTime - lastConfigCheck >= configCheckInterval || sysStatus.get_updatesPending()) {
-                lastConfigCheck = currentTime;
-                Log.info("Connected mode: Checking for configuration updates");
-                if (loadConfigurationFromCloud()) {
-                    Log.info("Configuration loaded and saved successfully");
-                } else {
-                    Log.warn("Failed to load configuration from cloud");
-                }
-            }
-        }
+    if (!Particle.connected()) {
+        return;
+    }
+
+    if (sysStatus.get_updatesPending()) {
+        // First connection after startup, invalid configuration, or requested
+        Log.info("Updates pending, checking configuration");
+    }
+    else if (ledgerSynced) {
+        Log.info("Ledger synced, checking configuration");
+    }
+    else if (!sysStatus.get_disconnectedMode() && millis() - lastIntegrityCheck >= CONFIG_INTEGRITY_CHECK_MS) {
+        // Connected mode: rarely re-read and re-apply the ledgers in case a sync was missed or the saved configuration changed.
+        // Values that match are not written to flash.
+        Log.info("Connected mode: Checking configuration integrity");
+        appliedFingerprint = 0;
+    }
+    else {
+        return;
+    }
+
+    ledgerSynced = false;
+    lastIntegrityCheck = millis();
+    if (loadConfigurationFromCloud()) {
+        Log.info("Configuration loaded and saved successfully");
+    } else {
+        Log.warn("Failed to load configuration from cloud");
     }
 }
 
@@ -361,28 +365,7 @@ bool Cloud::configureFromDeviceSettings() {
         return false;
     }
 
-    Log.info("Applying configuration from device-specific settings...");
-    bool success = true;
-
-    // Apply each configuration section
-    success &= applyMessagingConfig(data);
-    success &= applyTimingConfig(data);
-    success &= applyPowerConfig(data);
-    success &= applySensorConfig(data);
-
-    if (success) {
-        Log.info("All device-specific configurations applied successfully");
-        
-        // Force save the new configuration to persistent memory
-        sysStatus.flush(true);
-        sensorConfig.flush(true);
-        
-        Log.info("Configuration saved to persistent memory");
-    } else {
-        Log.warn("Some configurations failed to apply");
-    }
-
-    return success;
+    return applyConfiguration(data, "device-settings");
 }
 
 bool Cloud::configureFromCloudDefaults() {
@@ -394,38 +377,61 @@ bool Cloud::configureFromCloudDefaults() {
         return false;
     }
 
-    Log.info("Applying configuration from cloud defaults...");
+    return applyConfiguration(data, "default-settings");
+}
+
+bool Cloud::applyConfiguration(const LedgerData& data, const char *source) {
+    // The hourly check and syncCallback usually get the same configuration again
+    uint32_t fingerprint = configurationFingerprint(data);
+    if (fingerprint == appliedFingerprint) {
+        Log.info("Configuration from %s unchanged (%08lx), not applied", source, (unsigned long)fingerprint);
+        return true;
+    }
+
+    Log.info("Applying configuration from %s...", source);
     bool success = true;
 
-    // Apply each configuration section
-    success &= applyMessagingConfig(data);
-    success &= applyTimingConfig(data);
-    success &= applyPowerConfig(data);
-    success &= applySensorConfig(data);
+    // Apply each configuration section as one update of each persistent data object
+    {
+        StorageHelperRK::PersistentDataBase::Transaction sysStatusTransaction(sysStatus);
+        StorageHelperRK::PersistentDataBase::Transaction sensorConfigTransaction(sensorConfig);
+        success &= applyMessagingConfig(data);
+        success &= applyTimingConfig(data);
+        success &= applyPowerConfig(data);
+        success &= applySensorConfig(data);
+    }
 
     if (success) {
-        Log.info("All cloud default configurations applied successfully");
-        
-        // DEBUG: Check values before flush
-        Log.info("DEBUG: Before flush - faceThreshold: %d, gestureThreshold: %d", 
-                 sensorConfig.get_faceThreshold(), sensorConfig.get_gestureThreshold());
+        Log.info("All configurations from %s applied successfully", source);
         
-        // Force save the new configuration to persistent memory
+        // Force save the new configuration to persistent memory. Only objects with changed values are written.
         sysStatus.flush(true);
-        sensorConfig.flush(true);  // flush() returns void, not bool
+        sensorConfig.flush(true);
         
-        // DEBUG: Check values after flush
-        Log.info("DEBUG: After flush - faceThreshold: %d, gestureThreshold: %d", 
-                 sensorConfig.get_faceThreshold(), sensorConfig.get_gestureThreshold());
-                 
         Log.info("Configuration saved to persistent memory");
+        appliedFingerprint = fingerprint;
+
+        // Push the thresholds to the sensor now instead of at the next reset. It only writes the ones that differ.
+        if (!SensorManager::instance().applySensorConfig()) {
+            // Try again on the next sync or integrity check
+            Log.warn("Sensor configuration not applied");
+            appliedFingerprint = 0;
+        }
     } else {
+        // Not remembered, so the same configuration is applied (and logged) again next time
         Log.warn("Some configurations failed to apply");
+        appliedFingerprint = 0;
     }
 
     return success;
 }
 
+// [static]
+uint32_t Cloud::configurationFingerprint(const LedgerData& data) {
+    String json = Variant(data).toJSON();
+    return StorageHelperRK::murmur3_32((const uint8_t *)json.c_str(), json.length(), 0);
+}
+
 bool Cloud::loadConfigurationFromCloud() {
     if (!Particle.connected()) {
         Log.warn("Not connected to cloud, cannot load configuration");
@@ -434,18 +440,11 @@ bool Cloud::loadConfigurationFromCloud() {
     
     Log.info("Loading configuration from cloud");
     
-    // Subscribe to ledger updates if not already done
-    if (defaultSettings.isValid()) {
-        Log.info("Default settings ledger is valid");
-        defaultSettings.onSync(syncCallback);
-    } else {
+    // The sync callbacks were registered in setup()
+    if (!defaultSettings.isValid()) {
         Log.warn("Default settings ledger is NOT valid");
     }
-    
-    if (deviceSettings.isValid()) {
-        Log.info("Device settings ledger is valid");
-        deviceSettings.onSync(syncCallback);
-    } else {
+    if (!deviceSettings.isValid()) {
         Log.warn("Device settings ledger is NOT valid");
     }
     
@@ -475,6 +474,8 @@ bool Cloud::loadConfigurationFromCloud() {
     if (success) {
         sysStatus.set_updatesPending(false);
         sysStatus.flush(true);  // Save the cleared flag
+        sysStatus.waitForSave();
+        sensorConfig.waitForSave();
         Log.info("Configuration updates completed and saved");
     }
     
@@ -488,6 +489,9 @@ bool Cloud::isConnectedMode() {
 
 bool Cloud::reloadConfiguration() {
     Log.info("Manually reloading configuration");
+
+    // Apply it even if it's the same as the last configuration applied
+    appliedFingerprint = 0;
     
     // First try device-specific settings, then fall back to defaults
     if (isDeviceConfigured()) {
@@ -571,11 +575,9 @@ String Cloud::createConfigurationJSON() {
 void Cloud::syncCallback(Ledger ledger) {
     Log.info("syncCallback called for ledger: %s", ledger.name());
     
-    // If device-settings ledger was updated, reload configuration
-    if (String(ledger.name()) == "device-settings") {
-        Log.info("Device settings updated, triggering configuration reload");
-        Cloud::instance().configureFromDeviceSettings();
-    }
+    // Either ledger can change the configuration (device-settings overrides default-settings).
+    // loop() applies it, so the work isn't done in the callback.
+    Cloud::instance().ledgerSynced = true;
 }
 
 bool Cloud::isDeviceConfigured() {
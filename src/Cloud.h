@@ -81,7 +81,7 @@ public:
     bool reloadConfiguration();
 
     /**
-     * @brief Apply device configuration from ledger data
+     * @brief Called when the cloud syncs a ledger to the device; loop() then applies the configuration
      * 
      */
     static void syncCallback(Ledger ledger);
@@ -141,6 +141,26 @@ private:
      */
     bool applySensorConfig(const LedgerData& data);
 
+    /**
+     * @brief Apply all configuration sections from ledger data and save them, unless it was already applied
+     * 
+     * @param data LedgerData from the default-settings or device-settings ledger
+     * @param source Ledger name for logging
+     * @return true if successful, including when the same configuration was applied before
+     * 
+     * The data is fingerprinted with murmur3_32 of its JSON. When it matches the fingerprint of the last
+     * configuration applied successfully, the validation, persistent data updates and flushes are skipped.
+     */
+    bool applyConfiguration(const LedgerData& data, const char *source);
+
+    /**
+     * @brief Fingerprint of ledger data, used to detect a configuration that has already been applied
+     * 
+     * @param data LedgerData to fingerprint
+     * @return murmur3_32 hash of the JSON of the data
+     */
+    static uint32_t configurationFingerprint(const LedgerData& data);
+
     /**
      * @brief Validate configuration value is within acceptable range
      * 
@@ -165,6 +185,26 @@ private:
      */
     bool isFirstConfiguration;
 
+    /**
+     * @brief Fingerprint of the last configuration applied successfully, 0 if none since boot
+     */
+    uint32_t appliedFingerprint;
+
+    /**
+     * @brief Set by syncCallback() when a ledger was updated by the cloud, cleared by loop() when it applies the configuration
+     */
+    volatile bool ledgerSynced;
+
+    /**
+     * @brief millis() value when loop() last read the ledgers
+     */
+    uint32_t lastIntegrityCheck;
+
+    /**
+     * @brief How often loop() re-reads the ledgers in connected mode without a sync (24 hours)
+     */
+    static const uint32_t CONFIG_INTEGRITY_CHECK_MS = 24 * 60 * 60 * 1000;
+
     /**
      * @brief Check if device is in connected mode (stays connected)
      * 
@@ -1,5 +1,6 @@
 // src/GestureFaceSensor.cpp - Updated implementation
 #include "GestureFaceSensor.h"
+#include "PublishQueuePosixRK.h"
 
 // Buffer for formatted output
 static char str[100];
@@ -48,19 +49,8 @@ bool GestureFaceSensor::setup() {
         return false;
     }
     
-    // Set the face detection threshold
-    if (_gfd->setFaceDetectThres(sensorConfig.get_faceThreshold())) {
-        Log.info("Face detection threshold set to %d", sensorConfig.get_faceThreshold());
-    } else {
-        Log.warn("Failed to set face detection threshold");
-    }
-    
-    // Set the gesture detection threshold
-    if (_gfd->setGestureDetectThres(sensorConfig.get_gestureThreshold())) {
-        Log.info("Gesture detection threshold set to %d", sensorConfig.get_gestureThreshold());
-    } else {
-        Log.warn("Failed to set gesture detection threshold");
-    }
+    // Set the face and gesture detection thresholds
+    applyConfig();
     
     return _initialized;
 }
@@ -86,7 +76,8 @@ bool GestureFaceSensor::loop() {
         _lastData.timestamp = Time.now();
         _lastData.hasNewData = true;
         
-        // Update persistent storage with new data
+        // Update persistent storage with new data as one update (one hash and one deferred save)
+        StorageHelperRK::PersistentDataBase::Transaction transaction(current);
         current.set_faceNumber(_lastData.faceNumber);
         current.set_faceScore(_lastData.faceScore);
         current.set_gestureType(_lastData.gestureType);
@@ -97,6 +88,37 @@ bool GestureFaceSensor::loop() {
     return hasNewData;
 }
 
+bool GestureFaceSensor::applyConfig() {
+    if (!_initialized || !_gfd) {
+        return false;
+    }
+
+    bool success = true;
+
+    // Only write a threshold that differs, and read it back to verify the sensor took it
+    uint16_t faceThreshold = sensorConfig.get_faceThreshold();
+    if (_gfd->getFaceDetectThres() != faceThreshold) {
+        if (_gfd->setFaceDetectThres(faceThreshold) && _gfd->getFaceDetectThres() == faceThreshold) {
+            Log.info("Face detection threshold set to %d", faceThreshold);
+        } else {
+            Log.warn("Failed to set face detection threshold to %d", faceThreshold);
+            success = false;
+        }
+    }
+
+    uint16_t gestureThreshold = sensorConfig.get_gestureThreshold();
+    if (_gfd->getGestureDetectThres() != gestureThreshold) {
+        if (_gfd->setGestureDetectThres(gestureThreshold) && _gfd->getGestureDetectThres() == gestureThreshold) {
+            Log.info("Gesture detection threshold set to %d", gestureThreshold);
+        } else {
+            Log.warn("Failed to set gesture detection threshold to %d", gestureThreshold);
+            success = false;
+        }
+    }
+
+    return success;
+}
+
 SensorData GestureFaceSensor::getData() const {
     return _lastData;
 }
@@ -133,7 +155,7 @@ bool GestureFaceSensor::getFaceData() {
         }
         
         if (Particle.connected() && sysStatus.get_verboseMode()) {
-            Particle.publish("Status", str, PRIVATE);
+            PublishQueuePosix::instance().publish("Status", str, PublishQueuePosix::PublishOptions().withSupersedeKey("Status"), PRIVATE);
         }
         Log.info("%s", str);
         return true;
@@ -180,7 +202,7 @@ bool GestureFaceSensor::getGestureData() {
         }
         
         if (Particle.connected() && sysStatus.get_verboseMode()) {
-            Particle.publish("Status", str, PRIVATE);
+            PublishQueuePosix::instance().publish("Status", str, PublishQueuePosix::PublishOptions().withSupersedeKey("Status"), PRIVATE);
         }
         Log.info("%s", str);
         return true;
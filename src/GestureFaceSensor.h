@@ -27,6 +27,7 @@ public:
     String getSensorType() const override { return "GestureFace"; }
     bool isReady() const override { return _initialized; }
     void reset() override;
+    bool applyConfig() override;
     
 protected:
     GestureFaceSensor();
@@ -37,6 +37,19 @@ struct SensorData {
      * @return true if JSON was created successfully
      */
     bool toJSON(char* buffer, size_t bufferSize) const;
+
+    /**
+     * @brief Combine two sensor-data JSON events into an hourly summary
+     * @param queued JSON of the queued event, a sample from toJSON() or a previous summary
+     * @param sample JSON of the new event
+     * @param buffer Character buffer to write the summary JSON into
+     * @param bufferSize Size of the buffer
+     * @return true if the summary was created successfully
+     *
+     * Used by the publish queue when it is backed up, so an hour of samples is sent as
+     * one event with totals instead of being discarded.
+     */
+    static bool mergeJSON(const char* queued, const char* sample, char* buffer, size_t bufferSize);
 };
 
 /**
@@ -83,6 +96,16 @@ public:
      * @brief Reset sensor state and clear any cached data
      */
     virtual void reset() = 0;
+
+    /**
+     * @brief Apply the current sensorConfig settings to the sensor hardware
+     * 
+     * Called by setup() and when the configuration from the cloud changes, so a change takes
+     * effect without a reset. Sensors without settings don't need to override this.
+     * 
+     * @return true if the hardware has the configured settings
+     */
+    virtual bool applyConfig() { return true; }
 };
 
 // Implementation of SensorData::toJSON
@@ -110,4 +133,63 @@ inline bool SensorData::toJSON(char* buffer, size_t bufferSize) const {
     return writer.dataSize() > 0;
 }
 
+// Implementation of SensorData::mergeJSON
+inline bool SensorData::mergeJSON(const char* queued, const char* sample, char* buffer, size_t bufferSize) {
+    if (!queued || !sample || !buffer || bufferSize < 100) return false;
+
+    String type;
+    int timestamp = 0;
+    int samples = 0;
+    int faces = 0;
+    int gestures = 0;
+
+    // A summary has a "samples" count and totals; a single sample counts as one
+    const char* events[2] = { queued, sample };
+    for (const char* json : events) {
+        JSONValue obj = JSONValue::parseCopy(json);
+        if (!obj.isObject()) return false;
+
+        int eventSamples = 1;
+        int eventGestures = 0;
+        JSONObjectIterator iter(obj);
+        while (iter.next()) {
+            String name = (const char*)iter.name();
+            int value = iter.value().toInt();
+
+            if (name == "sensorType") {
+                if (type.length() == 0) type = (const char*)iter.value().toString();
+            } else if (name == "timestamp") {
+                if (timestamp == 0 || (value != 0 && value < timestamp)) timestamp = value;
+            } else if (name == "samples") {
+                eventSamples = value;
+            } else if (name == "facenumber") {
+                faces += value;
+            } else if (name == "gestures") {
+                eventGestures = value;
+            } else if (name == "gesturetype" && value > 0) {
+                eventGestures = 1;
+            }
+        }
+        samples += eventSamples;
+        gestures += eventGestures;
+    }
+
+    JSONBufferWriter writer(buffer, bufferSize - 1);
+    writer.beginObject();
+
+    writer.name("sensorType").value(type.c_str());
+    writer.name("timestamp").value(timestamp - (timestamp % 3600)); // Start of the hour
+    writer.name("period").value(3600);
+    writer.name("samples").value(samples);
+    writer.name("facenumber").value(faces);
+    writer.name("gestures").value(gestures);
+
+    writer.endObject();
+
+    if (writer.dataSize() >= bufferSize) return false;
+    buffer[writer.dataSize()] = 0;
+
+    return true;
+}
+
 #endif /* ISENSOR_H */
\ No newline at end of file
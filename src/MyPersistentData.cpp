@@ -1,5 +1,4 @@
 #include "Particle.h"
-#include "StorageHelperRK.h"
 #include "MyPersistentData.h"
 
 // *******************  SysStatus Storage Object **********************
@@ -27,10 +26,16 @@ sysStatusData::~sysStatusData() {
 
 void sysStatusData::setup() {
     sysStatus
+        .withDualSlot()
+        .withJournal(512)                                                  // Append small changes like lastReport to a journal instead of rewriting the file
+        .withWorker(StorageHelperRK::PersistentDataWorker::instance())   // Write the file from the worker thread
     //  .withLogData(true)
         .withSaveDelayMs(100)
         .load();
 
+    // An out of range field (closeTime = 24 from an older release) is set to its default, the rest are kept
+    sysStatus.repairFields();
+
     // Log.info("sizeof(SysData): %u", sizeof(SysData));
 }
 
@@ -40,18 +45,6 @@ void sysStatusData::loop() {
 
 bool sysStatusData::validate(size_t dataSize) {
     bool valid = PersistentDataFile::validate(dataSize);
-    if (valid) {
-        // If test1 < 0 or test1 > 100, then the data is invalid
-
-        if (sysStatus.get_openTime() < 0 || sysStatus.get_openTime() > 12) {
-            Log.info("data not valid open time =%d", sysStatus.get_openTime());
-            valid = false;
-        }
-        else if (sysStatus.get_lastConnection() < 0 || sysStatus.get_lastConnectionDuration() > 900) {
-            Log.info("data not valid last connection duration =%d", sysStatus.get_lastConnectionDuration());
-            valid = false;
-        }
-    }
     Log.info("sysStatus data is %s",(valid) ? "valid": "not valid");
     return valid;
 }
@@ -62,149 +55,9 @@ void sysStatusData::initialize() {
     const char message[26] = "Loading System Defaults";
     Log.info(message);
     if (Particle.connected()) Particle.publish("Mode",message, PRIVATE);
-    Log.info("Loading system defaults");
-    sysStatus.set_structuresVersion(1);
-    sysStatus.set_verboseMode(false);
-    sysStatus.set_lowBatteryMode(false);
-    sysStatus.set_solarPowerMode(true);
-    sysStatus.set_lowPowerMode(false);          // This should be changed to true once we have tested
-    sysStatus.set_timeZoneStr("ANAT-12");     // NZ Time
-    sysStatus.set_sensorType(1);                // PIR sensor
-    sysStatus.set_openTime(0);
-    sysStatus.set_closeTime(24);                                           // New standard with v20
-    sysStatus.set_lastConnectionDuration(0);                               // New measure
-}
-
-uint8_t sysStatusData::get_structuresVersion() const {
-    return getValue<uint8_t>(offsetof(SysData, structuresVersion));
-}
-
-void sysStatusData::set_structuresVersion(uint8_t value) {
-    setValue<uint8_t>(offsetof(SysData, structuresVersion), value);
-}
-
-bool sysStatusData::get_verboseMode() const {
-    return getValue<bool>(offsetof(SysData,verboseMode));
-}
-
-void sysStatusData::set_verboseMode(bool value) {
-    setValue<bool>(offsetof(SysData, verboseMode), value);
-}
-
-bool sysStatusData::get_solarPowerMode() const  {
-    return getValue<bool>(offsetof(SysData,solarPowerMode ));
-}
-void sysStatusData::set_solarPowerMode(bool value) {
-    setValue<bool>(offsetof(SysData, solarPowerMode), value);
-}
-
-bool sysStatusData::get_lowPowerMode() const  {
-    return getValue<bool>(offsetof(SysData,lowPowerMode ));
-}
-void sysStatusData::set_lowPowerMode(bool value) {
-    setValue<bool>(offsetof(SysData, lowPowerMode), value);
-}
-
-bool sysStatusData::get_lowBatteryMode() const  {
-    return getValue<bool>(offsetof(SysData, lowBatteryMode));
-}
-void sysStatusData::set_lowBatteryMode(bool value) {
-    setValue<bool>(offsetof(SysData, lowBatteryMode), value);
-}
-
-uint8_t sysStatusData::get_resetCount() const  {
-    return getValue<uint8_t>(offsetof(SysData,resetCount));
-}
-void sysStatusData::set_resetCount(uint8_t value) {
-    setValue<uint8_t>(offsetof(SysData, resetCount), value);
-}
-
-String sysStatusData::get_timeZoneStr() const {
-	String result;
-	getValueString(offsetof(SysData, timeZoneStr), sizeof(SysData::timeZoneStr), result);
-	return result;
-}
-
-bool sysStatusData::set_timeZoneStr(const char *str) {
-	return setValueString(offsetof(SysData, timeZoneStr), sizeof(SysData::timeZoneStr), str);
-}
-
-uint8_t sysStatusData::get_openTime() const  {
-    return getValue<uint8_t>(offsetof(SysData,openTime));
-}
-void sysStatusData::set_openTime(uint8_t value) {
-    setValue<uint8_t>(offsetof(SysData, openTime), value);
+    setFieldDefaults();                                                    // Defaults from SYS_DATA_FIELDS
 }
-
-uint8_t sysStatusData::get_closeTime() const  {
-    return getValue<uint8_t>(offsetof(SysData,closeTime));
-}
-void sysStatusData::set_closeTime(uint8_t value) {
-    setValue<uint8_t>(offsetof(SysData, closeTime), value);
-}
-
-time_t sysStatusData::get_lastReport() const  {
-    return getValue<time_t>(offsetof(SysData,lastReport));
-}
-void sysStatusData::set_lastReport(time_t value) {
-    setValue<time_t>(offsetof(SysData, lastReport), value);
-}
-
-time_t sysStatusData::get_lastConnection() const  {
-    return getValue<time_t>(offsetof(SysData,lastConnection));
-}
-void sysStatusData::set_lastConnection(time_t value) {
-    setValue<time_t>(offsetof(SysData, lastConnection), value);
-}
-
-uint16_t sysStatusData::get_lastConnectionDuration() const  {
-    return getValue<uint16_t>(offsetof(SysData,lastConnectionDuration));
-}
-void sysStatusData::set_lastConnectionDuration(uint16_t value) {
-    setValue<uint16_t>(offsetof(SysData, lastConnectionDuration), value);
-}
-
-time_t sysStatusData::get_lastHookResponse() const  {
-    return getValue<time_t>(offsetof(SysData,lastHookResponse));
-}
-void sysStatusData::set_lastHookResponse(time_t value) {
-    setValue<time_t>(offsetof(SysData, lastHookResponse), value);
-}
-
-uint8_t sysStatusData::get_sensorType() const  {
-    return getValue<uint8_t>(offsetof(SysData,sensorType));
-}
-void sysStatusData::set_sensorType(uint8_t value) {
-    setValue<uint8_t>(offsetof(SysData, sensorType), value);
-}
-
-bool sysStatusData::get_updatesPending() const  {
-    return getValue<bool>(offsetof(SysData,updatesPending));
-}
-void sysStatusData::set_updatesPending(bool value) {
-    setValue<bool>(offsetof(SysData,updatesPending), value);
-}  
-
-uint16_t sysStatusData::get_reportingInterval() const  {
-    return getValue<uint16_t>(offsetof(SysData,reportingInterval));
-}
-void sysStatusData::set_reportingInterval(uint16_t value) {
-    setValue<uint16_t>(offsetof(SysData, reportingInterval), value);
-}
-
-bool sysStatusData::get_disconnectedMode() const  {
-    return getValue<bool>(offsetof(SysData,disconnectedMode));
-}
-void sysStatusData::set_disconnectedMode(bool value) {
-    setValue<bool>(offsetof(SysData,disconnectedMode), value);
-}  
-
-bool sysStatusData::get_serialConnected() const  {
-    return getValue<bool>(offsetof(SysData,serialConnected));
-}
-void sysStatusData::set_serialConnected(bool value) {
-    setValue<bool>(offsetof(SysData,serialConnected), value);
-}  // End of sysStatusData class
+// End of sysStatusData class
 
 // *****************  Sensor Config Storage Object *******************
 // 
@@ -230,9 +83,13 @@ sensorConfigData::~sensorConfigData() {
 
 void sensorConfigData::setup() {
     sensorConfig
+        .withDualSlot()
+        .withWorker(StorageHelperRK::PersistentDataWorker::instance())
     //    .withLogData(true)
         .withSaveDelayMs(250)
         .load();
+
+    sensorConfig.repairFields();
 }
 
 void sensorConfigData::loop() {
@@ -241,47 +98,21 @@ void sensorConfigData::loop() {
 
 bool sensorConfigData::validate(size_t dataSize) {
     bool valid = PersistentDataFile::validate(dataSize);
-    if (valid) {
-        if (sensorConfig.get_faceThreshold() < 0 || sensorConfig.get_faceThreshold()  > 100) {
-            Log.info("Sensor config: faceThreshold not valid =%d %%" , sensorConfig.get_faceThreshold());
-            valid = false;
-        }
-    }
-    Log.info("Sensor config: faceThreshold is %s",(valid) ? "valid": "not valid");
+    Log.info("Sensor config is %s",(valid) ? "valid": "not valid");
     return valid;
 }
 
 void sensorConfigData::initialize() {
     PersistentDataFile::initialize();
 
-    Log.info("Current Data Initialized");
+    Log.info("Sensor Config Initialized");
+
+    setFieldDefaults();                                                    // Defaults from SENSOR_DATA_FIELDS
 
     // If you manually update fields here, be sure to update the hash
     updateHash();
 }
-
-uint16_t sensorConfigData::get_faceThreshold() const {
-    return getValue<uint16_t>(offsetof(SensorData, faceThreshold));
-}
-
-void sensorConfigData::set_faceThreshold(uint16_t value) {
-    setValue<uint16_t>(offsetof(SensorData, faceThreshold), value);
-}
-
-uint16_t sensorConfigData::get_gestureThreshold() const {
-    return getValue<uint16_t>(offsetof(SensorData, gestureThreshold));
-}
-
-void sensorConfigData::set_gestureThreshold(uint16_t value) {
-    setValue<uint16_t>(offsetof(SensorData, gestureThreshold), value);
-}
-uint16_t sensorConfigData::get_pollingRate() const {
-    return getValue<uint16_t>(offsetof(SensorData, pollingRate));
-}
-
-void sensorConfigData::set_pollingRate(uint16_t value) {
-    setValue<uint16_t>(offsetof(SensorData, pollingRate), value);
-}  // End of sensorConfigData class
+// End of sensorConfigData class
 
 
 
@@ -302,7 +133,8 @@ currentStatusData &currentStatusData::instance() {
     return *_instance;
 }
 
-currentStatusData::currentStatusData() : StorageHelperRK::PersistentDataFile(persistentDataPathCurrent, &currentData.currentHeader, sizeof(CurrentData), CURRENT_DATA_MAGIC, CURRENT_DATA_VERSION) {
+// Kept in the AB1805 RTC RAM, which survives sleep and reset, and checkpointed to /usr/current.dat
+currentStatusData::currentStatusData() : StorageHelperRK::PersistentDataAB1805(ab1805, 0, persistentDataPathCurrent, &currentData.currentHeader, sizeof(CurrentData), CURRENT_DATA_MAGIC, CURRENT_DATA_VERSION) {
 };
 
 currentStatusData::~currentStatusData() {
@@ -310,9 +142,14 @@ currentStatusData::~currentStatusData() {
 
 void currentStatusData::setup() {
     current
+        .withCheckpointIntervalMs(15 * 60 * 1000)               // Save to flash at most every 15 minutes
+        .withDualSlot()
+        .withWorker(StorageHelperRK::PersistentDataWorker::instance())
     //    .withLogData(true)
         .withSaveDelayMs(250)
         .load();
+
+    current.repairFields();                                     // An out of range count (faceNumber > 10) is reset to 0
 }
 
 void currentStatusData::loop() {
@@ -325,116 +162,21 @@ void currentStatusData::resetEverything() {                             // The d
 }
 
 bool currentStatusData::validate(size_t dataSize) {
-    bool valid = PersistentDataFile::validate(dataSize);
-    if (valid) {
-        if (current.get_faceNumber() < 0 || current.get_faceNumber()  > 10) {
-            Log.info("Current: faceNumber not valid =%d" , current.get_faceNumber());
-            current.set_faceNumber(0);                                  // Reset to 0 if invalid
-            current.set_gestureType(0);                                  // Reset gesture type to 0
-            current.set_gestureScore(0);
-            current.set_faceScore(0);
-            current.set_lastCountTime(Time.now());
-            valid = false;
-        }
-    }
-    Log.info("Current: faceNumber is %s",(valid) ? "valid": "not valid");
+    bool valid = PersistentDataAB1805::validate(dataSize);
+    Log.info("Current data is %s",(valid) ? "valid": "not valid");
     return valid;
 }
 
 void currentStatusData::initialize() {
-    PersistentDataFile::initialize();
+    PersistentDataAB1805::initialize();
 
     Log.info("Current Data Initialized");
 
+    setFieldDefaults();                                                    // Defaults from CURRENT_DATA_FIELDS
     currentStatusData::resetEverything();
 
     // If you manually update fields here, be sure to update the hash
     updateHash();
 }
 
-uint16_t currentStatusData::get_faceNumber() const {
-    return getValue<uint16_t>(offsetof(CurrentData, faceNumber));
-}
-
-void currentStatusData::set_faceNumber(uint16_t value) {
-    setValue<uint16_t>(offsetof(CurrentData, faceNumber), value);
-}
-
-uint16_t currentStatusData::get_faceScore() const {
-    return getValue<uint16_t>(offsetof(CurrentData, faceScore));
-}
-
-void currentStatusData::set_faceScore(uint16_t value) {
-    setValue<uint16_t>(offsetof(CurrentData, faceScore), value);
-}
-uint16_t currentStatusData::get_gestureType() const {
-    return getValue<uint16_t>(offsetof(CurrentData, gestureType));
-}
-
-void currentStatusData::set_gestureType(uint16_t value) {
-    setValue<uint16_t>(offsetof(CurrentData, gestureType), value);
-}
-
-uint16_t currentStatusData::get_gestureScore() const {
-    return getValue<uint16_t>(offsetof(CurrentData, gestureScore));
-}
-
-void currentStatusData::set_gestureScore(uint16_t value) {
-    setValue<uint16_t>(offsetof(CurrentData, gestureScore), value);
-}
-
-time_t currentStatusData::get_lastCountTime() const {
-    return getValue<time_t>(offsetof(CurrentData, lastCountTime));
-}
-
-void currentStatusData::set_lastCountTime(time_t value) {
-    setValue<time_t>(offsetof(CurrentData, lastCountTime), value);
-}
-
-float currentStatusData::get_internalTempC() const {
-    return getValue<float>(offsetof(CurrentData, internalTempC));
-}
-
-void currentStatusData::set_internalTempC(float value) {
-    setValue<float>(offsetof(CurrentData, internalTempC), value);
-}
-
-float currentStatusData::get_externalTempC() const {
-    return getValue<float>(offsetof(CurrentData, externalTempC));
-}
-
-void currentStatusData::set_externalTempC(float value) {
-    setValue<float>(offsetof(CurrentData, externalTempC), value);
-}
-
-int8_t currentStatusData::get_alertCode() const {
-    return getValue<int8_t>(offsetof(CurrentData, alertCode));
-}
-
-void currentStatusData::set_alertCode(int8_t value) {
-    setValue<int8_t>(offsetof(CurrentData, alertCode), value);
-}
-
-time_t currentStatusData::get_lastAlertTime() const {
-    return getValue<int8_t>(offsetof(CurrentData,lastAlertTime));
-}
-
-void currentStatusData::set_lastAlertTime(time_t value) {
-    setValue<time_t>(offsetof(CurrentData,lastAlertTime),value);
-}
-
-float currentStatusData::get_stateOfCharge() const  {
-    return getValue<float>(offsetof(CurrentData,stateOfCharge));
-}
-void currentStatusData::set_stateOfCharge(float value) {
-    setValue<float>(offsetof(CurrentData, stateOfCharge), value);
-}
-
-uint8_t currentStatusData::get_batteryState() const  {
-    return getValue<uint8_t>(offsetof(CurrentData, batteryState));
-}
-void currentStatusData::set_batteryState(uint8_t value) {
-    setValue<uint8_t>(offsetof(CurrentData, batteryState), value);
-}
-
 // End of currentStatusData class
\ No newline at end of file
@@ -2,10 +2,12 @@
 #define __MYPERSISTENTDATA_H
 
 #include "Particle.h"
+#include "AB1805_RK.h"          // Must be before StorageHelperRK.h to enable PersistentDataAB1805
 #include "StorageHelperRK.h"
 
 //Define external class instances. These are typically declared public in the main .CPP. I wonder if we can only declare it here?
 // extern MB85RC64 fram;
+extern AB1805 ab1805;
 
 //Macros(#define) to swap out during pre-processing (use sparingly). This is typically used outside of this .H and .CPP file within the main .CPP file or other .CPP files that reference this header file. 
 // This way you can do "data.setup()" instead of "MyPersistentData::instance().setup()" as an example
@@ -23,10 +25,112 @@
  * MyPersistentData::instance().loop();
  */
 
+// *******************  Declarative Field Tables **********************
+//
+// Each storage object lists its fields exactly once, in storage order, in a table macro
+// that takes two macros:
+//
+//   FIELD(type, name, default, min, max)   a scalar value, valid when min <= value <= max
+//   STRING(name, size, default)            a null terminated string in a char[size]
+//
+// PERSISTENT_DATA_STRUCT expands a table into the fields of the data structure and
+// PERSISTENT_DATA_METHODS expands it into the get_name() / set_name() accessors,
+// repairFields(), setFieldDefaults() and writeJSON(). The accessors are inline and go
+// through getValue / setValue, so transactions and dirty ranges work the same as for
+// hand-written accessors. Once a field has been added you cannot insert fields, remove
+// fields, or change the size of a field (add new fields at the end), as that would
+// change the layout of the saved data. Tightening a range is safe: after load, a saved
+// value outside the new range is set to its default and the other fields are kept.
+// ********************************************************************
+
+#define PERSISTENT_FIELD_MEMBER(type, field, def, min, max)      type field;
+#define PERSISTENT_STRING_MEMBER(field, size, def)               char field[size];
+
+#define PERSISTENT_FIELD_ACCESSORS(type, field, def, min, max) \
+	type get_##field() const { return getValue<type>(offsetof(FieldData, field)); } \
+	void set_##field(type value) { setValue<type>(offsetof(FieldData, field), value); }
+#define PERSISTENT_STRING_ACCESSORS(field, size, def) \
+	String get_##field() const { String result; getValueString(offsetof(FieldData, field), size, result); return result; } \
+	bool set_##field(const char *str) { return setValueString(offsetof(FieldData, field), size, str); }
+
+#define PERSISTENT_FIELD_REPAIR(type, field, def, min, max) \
+	if (!persistentFieldInRange(get_##field(), min, max)) { \
+		Log.info("data not valid %s=%.0f (must be %.0f to %.0f), set to %g", #field, (double)get_##field(), (double)(min), (double)(max), (double)(def)); \
+		set_##field(def); \
+		repaired++; \
+	}
+#define PERSISTENT_STRING_REPAIR(field, size, def) \
+	if (!memchr((const uint8_t *)savedDataHeader + offsetof(FieldData, field), 0, size)) { \
+		Log.info("data not valid %s is not terminated, set to \"%s\"", #field, def); \
+		set_##field(def); \
+		repaired++; \
+	}
+
+#define PERSISTENT_FIELD_DEFAULT(type, field, def, min, max)     set_##field(def);
+#define PERSISTENT_STRING_DEFAULT(field, size, def)              set_##field(def);
+
+#define PERSISTENT_FIELD_JSON(type, field, def, min, max)        persistentFieldJSON(writer.name(#field), get_##field());
+#define PERSISTENT_STRING_JSON(field, size, def)                 writer.name(#field).value(get_##field());
+
+#define PERSISTENT_DATA_STRUCT(TABLE) \
+	TABLE(PERSISTENT_FIELD_MEMBER, PERSISTENT_STRING_MEMBER)
+
+// repairFields() sets each field that is out of its range to its default, keeping the other fields, and
+// returns the number of fields set. setFieldDefaults() sets every field to its default. Both are one
+// transaction. writeJSON() writes every field as a key of the open JSON object.
+#define PERSISTENT_DATA_METHODS(TABLE) \
+	TABLE(PERSISTENT_FIELD_ACCESSORS, PERSISTENT_STRING_ACCESSORS) \
+	int repairFields() { \
+		StorageHelperRK::PersistentDataBase::Transaction transaction(*this); \
+		int repaired = 0; \
+		TABLE(PERSISTENT_FIELD_REPAIR, PERSISTENT_STRING_REPAIR) \
+		return repaired; \
+	} \
+	void setFieldDefaults() { \
+		StorageHelperRK::PersistentDataBase::Transaction transaction(*this); \
+		TABLE(PERSISTENT_FIELD_DEFAULT, PERSISTENT_STRING_DEFAULT) \
+	} \
+	void writeJSON(JSONWriter &writer) const { \
+		TABLE(PERSISTENT_FIELD_JSON, PERSISTENT_STRING_JSON) \
+	}
+
+template<typename T>
+inline bool persistentFieldInRange(T value, double min, double max) {
+	// Also false for a float that is NaN
+	return (double)value >= min && (double)value <= max;
+}
+
+// JSONWriter has no overload for every integer type (time_t in particular), so pick one here
+template<typename T>
+inline void persistentFieldJSON(JSONWriter &writer, T value) { writer.value(value); }
+inline void persistentFieldJSON(JSONWriter &writer, long long value) { writer.value((long)value); }
+inline void persistentFieldJSON(JSONWriter &writer, float value) { writer.value((double)value); }
+
 // *******************  SysStatus Storage Object **********************
 //
 // ********************************************************************
 
+// SysData fields, in storage order: FIELD(type, name, default, min, max) or STRING(name, size, default)
+#define SYS_DATA_FIELDS(FIELD, STRING) \
+	FIELD(uint8_t,  structuresVersion,      1,      0, 255)         /* Version of the data structures (system and data) */ \
+	FIELD(bool,     verboseMode,            false,  0, 1)           /* Turns on extra messaging */ \
+	FIELD(bool,     solarPowerMode,         true,   0, 1)           /* Powered by a solar panel or utility power */ \
+	FIELD(bool,     lowPowerMode,           false,  0, 1)           /* Does the device need to run disconnected to save battery */ \
+	FIELD(bool,     lowBatteryMode,         false,  0, 1)           /* Is the battery level so low that we can no longer connect */ \
+	FIELD(uint8_t,  resetCount,             0,      0, 255)         /* reset count of device (0-256) */ \
+	STRING(         timeZoneStr, 39,        "ANAT-12")              /* POSIX timezone - https://developer.ibm.com/technologies/systems/articles/au-aix-posix/ (NZ Time) */ \
+	FIELD(uint8_t,  openTime,               0,      0, 23)          /* Hour the park opens (0-23) */ \
+	FIELD(uint8_t,  closeTime,              23,     0, 23)          /* Hour the park closes (0-23), open through the end of this hour */ \
+	FIELD(time_t,   lastReport,             0,      0, INT32_MAX)   /* The last time we sent a webhook to the queue */ \
+	FIELD(time_t,   lastConnection,         0,      0, INT32_MAX)   /* Last time we successfully connected to Particle */ \
+	FIELD(time_t,   lastHookResponse,       0,      0, INT32_MAX)   /* Last time we got a valid Webhook response */ \
+	FIELD(uint16_t, lastConnectionDuration, 0,      0, 900)         /* How long - in seconds - did it take to last connect to the Particle cloud */ \
+	FIELD(uint8_t,  sensorType,             1,      0, 255)         /* What is the sensor type - 0-Pressure Sensor, 1-PIR Sensor */ \
+	FIELD(bool,     updatesPending,         false,  0, 1)           /* Has there been a change to the sysStatus that we need to effect */ \
+	FIELD(uint16_t, reportingInterval,      3600,   0, 65535)       /* How often do we report in to the Particle cloud - in seconds */ \
+	FIELD(bool,     disconnectedMode,       false,  0, 1)           /* Prevents the device from trying to connect to the Particle cloud - for development and testing */ \
+	FIELD(bool,     serialConnected,        false,  0, 1)           /* Wait for a serial connection before starting the device */
+
 class sysStatusData : public StorageHelperRK::PersistentDataFile {
 public:
 
@@ -81,116 +185,25 @@ public:
 	public:
 		// This structure must always begin with the header (16 bytes)
 		StorageHelperRK::PersistentDataBase::SavedDataHeader sysHeader;
-		// Your fields go here. Once you've added a field you cannot add fields
+		// The fields are in SYS_DATA_FIELDS. Once you've added a field you cannot add fields
 		// (except at the end), insert fields, remove fields, change size of a field.
 		// Doing so will cause the data to be corrupted!
-		uint8_t structuresVersion;                        // Version of the data structures (system and data)
-		bool verboseMode;                                 // Turns on extra messaging
-		bool solarPowerMode;                              // Powered by a solar panel or utility power
-  		bool lowPowerMode;                                // Does the device need to run disconnected to save battery
-		bool lowBatteryMode;                              // Is the battery level so low that we can no longer connect
-		uint8_t resetCount;                               // reset count of device (0-256)
-		char timeZoneStr[39];							  // String for the timezone - https://developer.ibm.com/technologies/systems/articles/au-aix-posix/
-		uint8_t openTime;                                 // Hour the park opens (0-23)
-		uint8_t closeTime;                                // Hour the park closes (0-23)
-		time_t lastReport;								  // The last time we sent a webhook to the queue
-		time_t lastConnection;                     		  // Last time we successfully connected to Particle
-		time_t lastHookResponse;                   		  // Last time we got a valid Webhook response
-		uint16_t lastConnectionDuration;                  // How long - in seconds - did it take to last connect to the Particle cloud
-		uint8_t sensorType;                               // What is the sensor type - 0-Pressure Sensor, 1-PIR Sensor
-		bool updatesPending;                              // Has there been a change to the sysStatus that we need to effect 
-		uint16_t reportingInterval;                       // How often do we report in to the Particle cloud - in seconds
-		bool disconnectedMode;                            // Are we in disconnected mode - this is used to prevent the device from trying to connect to the Particle cloud - for Development and testing purposes
-		bool serialConnected;							  // Is the serial port connected - used to determine if we should wait for a serial connection before starting the device
-
+		PERSISTENT_DATA_STRUCT(SYS_DATA_FIELDS)
 	};
+	typedef SysData FieldData;
 
 	SysData sysData;
 
 	// 	******************* Get and Set Functions for each variable in the storage object ***********
     
 	/**
-	 * @brief For the Get functions, used to retrieve the value of the variable
-	 * 
-	 * @details Specific to the location in the object and the type of the variable
-	 * 
-	 * @param Nothing needed
-	 * 
-	 * @returns The value of the variable in the corret type
+	 * @brief get_name() and set_name(value) for each field, generated from SYS_DATA_FIELDS
 	 * 
+	 * @details Strings are returned as String and set from a const char *, returning false 
+	 * if the string was truncated to fit. Also generates repairFields(), setFieldDefaults() 
+	 * and writeJSON(JSONWriter &).
 	 */
-
-	/**
-	 * @brief For the Set functions, used to set the value of the variable
-	 * 
-	 * @details Specific to the location in the object and the type of the variable
-	 * 
-	 * @param Value to set the variable - correct type - for Strings they are truncated if too long
-	 * 
-	 * @returns None needed
-	 * 
-	 */
-
-	uint8_t get_structuresVersion() const ;
-	void set_structuresVersion(uint8_t value);
-
-	bool get_verboseMode() const;
-	void set_verboseMode(bool value);
-
-	bool get_solarPowerMode() const;
-	void set_solarPowerMode(bool value);
-
-	bool get_lowPowerMode() const;
-	void set_lowPowerMode(bool value);
-
-	bool get_lowBatteryMode() const;
-	void set_lowBatteryMode(bool value);
-
-	uint8_t get_resetCount() const;
-	void set_resetCount(uint8_t value);
-
-	String get_timeZoneStr() const;
-	bool set_timeZoneStr(const char *str);
-
-	uint8_t get_openTime() const;
-	void set_openTime(uint8_t value);
-
-	uint8_t get_closeTime() const;
-	void set_closeTime(uint8_t value);
-
-	time_t get_lastReport() const;
-	void set_lastReport(time_t value);
-
-	time_t get_lastConnection() const;
-	void set_lastConnection(time_t value);
-
-	uint16_t get_lastConnectionDuration() const;
-	void set_lastConnectionDuration(uint16_t value);
-
-	time_t get_lastHookResponse() const;
-	void set_lastHookResponse(time_t value);
-
-	uint8_t get_alertCodeNode() const;
-	void set_alertCodeNode(uint8_t value);
-
-	time_t get_alertTimestampNode() const;
-	void set_alertTimestampNode(time_t value);
-
-	uint8_t get_sensorType() const;
-	void set_sensorType(uint8_t value);
-
-	bool get_updatesPending() const;
-	void set_updatesPending(bool value);
-
-	uint16_t get_reportingInterval() const;
-	void set_reportingInterval(uint16_t value);
-
-	bool get_disconnectedMode() const;
-	void set_disconnectedMode(bool value);
-
-	bool get_serialConnected() const;
-	void set_serialConnected(bool value);
-
+	PERSISTENT_DATA_METHODS(SYS_DATA_FIELDS)
 
 	//Members here are internal only and therefore protected
 protected:
@@ -233,6 +246,12 @@ protected:
 //
 // ********************************************************************
 
+// SensorData fields, in storage order: FIELD(type, name, default, min, max)
+#define SENSOR_DATA_FIELDS(FIELD, STRING) \
+	FIELD(uint16_t, faceThreshold,          60,     0, 100)         /* Confidence threshold for face detection (%) */ \
+	FIELD(uint16_t, gestureThreshold,       60,     0, 100)         /* Confidence threshold for gesture detection (%) */ \
+	FIELD(uint16_t, pollingRate,            0,      0, 3600)        /* How often to poll the sensor in seconds - a value of zero means no polling */
+
 class sensorConfigData : public StorageHelperRK::PersistentDataFile {
 public:
 
@@ -284,48 +303,20 @@ public:
 	public:
 		// This structure must always begin with the header (16 bytes)
 		StorageHelperRK::PersistentDataBase::SavedDataHeader sensorHeader;
-		// Your fields go here. Once you've added a field you cannot add fields
+		// The fields are in SENSOR_DATA_FIELDS. Once you've added a field you cannot add fields
 		// (except at the end), insert fields, remove fields, change size of a field.
 		// Doing so will cause the data to be corrupted!
-		// You may want to keep a version number in your data.
-		uint16_t faceThreshold;                         // Configdence threshold for face detection
-		uint16_t gestureThreshold;                      // faceNumber to the object in cm
-		uint16_t pollingRate;                           // How often to poll the sensor in seconds - a value of zero means no polling
+		PERSISTENT_DATA_STRUCT(SENSOR_DATA_FIELDS)
 	};
+	typedef SensorData FieldData;
 	SensorData sensorData;
 
 	// 	******************* Get and Set Functions for each variable in the storage object ***********
     
 	/**
-	 * @brief For the Get functions, used to retrieve the value of the variable
-	 * 
-	 * @details Specific to the location in the object and the type of the variable
-	 * 
-	 * @param Nothing needed
-	 * 
-	 * @returns The value of the variable in the corret type
-	 * 
+	 * @brief get_name() and set_name(value) for each field, generated from SENSOR_DATA_FIELDS
 	 */
-
-	/**
-	 * @brief For the Set functions, used to set the value of the variable
-	 * 
-	 * @details Specific to the location in the object and the type of the variable
-	 * 
-	 * @param Value to set the variable - correct type - for Strings they are truncated if too long
-	 * 
-	 * @returns None needed
-	 * 
-	 */
-
-	uint16_t get_faceThreshold() const;
-	void set_faceThreshold(uint16_t value);
-
-	uint16_t get_gestureThreshold() const;
-	void set_gestureThreshold(uint16_t value);
-
-	uint16_t get_pollingRate() const;
-	void set_pollingRate(uint16_t value);
+	PERSISTENT_DATA_METHODS(SENSOR_DATA_FIELDS)
 
 		//Members here are internal only and therefore protected
 protected:
@@ -368,7 +359,21 @@ protected:
 //
 // ********************************************************************
 
-class currentStatusData : public StorageHelperRK::PersistentDataFile {
+// CurrentData fields, in storage order: FIELD(type, name, default, min, max)
+#define CURRENT_DATA_FIELDS(FIELD, STRING) \
+	FIELD(uint16_t, faceNumber,             0,      0, 10)          /* number of faces counted */ \
+	FIELD(uint16_t, faceScore,              0,      0, 65535)       /* Score of the face counted */ \
+	FIELD(uint16_t, gestureType,            0,      0, 65535)       /* Gesture observed */ \
+	FIELD(uint16_t, gestureScore,           0,      0, 65535)       /* Score of the gesture observed */ \
+	FIELD(time_t,   lastCountTime,          0,      0, INT32_MAX)   /* Last time a count was made */ \
+	FIELD(float,    internalTempC,          0,      -100, 200)      /* Enclosure temperature in degrees C */ \
+	FIELD(float,    externalTempC,          0,      -100, 200)      /* Temp Sensor at the ultrasonic device */ \
+	FIELD(uint8_t,  alertCode,              0,      0, 255)         /* Current Alert Code */ \
+	FIELD(time_t,   lastAlertTime,          0,      0, INT32_MAX)   /* When the alert code was set */ \
+	FIELD(float,    stateOfCharge,          0,      -1, 100)        /* Battery charge level, -1 if the fuel gauge could not be read */ \
+	FIELD(uint8_t,  batteryState,           0,      0, 255)         /* Stores the current battery state */
+
+class currentStatusData : public StorageHelperRK::PersistentDataAB1805 {
 public:
 
     /**
@@ -424,80 +429,20 @@ public:
 	public:
 		// This structure must always begin with the header (16 bytes)
 		StorageHelperRK::PersistentDataBase::SavedDataHeader currentHeader;
-		// Your fields go here. Once you've added a field you cannot add fields
+		// The fields are in CURRENT_DATA_FIELDS. Once you've added a field you cannot add fields
 		// (except at the end), insert fields, remove fields, change size of a field.
 		// Doing so will cause the data to be corrupted!
-		// You may want to keep a version number in your data.
-		uint16_t faceNumber;                            // number of faces counted
-		uint16_t faceScore;							  	// Score of the face counted
-		uint16_t gestureType;                           // Gesure observed
-		uint16_t gestureScore;                          // faceNumber to the object in cm
-		time_t lastCountTime;							// Last time a count was made
-		float internalTempC;                            // Enclosure temperature in degrees C
-		float externalTempC;							// Temp Sensor at the ultrasonic device
-		uint8_t alertCode;								// Current Alert Code
-		time_t lastAlertTime;
-		float stateOfCharge;                            // Battery charge level
-		uint8_t batteryState;                           // Stores the current battery state
+		PERSISTENT_DATA_STRUCT(CURRENT_DATA_FIELDS)
 	};
+	typedef CurrentData FieldData;
 	CurrentData currentData;
 
 	// 	******************* Get and Set Functions for each variable in the storage object ***********
     
 	/**
-	 * @brief For the Get functions, used to retrieve the value of the variable
-	 * 
-	 * @details Specific to the location in the object and the type of the variable
-	 * 
-	 * @param Nothing needed
-	 * 
-	 * @returns The value of the variable in the corret type
-	 * 
-	 */
-
-	/**
-	 * @brief For the Set functions, used to set the value of the variable
-	 * 
-	 * @details Specific to the location in the object and the type of the variable
-	 * 
-	 * @param Value to set the variable - correct type - for Strings they are truncated if too long
-	 * 
-	 * @returns None needed
-	 * 
+	 * @brief get_name() and set_name(value) for each field, generated from CURRENT_DATA_FIELDS
 	 */
-
-	uint16_t get_faceNumber() const;
-	void set_faceNumber(uint16_t value);
-
-	uint16_t get_faceScore() const;
-	void set_faceScore(uint16_t value);
-
-	uint16_t get_gestureType() const;
-	void set_gestureType(uint16_t value);
-
-	uint16_t get_gestureScore() const;
-	void set_gestureScore(uint16_t value);
-
-	time_t get_lastCountTime() const;
-	void set_lastCountTime(time_t value);
-
-	float get_internalTempC() const ;
-	void set_internalTempC(float value);
-
-	float get_externalTempC() const ;
-	void set_externalTempC(float value);
-
-	int8_t get_alertCode() const;
-	void set_alertCode(int8_t value);
-
-	time_t get_lastAlertTime() const;
-	void set_lastAlertTime(time_t value);
-
-	float get_stateOfCharge() const;
-	void set_stateOfCharge(float value);
-
-	uint8_t get_batteryState() const;
-	void set_batteryState(uint8_t value);
+	PERSISTENT_DATA_METHODS(CURRENT_DATA_FIELDS)
 
 
 		//Members here are internal only and therefore protected
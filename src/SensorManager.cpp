@@ -83,6 +83,14 @@ bool SensorManager::isSensorReady() const {
     return _sensor && _sensor->isReady();
 }
 
+// Pushes a changed sensorConfig to the sensor hardware, without a reset
+bool SensorManager::applySensorConfig() {
+    if (!isSensorReady()) {
+        return true;                                   // Nothing to update; the sensor's setup() applies the configuration
+    }
+    return _sensor->applyConfig();
+}
+
 float SensorManager::tmp36TemperatureC(int adcValue) {
   // Analog inputs have values from 0-4095, or
   // 12-bit precision. 0 = 0V, 4095 = 3.3V, 0.0008 volts (0.8 mV) per unit
@@ -31,6 +31,7 @@ public:
     void setSensor(ISensor* sensor);
     SensorData getSensorData() const;
     bool isSensorReady() const;
+    bool applySensorConfig();
     
     // Utility functions
     float tmp36TemperatureC(int adcValue);
@@ -103,13 +103,26 @@ void setup() {
 
   sysStatus.setup();    // Initialize persistent storage
   sensorConfig.setup(); // Initialize the sensor configuration
-  current.setup();      // Initialize the current status data
 
-  PublishQueuePosix::instance().setup(); // Initialize the Publish Queue
+  PublishQueuePosix::instance()
+      .withStatsVariable("queueStats")           // Queue depth, age and latency
+      .withStatsEvent("queue-stats", 3600000UL)  // Hourly backlog trend report
+      .withMaxInFlight(4)                        // Drain the backlog without waiting on each cellular round trip
+      .withReadAhead(2)                          // Read queued events while waiting for acknowledgements
+      .withEventPool(6, 9, 2)                    // sensor-data events (~185 bytes) are medium: 2 RAM queue + 4 in flight + 2 read ahead + 1 (de)compression buffer
+      .withCompressionDictionary("sensor-data",  // Store only the values of queued sensor-data JSON in flash
+          "{\"sensorType\":\"GestureFace\",\"timestamp\":1760000000,\"gesturetype\":1,\"gesturescore\":80,\"facenumber\":1,\"facescore\":90}")
+      .withSummaryPolicy(75, 25,                  // Backed up: send hourly totals instead of dropping samples
+          [](const char *eventName, const char *queuedData, const char *newData, char *mergedData, size_t mergedDataSize) {
+            return SensorData::mergeJSON(queuedData, newData, mergedData, mergedDataSize);
+          })
+      .setup(); // Initialize the Publish Queue
 
   ab1805.withFOUT(D8).setup();                 // Initialize AB1805 RTC
   ab1805.setWDT(AB1805::WATCHDOG_MAX_SECONDS); // Enable watchdog
 
+  current.setup(); // Initialize the current status data (stored in the AB1805 RAM, so after ab1805.setup())
+
   // Particle_Functions::instance().connectToCloud(); // Connect to the Particle
   // cloud
 
@@ -339,7 +352,10 @@ void loop() { // The main loops runs forever and checks the sensor every
                                                         // string and publish
       Log.info(data);
       if (sysStatus.get_verboseMode())
-        Particle.publish("Cellular", data, PRIVATE);
+        PublishQueuePosix::instance().publish(
+            "Cellular", data,
+            PublishQueuePosix::PublishOptions().withSupersedeKey("Cellular"),
+            PRIVATE); // Only the latest connection report matters
       state = IDLE_STATE; // so, if we are connecting to report - next step is
                           // response wait - otherwise IDLE
     } else if (sysStatus.get_lastConnectionDuration() >
@@ -357,8 +373,14 @@ void loop() { // The main loops runs forever and checks the sensor every
           Log.info("Error state - resetting");
           resetTimer = millis();  // Set on state entry
       }
-      if (millis() - resetTimer > resetWait)
+      if (millis() - resetTimer > resetWait) {
+          // Saves are written by the persistent data worker thread; let them finish first
+          sysStatus.flush(true);
+          sysStatus.waitForSave();
+          current.flush(true);
+          current.waitForSave();
           System.reset();
+      }
   } break;
   }
 
@@ -402,7 +424,12 @@ void publishData() {
     
     char str[256];
     if (data.toJSON(str, sizeof(str))) {
-        PublishQueuePosix::instance().publish("sensor-data", str, PRIVATE);
+        // Samples from the same hour are merged into a summary if the queue is backed up, and
+        // samples still queued after two days are dropped rather than sent
+        char mergeKey[32];
+        snprintf(mergeKey, sizeof(mergeKey), "sensor-data-%ld", (long)(data.timestamp / 3600));
+        PublishQueuePosix::instance().publish("sensor-data", str, 
+            PublishQueuePosix::PublishOptions().withPriority(PublishQueuePosix::PRIORITY_BULK).withMergeKey(mergeKey).withTtl(2 * 86400), PRIVATE);
         Log.info("Publishing data: %s", str);
     } else {
         Log.warn("Failed to create JSON for sensor data");